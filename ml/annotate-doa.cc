@@ -0,0 +1,318 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Annotate a long recording with a DOA timeline, offline, on all cores.
+//
+// The recording is split into segments, which are processed in parallel
+// by worker threads. Each segment starts from the window of frames before
+// it, so the estimates are exactly those of a single stream over the whole
+// recording, as with stream-model. Within a segment, the leading layers of
+// the model slide hop by hop, while the rest of it runs on batches of
+// windows, which reads its weights once per batch instead of per window.
+//
+// The class probabilities are smoothed over time with an exponential
+// moving average (-t), as a simple tracker. The smoothing runs in order on
+// the writing thread, so its state carries over the segment boundaries.
+//
+// With -o, the timeline is written as CSV:
+//    time_s,class,prob,smoothed_class,smoothed_prob
+// where the time is that of the end of each window. Without -o nor -O,
+// it goes to the standard output. With -O, a compact binary timeline is
+// written: an annotate_header_t, the class names, each followed by a new
+// line, and then an annotate_record_t for each window.
+//
+// Example invocations:
+//    $ ./annotate-doa -m model.nn -o meeting.csv meeting.raw
+//    $ ./annotate-doa -m model.nn -H 240 -t 0.5 -O meeting.doa meeting.flac
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "nn-engine.h"
+#include "raw-audio.h"
+
+// Magic of the binary timeline.
+const char ANNOTATE_MAGIC[8] = { 'D', 'O', 'A', 'T', 'L', 0, 0, 0 };
+
+struct annotate_header_t {
+	char magic[8];		// "DOATL\0\0\0"
+	uint32_t sample_rate;
+	uint32_t hop;		// In frames.
+	uint32_t window;	// In frames.
+	uint32_t nclasses;
+	uint32_t names_size;	// In bytes, of the class names which follow.
+	uint32_t reserved;
+	uint64_t nwindows;	// Window k ends at frame (k + 1) * hop.
+};
+static_assert(sizeof(annotate_header_t) == 40);
+
+struct annotate_record_t {
+	uint16_t cls;
+	uint16_t smoothed_cls;
+	float prob;
+	float smoothed_prob;
+};
+static_assert(sizeof(annotate_record_t) == 12);
+
+struct annotate_opts_t {
+	size_t hop = 64;		// In frames.
+	unsigned nthreads = std::max(1u, std::thread::hardware_concurrency());
+	double segment_s = 60;
+	size_t batch = 32;		// Windows per inference.
+	double time_constant_s = 0.2;	// Of the smoothing, 0 for none.
+};
+
+// A part of the recording, and the model outputs for its windows.
+struct segment_t {
+	size_t first, nwindows;
+	std::vector<float> out;		// nwindows x nclasses.
+	bool done = false;
+};
+
+class annotator_t {
+public:
+	annotator_t(std::shared_ptr<const nn_model_t> _model, const std::string &_path, const annotate_opts_t &_o)
+		: model(_model), path(_path), o(_o), window(_model->input_size / NCHANNELS),
+		  nclasses(_model->output_size())
+	{
+		const std::string err = nn_stream_t::check(*model, o.hop, NCHANNELS);
+		if (!err.empty())
+			fatal(err);
+
+		// Each worker opens the recording, since the readers of packed
+		// and FLAC recordings are not thread-safe. They decode it as
+		// they go, and the workers are the parallelism.
+		raw_audio_t::decoder_threads = 0;
+		nwindows = raw_audio_t::open(path)->len / NCHANNELS / o.hop;
+		const size_t seg_windows = std::max<size_t>(1, std::lround(o.segment_s * SAMPLES_PER_SECOND / o.hop));
+		for (size_t k = 0; k < nwindows; k += seg_windows)
+			segments.push_back({k, std::min(seg_windows, nwindows - k), {}, false});
+	}
+
+	// Process the recording, and pass the windows of each segment to the
+	// callback, in order, with their class probabilities.
+	template <typename F>
+	void run(F &&on_segment)
+	{
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < o.nthreads; t++)
+			workers.emplace_back([this]() { work(); });
+
+		for (size_t s = 0; s < segments.size(); s++) {
+			auto &seg = segments[s];
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				done_cv.wait(lock, [&]() { return seg.done; });
+			}
+			on_segment(seg);
+			std::vector<float>().swap(seg.out);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				nwritten = s + 1;
+			}
+			written_cv.notify_all();
+		}
+		for (auto &w : workers)
+			w.join();
+	}
+
+	const std::shared_ptr<const nn_model_t> model;
+	const std::string path;
+	const annotate_opts_t o;
+	const size_t window;	// In frames.
+	const size_t nclasses;
+	size_t nwindows;
+	std::vector<segment_t> segments;
+
+private:
+	std::atomic<size_t> next {0};
+	std::mutex mutex;
+	std::condition_variable done_cv, written_cv;
+	size_t nwritten = 0;
+
+	// Worker thread.
+	void work()
+	{
+		auto m = raw_audio_t::open(path);
+		nn_stream_t stream(model, o.hop, NCHANNELS);
+		nn_workspace_t ws;
+		std::vector<int32_t> history(window * NCHANNELS);
+		std::vector<float> batch(o.batch * stream.tail_size());
+		const off_t hop_len = o.hop * NCHANNELS;
+		// Bounds the memory held by the outputs waiting to be written.
+		const size_t max_ahead = 2 * o.nthreads;
+
+		for (size_t s; (s = next.fetch_add(1)) < segments.size(); ) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				written_cv.wait(lock, [&]() { return s < nwritten + max_ahead; });
+			}
+			auto &seg = segments[s];
+			seg.out.resize(seg.nwindows * nclasses);
+
+			// The window before the segment, zeros before the start.
+			const off_t start = seg.first * hop_len;
+			const off_t nhistory = std::min<off_t>(start, history.size());
+			std::fill(history.begin(), history.end() - nhistory, 0);
+			std::copy_n(m->samples(start - nhistory, nhistory), nhistory, history.end() - nhistory);
+			stream.prime(history.data());
+
+			for (size_t k = 0; k < seg.nwindows; k += o.batch) {
+				const size_t n = std::min(o.batch, seg.nwindows - k);
+				for (size_t b = 0; b < n; b++) {
+					stream.slide(m->samples(start + (k + b) * hop_len, hop_len));
+					std::copy_n(stream.tail_input(), stream.tail_size(), &batch[b * stream.tail_size()]);
+				}
+				model->predict_batch_from(stream.tail_layer(), batch.data(), &seg.out[k * nclasses], n, ws);
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				seg.done = true;
+			}
+			done_cv.notify_one();
+		}
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	const std::string usage =
+		"Usage: annotate-doa -m MODEL [-H HOP] [-j THREADS] [-L SEGMENT_S] [-B BATCH]\n"
+		"                    [-t TIME_CONSTANT_S] [-o CSV_FILE] [-O BINARY_FILE] RECORDING";
+	std::string model_path, csv_path, bin_path;
+	annotate_opts_t o;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:H:j:L:B:t:o:O:")) != -1) {
+		switch (opt) {
+		case 'm':
+			model_path = optarg;
+			break;
+		case 'H':
+			o.hop = std::atol(optarg);
+			break;
+		case 'j':
+			o.nthreads = std::atoi(optarg);
+			break;
+		case 'L':
+			o.segment_s = std::atof(optarg);
+			break;
+		case 'B':
+			o.batch = std::atol(optarg);
+			break;
+		case 't':
+			o.time_constant_s = std::atof(optarg);
+			break;
+		case 'o':
+			csv_path = optarg;
+			break;
+		case 'O':
+			bin_path = optarg;
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind != 1 || model_path.empty() || !o.nthreads || o.segment_s <= 0 || !o.batch ||
+	    o.time_constant_s < 0)
+		fatal(usage);
+
+	const auto t0 = std::chrono::steady_clock::now();
+	annotator_t a(nn_model_t::load(model_path), argv[optind], o);
+	if (a.nwindows == 0)
+		fatal("recording is shorter than one hop");
+	if (a.nclasses > UINT16_MAX)
+		fatal("too many classes for the timeline");
+	const auto &names = a.model->class_names;
+
+	std::ofstream csv_file, bin;
+	std::ostream *csv = nullptr;
+	if (!csv_path.empty()) {
+		csv_file.open(csv_path);
+		if (!csv_file)
+			fatal("failed to open \"" + csv_path + "\"");
+		csv = &csv_file;
+	} else if (bin_path.empty()) {
+		csv = &std::cout;
+	}
+	if (csv) {
+		*csv << "time_s,class,prob,smoothed_class,smoothed_prob\n";
+		*csv << std::fixed;
+	}
+	if (!bin_path.empty()) {
+		bin.open(bin_path, std::ios::binary);
+		if (!bin)
+			fatal("failed to open \"" + bin_path + "\"");
+		std::string all_names;
+		for (const auto &n : names)
+			all_names += n + "\n";
+		annotate_header_t h {};
+		std::memcpy(h.magic, ANNOTATE_MAGIC, sizeof(h.magic));
+		h.sample_rate = SAMPLES_PER_SECOND;
+		h.hop = o.hop;
+		h.window = a.window;
+		h.nclasses = a.nclasses;
+		h.names_size = all_names.size();
+		h.nwindows = a.nwindows;
+		bin.write(reinterpret_cast<const char *>(&h), sizeof(h));
+		bin << all_names;
+	}
+
+	const double alpha = o.time_constant_s ?
+		1.0 - std::exp(-double(o.hop) / (o.time_constant_s * SAMPLES_PER_SECOND)) : 1.0;
+	std::vector<double> smoothed;
+	std::vector<annotate_record_t> records;
+	a.run([&](const segment_t &seg) {
+		records.resize(seg.nwindows);
+		for (size_t k = 0; k < seg.nwindows; k++) {
+			const float *out = &seg.out[k * a.nclasses];
+			if (smoothed.empty())
+				smoothed.assign(out, out + a.nclasses);
+			for (size_t c = 0; c < a.nclasses; c++)
+				smoothed[c] += alpha * (out[c] - smoothed[c]);
+			auto &r = records[k];
+			r.cls = std::max_element(out, out + a.nclasses) - out;
+			r.prob = out[r.cls];
+			r.smoothed_cls = std::max_element(smoothed.begin(), smoothed.end()) - smoothed.begin();
+			r.smoothed_prob = smoothed[r.smoothed_cls];
+			if (csv) {
+				*csv << std::setprecision(4) << double((seg.first + k + 1) * o.hop) / SAMPLES_PER_SECOND;
+				*csv << "," << names[r.cls] << "," << std::setprecision(6) << r.prob;
+				*csv << "," << names[r.smoothed_cls] << "," << r.smoothed_prob << "\n";
+			}
+		}
+		if (bin.is_open())
+			bin.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(records[0]));
+	});
+
+	if (csv && !csv->flush())
+		fatal("failed to write the CSV timeline");
+	if (bin.is_open() && !bin.flush())
+		fatal("failed to write \"" + bin_path + "\"");
+	const double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	const double audio_s = double(a.nwindows * o.hop) / SAMPLES_PER_SECOND;
+	std::cerr << std::fixed << std::setprecision(1);
+	std::cerr << "Annotated " << audio_s << " s of audio in " << wall_s << " s, ";
+	std::cerr << audio_s / wall_s << "x real time" << std::endl;
+	std::cerr << "Windows: " << a.nwindows << ", segments: " << a.segments.size();
+	std::cerr << ", threads: " << o.nthreads << std::endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,263 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Real-time delay-and-sum beamforming of a BeagleMic audio stream.
+//
+// Input is the raw 8-channel S32_LE stream, as recorded by arecord. Output
+// is the mono S32_LE beam, steered towards the estimated direction of
+// arrival. The DOA is either fixed, estimated by an exported NN model,
+// or by SRP-PHAT. It is updated for each chunk of DOA_NSAMPLES frames.
+//
+// Example invocations:
+//    $ arecord -Dhw:0 -c8 -r24000 -fS32_LE -t raw | ./beamform -m model.nn > beam.raw
+//    $ ./beamform -a 45 output-5.6deg-0elev-1m.raw beam.raw
+//    $ ./beamform -m model.nn -B 60
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "beamformer.h"
+#include "mic-array.h"
+#include "nn-engine.h"
+#include "raw-audio.h"
+#include "srp-phat.h"
+
+// Chunk size for DOA estimation. Matches the datasets.
+const size_t DOA_NSAMPLES = 512;
+
+// Source of the angle to steer to.
+class doa_source_t {
+public:
+	virtual ~doa_source_t() {}
+
+	// Estimate from a chunk of DOA_NSAMPLES interleaved frames. Returns
+	// a stand angle index, or -1 to keep steering to the previous one.
+	virtual int estimate(const int32_t *chunk) = 0;
+};
+
+class fixed_doa_t : public doa_source_t {
+public:
+	fixed_doa_t(int _angle) : angle(_angle) {}
+	virtual int estimate(const int32_t *) { return angle; }
+private:
+	const int angle;
+};
+
+class nn_doa_t : public doa_source_t {
+public:
+	nn_doa_t(std::shared_ptr<nn_model_t> _model)
+		: model(_model), in(_model->input_size), class_angle(_model->class_names.size())
+	{
+		if (model->input_size != DOA_NSAMPLES * NCHANNELS)
+			fatal("model input does not match the DOA chunk size");
+		// Angle classes are named after the angle in degrees. Any other
+		// class (i.e. silence) leaves the beam where it was.
+		for (size_t i = 0; i < class_angle.size(); i++) {
+			const std::string &name = model->class_names[i];
+			char *end;
+			const double deg = std::strtod(name.c_str(), &end);
+			class_angle[i] = (end == name.c_str() || *end) ? -1 : angle_index(deg);
+		}
+	}
+
+	virtual int estimate(const int32_t *chunk)
+	{
+		nn_input_from_frames(chunk, in.data(), DOA_NSAMPLES, NCHANNELS);
+		return class_angle[model->classify(in.data(), ws)];
+	}
+
+	static int angle_index(double deg)
+	{
+		const long a = std::lround(deg * STAND_NANGLES / 360.0);
+		return ((a % STAND_NANGLES) + STAND_NANGLES) % STAND_NANGLES;
+	}
+
+private:
+	std::shared_ptr<nn_model_t> model;
+	nn_workspace_t ws;
+	std::vector<float> in;
+	std::vector<int> class_angle;
+};
+
+class srp_doa_t : public doa_source_t {
+public:
+	srp_doa_t() : srp(DOA_NSAMPLES) {}
+
+	virtual int estimate(const int32_t *chunk)
+	{
+		srp.reset();
+		srp.accumulate(chunk);
+		return srp.estimate();
+	}
+
+private:
+	srp_phat_t srp;
+};
+
+// Feeds the stream in hops to the beamformer, and the DOA source
+// with chunks of DOA_NSAMPLES frames.
+class beam_stream_t {
+public:
+	std::chrono::steady_clock::duration beam_time {};
+	std::chrono::steady_clock::duration doa_time {};
+	size_t nframes = 0;
+
+	beam_stream_t(doa_source_t &_doa)
+		: doa(_doa), chunk(DOA_NSAMPLES * NCHANNELS)
+	{
+		if (DOA_NSAMPLES % bf.hop)
+			fatal("DOA chunk must be a multiple of the beamformer hop");
+	}
+
+	size_t hop() const { return bf.hop; }
+
+	void process(const int32_t *frames, float *out)
+	{
+		const size_t n = bf.hop * NCHANNELS;
+		const size_t fill = (nframes % DOA_NSAMPLES) * NCHANNELS;
+		std::copy(frames, frames + n, &chunk[fill]);
+		nframes += bf.hop;
+
+		auto t0 = std::chrono::steady_clock::now();
+		if (nframes % DOA_NSAMPLES == 0) {
+			const int a = doa.estimate(chunk.data());
+			if (a >= 0)
+				angle = a;
+		}
+		auto t1 = std::chrono::steady_clock::now();
+		bf.process(frames, out, angle);
+		auto t2 = std::chrono::steady_clock::now();
+
+		doa_time += t1 - t0;
+		beam_time += t2 - t1;
+	}
+
+private:
+	beamformer_t bf;
+	doa_source_t &doa;
+	std::vector<int32_t> chunk;
+	int angle = 0;
+};
+
+static bool read_full(int fd, void *buf, size_t n)
+{
+	char *p = static_cast<char *>(buf);
+	while (n) {
+		const ssize_t r = read(fd, p, n);
+		if (r < 0)
+			fatal("read error");
+		if (r == 0)
+			return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+static void write_full(int fd, const void *buf, size_t n)
+{
+	const char *p = static_cast<const char *>(buf);
+	while (n) {
+		const ssize_t r = write(fd, p, n);
+		if (r < 0)
+			fatal("write error");
+		p += r;
+		n -= r;
+	}
+}
+
+static void run_stream(beam_stream_t &bs, int in_fd, int out_fd)
+{
+	std::vector<int32_t> in(bs.hop() * NCHANNELS), out(bs.hop());
+	std::vector<float> beam(bs.hop());
+
+	while (read_full(in_fd, in.data(), in.size() * sizeof(in[0]))) {
+		bs.process(in.data(), beam.data());
+		for (size_t i = 0; i < beam.size(); i++)
+			out[i] = std::clamp<double>(std::lrint(beam[i]), INT32_MIN, INT32_MAX);
+		write_full(out_fd, out.data(), out.size() * sizeof(out[0]));
+	}
+}
+
+// Process synthetic audio from memory, and report the processing speed.
+static void run_benchmark(beam_stream_t &bs, double seconds)
+{
+	const size_t nhops = seconds * SAMPLES_PER_SECOND / bs.hop();
+	std::vector<int32_t> in(nhops * bs.hop() * NCHANNELS);
+	std::vector<float> beam(bs.hop());
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int32_t> dist(-(1 << 24), 1 << 24);
+	for (auto &v : in)
+		v = dist(rng);
+
+	for (size_t h = 0; h < nhops; h++)
+		bs.process(&in[h * bs.hop() * NCHANNELS], beam.data());
+
+	const double audio_s = double(bs.nframes) / SAMPLES_PER_SECOND;
+	auto report = [&](const char *what, std::chrono::steady_clock::duration d) {
+		const double s = std::chrono::duration<double>(d).count();
+		std::cout << what << s << " s for " << audio_s << " s of audio, ";
+		std::cout << audio_s / s << "x real time" << std::endl;
+	};
+	report("Beamformer:    ", bs.beam_time);
+	report("DOA estimator: ", bs.doa_time);
+	report("Total:         ", bs.beam_time + bs.doa_time);
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: beamform [-a ANGLE | -m MODEL] [-B SECONDS] [INPUT [OUTPUT]]";
+	std::unique_ptr<doa_source_t> doa;
+	double bench_s = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:m:B:")) != -1) {
+		switch (opt) {
+		case 'a':
+			doa = std::make_unique<fixed_doa_t>(nn_doa_t::angle_index(std::atof(optarg)));
+			break;
+		case 'm':
+			doa = std::make_unique<nn_doa_t>(nn_model_t::load(optarg));
+			break;
+		case 'B':
+			bench_s = std::atof(optarg);
+			if (bench_s <= 0)
+				fatal(usage);
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind > 2 || (bench_s && argc != optind))
+		fatal(usage);
+	if (!doa)
+		doa = std::make_unique<srp_doa_t>();
+
+	beam_stream_t bs(*doa);
+	if (bench_s) {
+		run_benchmark(bs, bench_s);
+		return EXIT_SUCCESS;
+	}
+
+	int in_fd = STDIN_FILENO, out_fd = STDOUT_FILENO;
+	if (argc - optind >= 1 && (in_fd = open(argv[optind], O_RDONLY)) < 0)
+		fatal(std::string("could not open ") + argv[optind]);
+	if (argc - optind >= 2 && (out_fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		fatal(std::string("could not create ") + argv[optind + 1]);
+	run_stream(bs, in_fd, out_fd);
+
+	return EXIT_SUCCESS;
+}
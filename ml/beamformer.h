@@ -0,0 +1,124 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Delay-and-sum beamformer for the BeagleMic array.
+//
+// The microphone signals are delayed so that a sound arriving from the
+// steered angle lines up across all of them, and then averaged. Sound from
+// other directions adds up incoherently and is attenuated.
+//
+// The delays between the mics are a fraction of a sample, so they are
+// applied in the frequency domain, as a phase shift per bin. Audio is
+// processed with a weighted overlap-add (WOLA) scheme: frames of nfft
+// samples with a hop of nfft/2, and square-root Hann windows for both the
+// analysis and the synthesis. The steering vectors for all stand angles
+// are precomputed, so changing the steered angle costs nothing. And due
+// to the overlap, the switch is smoothly crossfaded over one hop.
+
+#ifndef DOA_BEAMFORMER_H
+#define DOA_BEAMFORMER_H
+
+#include <cstdint>
+#include <cmath>
+
+#include <algorithm>
+#include <numbers>
+#include <vector>
+
+#include "fft.h"
+#include "mic-array.h"
+#include "raw-audio.h"
+
+class beamformer_t {
+public:
+	const size_t nfft;
+	const size_t hop;
+	const size_t nbins;
+
+	beamformer_t(size_t _nfft = 512)
+		: nfft(_nfft), hop(_nfft / 2), nbins(_nfft / 2 + 1),
+		  fft(_nfft),
+		  window(_nfft),
+		  steering(size_t(STAND_NANGLES) * NCHANNELS * nbins),
+		  history(NCHANNELS * _nfft),
+		  overlap(_nfft),
+		  z(_nfft),
+		  spec(NCHANNELS * nbins)
+	{
+		// Periodic Hann, so that the squared window sums to one at 50% overlap.
+		for (size_t i = 0; i < nfft; i++)
+			window[i] = std::sin(std::numbers::pi * i / nfft);
+
+		// Advance each mic by its arrival delay: e^{+jwd}. Averaging is
+		// included in the weights.
+		for (int a = 0; a < STAND_NANGLES; a++) {
+			const double theta = stand_angle_deg(a) * std::numbers::pi / 180.0;
+			for (int m = 0; m < NCHANNELS; m++) {
+				const double d = mic_delay_s(theta, m);
+				cfloat *st = &steering[(a * NCHANNELS + m) * nbins];
+				for (size_t k = 0; k < nbins; k++) {
+					const double w = 2.0 * std::numbers::pi * k * SAMPLES_PER_SECOND / nfft;
+					st[k] = std::polar(1.0 / NCHANNELS, w * d);
+				}
+			}
+		}
+	}
+
+	// Output lags the input by this many samples.
+	size_t latency() const { return nfft - hop; }
+
+	// Consume hop interleaved input frames, and produce hop output
+	// samples of the beam steered to the given stand angle index.
+	void process(const int32_t *frames, float *out, int angle)
+	{
+		// Slide the analysis frame.
+		for (int ch = 0; ch < NCHANNELS; ch++) {
+			float *h = &history[ch * nfft];
+			std::copy(h + hop, h + nfft, h);
+			for (size_t i = 0; i < hop; i++)
+				h[nfft - hop + i] = frames[i * NCHANNELS + ch];
+		}
+
+		// Two real channels per complex FFT.
+		for (int ch = 0; ch < NCHANNELS; ch += 2) {
+			const float *ha = &history[ch * nfft];
+			const float *hb = &history[(ch + 1) * nfft];
+			for (size_t i = 0; i < nfft; i++)
+				z[i] = cfloat(window[i] * ha[i], window[i] * hb[i]);
+			fft.forward(z.data());
+			fft.split_real2(z.data(), &spec[ch * nbins], &spec[(ch + 1) * nbins]);
+		}
+
+		// Steer and sum. The output spectrum is Hermitian.
+		const cfloat *st = &steering[size_t(angle) * NCHANNELS * nbins];
+		for (size_t k = 0; k < nbins; k++) {
+			cfloat y = 0;
+			for (int m = 0; m < NCHANNELS; m++)
+				y += cmul(st[m * nbins + k], spec[m * nbins + k]);
+			z[k] = y;
+		}
+		z[0] = z[0].real();
+		z[nfft / 2] = z[nfft / 2].real();
+		for (size_t k = 1; k < nfft / 2; k++)
+			z[nfft - k] = std::conj(z[k]);
+		fft.inverse(z.data());
+
+		for (size_t i = 0; i < nfft; i++)
+			overlap[i] += window[i] * z[i].real();
+		std::copy(overlap.begin(), overlap.begin() + hop, out);
+		std::copy(overlap.begin() + hop, overlap.end(), overlap.begin());
+		std::fill(overlap.end() - hop, overlap.end(), 0.0f);
+	}
+
+private:
+	fft_t fft;
+	std::vector<float> window;
+	std::vector<cfloat> steering;	// Per angle, per mic, per bin.
+	std::vector<float> history;	// Last nfft samples, per mic.
+	std::vector<float> overlap;	// Pending overlap-add output.
+	std::vector<cfloat> z;
+	std::vector<cfloat> spec;	// Spectrum per mic.
+};
+
+#endif
@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Compare a model generated into C++ by gen-model.py with the same model
+// run by the generic inference engine. Both must give the same results.
+//
+// Example invocation:
+//    $ make bench-generated GEN_MODEL=model.nn
+//    $ ./bench-generated -m model.nn
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "nn-engine.h"
+#include "nn-generated.h"
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: bench-generated -m MODEL [-n NRUNS]";
+	std::string model_path;
+	size_t nruns = 1000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+		switch (opt) {
+		case 'm':
+			model_path = optarg;
+			break;
+		case 'n':
+			nruns = std::max(1, std::atoi(optarg));
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc != optind || model_path.empty())
+		fatal(usage);
+
+	auto model = nn_model_t::load(model_path);
+	const nn_generated_model_t &gen = nn_generated_model;
+	if (gen.input_size != model->input_size || gen.output_size != model->output_size())
+		fatal("generated model does not match " + model_path);
+	for (size_t i = 0; i < gen.output_size; i++)
+		if (model->class_names[i] != gen.class_names[i])
+			fatal("generated model classes do not match " + model_path);
+
+	std::vector<float> in(model->input_size);
+	std::vector<float> out(model->output_size()), gen_out(model->output_size());
+	std::vector<double> us[2] = { std::vector<double>(nruns), std::vector<double>(nruns) };
+	std::mt19937 rng(1);
+	std::normal_distribution<float> dist(0, 0.01);
+	nn_workspace_t ws;
+	size_t nmismatches = 0;
+
+	for (size_t r = 0; r < nruns; r++) {
+		for (auto &v : in)
+			v = dist(rng);
+
+		auto t0 = std::chrono::steady_clock::now();
+		model->predict(in.data(), out.data(), ws);
+		auto t1 = std::chrono::steady_clock::now();
+		gen.predict(in.data(), gen_out.data());
+		auto t2 = std::chrono::steady_clock::now();
+
+		us[0][r] = std::chrono::duration<double, std::micro>(t1 - t0).count();
+		us[1][r] = std::chrono::duration<double, std::micro>(t2 - t1).count();
+		if (std::memcmp(out.data(), gen_out.data(), out.size() * sizeof(float)))
+			nmismatches++;
+	}
+
+	const char *names[2] = { "Generic engine:  ", "Generated model: " };
+	for (int i = 0; i < 2; i++) {
+		std::sort(us[i].begin(), us[i].end());
+		std::cout << names[i] << "median " << us[i][nruns / 2] << " us, p99 ";
+		std::cout << us[i][nruns * 99 / 100] << " us" << std::endl;
+	}
+	std::cout << "Mismatching outputs: " << nmismatches << " of " << nruns << std::endl;
+
+	return nmismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
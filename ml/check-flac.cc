@@ -0,0 +1,189 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Check the built-in FLAC decoder against the reference one, flac(1).
+//
+// Each FLAC recording is read as all the tools read it, decoded by the
+// worker threads, and compared sample by sample with the output of
+// "flac -d". Each raw or packed recording is instead encoded by "flac" to
+// a temporary file, which is read back with the built-in decoder, and
+// compared with the original: a round trip. The samples are stored in 24
+// bits if they fit, as in the archives, or else in 32 bits.
+//
+// Example invocations:
+//    $ ./check-flac records/*.flac
+//    $ ./check-flac records/output-silence.s24
+//
+// Exit status is non-zero if any sample differs.
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <csignal>
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "raw-audio.h"
+
+// Samples compared at once. Small enough for the shortest FLAC frames.
+const off_t PIECE_SAMPLES = 4096;
+
+static std::string shell_quote(const std::string &s)
+{
+	std::string q = "'";
+	for (char c : s)
+		q += c == '\'' ? std::string("'\\''") : std::string(1, c);
+	return q + "'";
+}
+
+static bool fits_24_bits(raw_audio_t &m)
+{
+	for (off_t i = 0; i < m.len; i += PIECE_SAMPLES) {
+		const off_t n = std::min(PIECE_SAMPLES, m.len - i);
+		const int32_t *p = m.samples(i, n);
+		for (off_t j = 0; j < n; j++)
+			if (p[j] < -(1 << 23) || p[j] >= (1 << 23))
+				return false;
+	}
+	return true;
+}
+
+// Compare the recording with the raw little-endian samples of the given
+// width from the stream. Prints the first difference.
+static bool compare(raw_audio_t &m, FILE *ref, unsigned nbytes, const std::string &name)
+{
+	std::vector<uint8_t> buf(PIECE_SAMPLES * nbytes);
+	for (off_t i = 0; i < m.len; i += PIECE_SAMPLES) {
+		const off_t n = std::min(PIECE_SAMPLES, m.len - i);
+		if (std::fread(buf.data(), nbytes, n, ref) != size_t(n)) {
+			std::cerr << name << ": the reference has only " << i / NCHANNELS << " frames" << std::endl;
+			return false;
+		}
+		const int32_t *p = m.samples(i, n);
+		for (off_t j = 0; j < n; j++) {
+			uint32_t v = 0;
+			for (unsigned b = 0; b < nbytes; b++)
+				v |= uint32_t(buf[j * nbytes + b]) << (8 * b);
+			// Sign-extend.
+			const int32_t r = int32_t(v << (32 - 8 * nbytes)) >> (32 - 8 * nbytes);
+			if (p[j] != r) {
+				std::cerr << name << ": frame " << (i + j) / NCHANNELS << ", channel " << (i + j) % NCHANNELS;
+				std::cerr << " is " << p[j] << ", the reference " << r << std::endl;
+				return false;
+			}
+		}
+	}
+	if (std::fgetc(ref) != EOF) {
+		std::cerr << name << ": the reference has more than " << m.len / NCHANNELS << " frames" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool check_flac(const std::string &path)
+{
+	auto m = raw_audio_t::open(path);
+	const std::string cmd = "flac -d -c -s --force-raw-format --endian=little --sign=signed " + shell_quote(path);
+	FILE *ref = popen(cmd.c_str(), "r");
+	if (!ref)
+		fatal("failed to run flac");
+	bool ok = compare(*m, ref, (m->stored_bps() + 7) / 8, path);
+	if (pclose(ref) != 0) {
+		std::cerr << path << ": flac -d failed" << std::endl;
+		ok = false;
+	}
+	return ok;
+}
+
+static bool check_round_trip(const std::string &path)
+{
+	auto m = raw_audio_t::open(path);
+	const unsigned bps = fits_24_bits(*m) ? 24 : 32;
+	const unsigned nbytes = bps / 8;
+
+	std::string tmp = (std::filesystem::temp_directory_path() / "check-flac-XXXXXX.flac").string();
+	const int fd = mkstemps(tmp.data(), 5);
+	if (fd < 0)
+		fatal("failed to create a temporary file");
+	close(fd);
+	const std::string cmd = "flac -s -f --force-raw-format --endian=little --sign=signed --channels=" +
+		std::to_string(NCHANNELS) + " --bps=" + std::to_string(bps) + " --sample-rate=" +
+		std::to_string(SAMPLES_PER_SECOND) + " -o " + shell_quote(tmp) + " -";
+	FILE *enc = popen(cmd.c_str(), "w");
+	if (!enc)
+		fatal("failed to run flac");
+	std::vector<uint8_t> buf(PIECE_SAMPLES * nbytes);
+	for (off_t i = 0; i < m->len; i += PIECE_SAMPLES) {
+		const off_t n = std::min(PIECE_SAMPLES, m->len - i);
+		const int32_t *p = m->samples(i, n);
+		for (off_t j = 0; j < n; j++)
+			for (unsigned b = 0; b < nbytes; b++)
+				buf[j * nbytes + b] = uint32_t(p[j]) >> (8 * b);
+		if (std::fwrite(buf.data(), nbytes, n, enc) != size_t(n))
+			break;
+	}
+	if (pclose(enc) != 0) {
+		std::remove(tmp.c_str());
+		std::cerr << path << ": flac failed" << std::endl;
+		return false;
+	}
+
+	// Compare the decoded samples with the original ones, as the
+	// reference decoder would produce them.
+	bool ok = true;
+	{
+		auto decoded = raw_audio_t::open(tmp);
+		if (decoded->len != m->len) {
+			std::cerr << path << ": " << decoded->len / NCHANNELS << " frames decoded of ";
+			std::cerr << m->len / NCHANNELS << std::endl;
+			ok = false;
+		}
+		for (off_t i = 0; ok && i < m->len; i += PIECE_SAMPLES) {
+			const off_t n = std::min(PIECE_SAMPLES, m->len - i);
+			const int32_t *p = m->samples(i, n);
+			const int32_t *q = decoded->samples(i, n);
+			for (off_t j = 0; j < n; j++) {
+				if (p[j] != q[j]) {
+					std::cerr << path << ": frame " << (i + j) / NCHANNELS << ", channel ";
+					std::cerr << (i + j) % NCHANNELS << " is decoded as " << q[j] << ", not ";
+					std::cerr << p[j] << std::endl;
+					ok = false;
+					break;
+				}
+			}
+		}
+	}
+	std::remove(tmp.c_str());
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: check-flac RECORDING...";
+	if (argc < 2)
+		fatal(usage);
+	// A failing flac is reported by pclose().
+	std::signal(SIGPIPE, SIG_IGN);
+
+	int nfailed = 0;
+	for (int i = 1; i < argc; i++) {
+		const std::string path = argv[i];
+		const auto t0 = std::chrono::steady_clock::now();
+		const bool ok = raw_audio_t::is_flac(path) ? check_flac(path) : check_round_trip(path);
+		const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		std::cout << (ok ? "OK " : "FAILED ") << path << std::fixed << std::setprecision(2);
+		std::cout << " (" << secs << " s)" << std::endl;
+		nfailed += !ok;
+	}
+
+	return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Per-chunk statistics of a raw recording, kept in a sidecar file.
+//
+// Selecting the chunks with useful audio takes a scan over the whole
+// recording, for each VALID_SAMPLE_THRESHOLD and VALID_SAMPLES_PERCENT.
+// Instead, the recording is scanned once, and the sidecar keeps for each
+// chunk and channel the maximum amplitude, and a histogram of the
+// amplitudes over power-of-two buckets. The number of valid samples of
+// a chunk, for any threshold, is then known from the buckets entirely
+// above or below the threshold, give or take the one bucket containing
+// it. Only the few chunks for which that bucket decides need to be read
+// again, to count exactly.
+//
+// The sidecar is stored next to the recording, as "<RECORDING>.chunks".
+// It is recomputed if the recording, or the silence training period,
+// changes. Layout, in host byte order:
+//
+//    char magic[8];                 "DOACHK1\0"
+//    chunk_stats_t::header_t;
+//    nchunks times, NCHANNELS times:
+//        chunk_stats_t::channel_t;
+//
+// The chunks start at data_scan_i, and follow each other.
+
+#ifndef DOA_CHUNK_STATS_H
+#define DOA_CHUNK_STATS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <bit>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "common.h"
+#include "raw-audio.h"
+
+static const char CHUNK_STATS_MAGIC[8] = { 'D', 'O', 'A', 'C', 'H', 'K', '1', '\0' };
+
+class chunk_stats_t {
+public:
+	// Bucket b holds the amplitudes of bit width b, i.e. 0 for silence,
+	// and [2^(b-1), 2^b) otherwise.
+	static const unsigned NBUCKETS = 33;
+
+	struct header_t {
+		uint64_t file_size;	// Of the recording, to detect changes.
+		int64_t mtime_ns;
+		uint32_t chunk_len;	// In samples of all channels.
+		uint32_t nchannels;
+		int64_t silence_scan_i;
+		int64_t data_scan_i;
+		int32_t silence_max;	// Trained from the silence period.
+		uint32_t nchunks;
+	};
+	static_assert(sizeof(header_t) == 48);
+
+	struct channel_t {
+		uint32_t absmax;
+		uint16_t hist[NBUCKETS];
+	};
+	static_assert(sizeof(channel_t) == 72);
+
+	header_t hdr;
+	std::vector<channel_t> channels;	// NCHANNELS per chunk.
+
+	static std::filesystem::path sidecar_path(const std::filesystem::path &recording)
+	{
+		return recording.string() + ".chunks";
+	}
+
+	// The amplitude, even of INT32_MIN.
+	static uint32_t abs_u32(int32_t v)
+	{
+		return v < 0 ? 0u - uint32_t(v) : uint32_t(v);
+	}
+
+	// Scan the whole recording.
+	static std::unique_ptr<chunk_stats_t> compute(raw_audio_t &m, off_t chunk_len,
+						      const std::filesystem::path &recording)
+	{
+		auto s = create(m, chunk_len, recording);
+		for (size_t k = 0; k < s->hdr.nchunks; k++)
+			s->add_chunk(k, m.samples(s->hdr.data_scan_i + k * chunk_len, chunk_len));
+		return s;
+	}
+
+	// Train for silence, and leave the chunks for add_chunk(), e.g. as
+	// they are scanned anyway.
+	static std::unique_ptr<chunk_stats_t> create(raw_audio_t &m, off_t chunk_len,
+						     const std::filesystem::path &recording)
+	{
+		if (chunk_len % NCHANNELS || chunk_len / NCHANNELS > UINT16_MAX)
+			fatal("unsupported chunk length for chunk statistics");
+		const silence_params_t sp = train_silence(m, chunk_len, recording.string());
+		auto s = std::make_unique<chunk_stats_t>();
+		s->hdr = file_header(recording);
+		s->hdr.chunk_len = chunk_len;
+		s->hdr.nchannels = NCHANNELS;
+		s->hdr.silence_scan_i = sp.silence_scan_i;
+		s->hdr.data_scan_i = sp.data_scan_i;
+		s->hdr.silence_max = sp.silence_max;
+		s->hdr.nchunks = (m.len - sp.data_scan_i) / chunk_len;
+		s->channels.resize(size_t(s->hdr.nchunks) * NCHANNELS);
+		return s;
+	}
+
+	// Each chunk must be added once.
+	void add_chunk(size_t k, const int32_t *chunk)
+	{
+		channel_t *c = &channels[k * NCHANNELS];
+		const off_t chunk_len = hdr.chunk_len;
+		// Zero-initialized by resize().
+		for (off_t i = 0; i < chunk_len; i += NCHANNELS) {
+			for (int ch = 0; ch < NCHANNELS; ch++) {
+				const uint32_t a = abs_u32(chunk[i + ch]);
+				c[ch].hist[std::bit_width(a)]++;
+				c[ch].absmax = std::max(c[ch].absmax, a);
+			}
+		}
+	}
+
+	// Returns null if the sidecar is missing, or out of date.
+	static std::unique_ptr<chunk_stats_t> load(const std::filesystem::path &recording, off_t chunk_len)
+	{
+		std::ifstream f {sidecar_path(recording), f.binary};
+		if (!f)
+			return nullptr;
+		char magic[sizeof(CHUNK_STATS_MAGIC)];
+		header_t h;
+		f.read(magic, sizeof(magic));
+		f.read(reinterpret_cast<char *>(&h), sizeof(h));
+		const header_t cur = file_header(recording);
+		if (!f || std::memcmp(magic, CHUNK_STATS_MAGIC, sizeof(magic)) ||
+		    h.file_size != cur.file_size || h.mtime_ns != cur.mtime_ns ||
+		    h.chunk_len != chunk_len || h.nchannels != NCHANNELS ||
+		    h.silence_scan_i != secs2offs(INITIAL_SKIP_S) ||
+		    h.data_scan_i != h.silence_scan_i + secs2offs(SILENCE_TRAINING_S))
+			return nullptr;
+
+		auto s = std::make_unique<chunk_stats_t>();
+		s->hdr = h;
+		s->channels.resize(size_t(h.nchunks) * NCHANNELS);
+		f.read(reinterpret_cast<char *>(s->channels.data()), s->channels.size() * sizeof(channel_t));
+		if (!f)
+			return nullptr;
+		return s;
+	}
+
+	// Write the sidecar of the recording. Returns false if it could not,
+	// e.g. because the recordings are on a read-only filesystem.
+	bool save(const std::filesystem::path &recording) const
+	{
+		const auto path = sidecar_path(recording);
+		const auto tmp = path.string() + ".tmp";
+		{
+			std::ofstream f {tmp, f.binary | f.trunc};
+			if (!f)
+				return false;
+			f.write(CHUNK_STATS_MAGIC, sizeof(CHUNK_STATS_MAGIC));
+			f.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+			f.write(reinterpret_cast<const char *>(channels.data()), channels.size() * sizeof(channel_t));
+			if (!f) {
+				std::remove(tmp.c_str());
+				return false;
+			}
+		}
+		return std::rename(tmp.c_str(), path.c_str()) == 0;
+	}
+
+	// The thresholds, as train_silence() would set them.
+	silence_params_t params(float sample_threshold = VALID_SAMPLE_THRESHOLD,
+				float samples_percent = VALID_SAMPLES_PERCENT) const
+	{
+		silence_params_t p;
+		p.silence_scan_i = hdr.silence_scan_i;
+		p.data_scan_i = hdr.data_scan_i;
+		p.silence_max = hdr.silence_max;
+		set_valid_thresholds(p, hdr.chunk_len, sample_threshold, samples_percent);
+		return p;
+	}
+
+	// The range [lo, hi] of the count_valid_samples() of chunk k.
+	void valid_samples_bounds(const silence_params_t &p, size_t k, int &lo, int &hi) const
+	{
+		lo = hi = 0;
+		const int64_t t = p.silence_threshold;
+		for (int ch = 0; ch < NCHANNELS; ch++) {
+			const channel_t &c = channels[k * NCHANNELS + ch];
+			if (int64_t(c.absmax) < t)
+				continue;
+			for (unsigned b = 0; b < NBUCKETS; b++) {
+				const int64_t low = b ? 1ll << (b - 1) : 0;
+				const int64_t high = b ? (1ll << b) - 1 : 0;
+				if (low >= t) {
+					lo += c.hist[b];
+					hi += c.hist[b];
+				} else if (high >= t) {
+					// The maximum is one of the valid samples.
+					lo += unsigned(std::bit_width(c.absmax)) == b;
+					hi += c.hist[b];
+				}
+			}
+		}
+	}
+
+private:
+	static header_t file_header(const std::filesystem::path &recording)
+	{
+		struct stat st;
+		if (stat(recording.c_str(), &st) < 0)
+			fatal("failed to stat \"" + recording.string() + "\"");
+		header_t h {};
+		h.file_size = st.st_size;
+		h.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+		return h;
+	}
+};
+
+#endif
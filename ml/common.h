@@ -0,0 +1,22 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Helpers shared between the C++ tools in this directory.
+
+#ifndef DOA_COMMON_H
+#define DOA_COMMON_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+static inline void fatal(const std::string &s)
+{
+	std::cerr << "ERROR: " << s << std::endl;
+	std::cerr << "   errno=" << errno << std::endl;
+	std::abort();
+}
+
+#endif
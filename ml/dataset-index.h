@@ -0,0 +1,395 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Index of the datasets stored in shard files.
+//
+// Instead of a directory tree with millions of small files, prepare-data
+// can append the datasets as fixed-size records to a few large shard
+// files. The index lists the location of each record, along with its
+// attributes (class, elevation, ...). For each distinct value of each
+// attribute, a bitmap marks the records having that value. Selecting
+// a subset of the dataset is then a matter of a few bitwise operations
+// over the bitmaps, instead of globbing a directory tree.
+//
+// Index file layout. All integers are little-endian. Sections are padded
+// to 8 bytes, so that the records and bitmaps can be mapped directly:
+//
+//    char magic[8];                 "DOAIDX1\0"
+//    u32  nrecords;
+//    u32  record_nbytes;
+//    u32  nshards;
+//    u32  nattrs;
+//    nattrs times:
+//        u32 nvalues;
+//        nvalues times: { u16 len; char str[len]; }
+//    <padding>
+//    dataset_record_t records[nrecords];
+//    <padding>
+//    nattrs times, nvalues times:
+//        u64 bitmap[(nrecords + 63) / 64];
+//
+// A query is a comma-separated list of terms, all of which must match.
+// Each term is an attribute name, followed by one or more alternative
+// values. For example:
+//
+//    class=5.625|50.625,elev=0.0,split=train
+//
+// The same query syntax is supported by the Python dataset_index module.
+//
+// If the records were shuffled across the shards when written, the index
+// lists them in the order of the shards, and a file named "shuffled" next
+// to it holds the seed of the shuffle. Reading the shards front to back
+// then gives well mixed batches.
+
+#ifndef DOA_DATASET_INDEX_H
+#define DOA_DATASET_INDEX_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Record attributes. Keep in sync with dataset_index.py!
+enum dataset_attr_t {
+	ATTR_CLASS,		// NN output class: angle, or "silence".
+	ATTR_ELEV,
+	ATTR_DISTANCE,
+	ATTR_SOURCE,		// Filename of the raw microphone recording.
+	ATTR_SPLIT,		// "train" or "valid".
+	DATASET_NATTRS,
+};
+
+static const char *const dataset_attr_names[DATASET_NATTRS] = {
+	"class", "elev", "distance", "source", "split",
+};
+
+// Value of an attribute which is not applicable, e.g. distance for silence.
+static const char *const ATTR_NONE = "-";
+
+typedef std::array<std::string, DATASET_NATTRS> dataset_attrs_t;
+
+static const char DATASET_INDEX_MAGIC[8] = { 'D', 'O', 'A', 'I', 'D', 'X', '1', '\0' };
+static const char *const DATASET_INDEX_FILENAME = "index.bin";
+static const char *const DATASET_SHUFFLED_FILENAME = "shuffled";
+
+// Location of a record, and the ID of each of its attribute values.
+struct dataset_record_t {
+	uint32_t shard;
+	uint32_t slot;		// Record number within the shard.
+	uint16_t attr[DATASET_NATTRS];
+	uint16_t pad;
+};
+static_assert(sizeof(dataset_record_t) == 20);
+
+static inline std::string dataset_shard_filename(uint32_t shard)
+{
+	char buf[32];
+	std::snprintf(buf, sizeof(buf), "shard-%05u.dat", shard);
+	return buf;
+}
+
+//----------------------------------------------------------------------------
+
+// A set of records.
+class dataset_bitmap_t {
+public:
+	std::vector<uint64_t> words;
+	size_t nbits;
+
+	dataset_bitmap_t(size_t n, bool val)
+		: words((n + 63) / 64, val ? ~uint64_t(0) : 0), nbits(n)
+	{
+		if (val && (n % 64))
+			words.back() = (uint64_t(1) << (n % 64)) - 1;
+	}
+
+	void set(size_t i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+	bool test(size_t i) const { return words[i / 64] & (uint64_t(1) << (i % 64)); }
+
+	dataset_bitmap_t &operator&=(const dataset_bitmap_t &o)
+	{
+		for (size_t i = 0; i < words.size(); i++)
+			words[i] &= o.words[i];
+		return *this;
+	}
+	dataset_bitmap_t &operator|=(const dataset_bitmap_t &o)
+	{
+		for (size_t i = 0; i < words.size(); i++)
+			words[i] |= o.words[i];
+		return *this;
+	}
+
+	size_t count() const
+	{
+		size_t n = 0;
+		for (auto w : words)
+			n += std::popcount(w);
+		return n;
+	}
+
+	// Indices of the records in the set, in ascending order.
+	std::vector<uint32_t> indices() const
+	{
+		std::vector<uint32_t> v;
+		v.reserve(count());
+		for (size_t wi = 0; wi < words.size(); wi++) {
+			for (uint64_t w = words[wi]; w; w &= w - 1)
+				v.push_back(wi * 64 + std::countr_zero(w));
+		}
+		return v;
+	}
+};
+
+//----------------------------------------------------------------------------
+
+// Read-only access to a dataset index.
+class dataset_index_t {
+public:
+	const std::filesystem::path dirpath;
+	uint32_t record_nbytes;
+	uint32_t nshards;
+	std::vector<dataset_record_t> records;
+
+	static std::shared_ptr<dataset_index_t> open(const std::filesystem::path &dirpath)
+	{
+		auto o = std::shared_ptr<dataset_index_t>(new dataset_index_t(dirpath));
+		o->load(dirpath / DATASET_INDEX_FILENAME);
+		return o;
+	}
+
+	size_t size() const { return records.size(); }
+
+	// Returns -1 if attribute or value is not known.
+	static int attr_id(const std::string &name)
+	{
+		for (int a = 0; a < DATASET_NATTRS; a++)
+			if (name == dataset_attr_names[a])
+				return a;
+		return -1;
+	}
+	int value_id(int attr, const std::string &val) const
+	{
+		const auto &v = values[attr];
+		for (size_t i = 0; i < v.size(); i++)
+			if (v[i] == val)
+				return i;
+		return -1;
+	}
+	const std::vector<std::string> &attr_values(int attr) const { return values[attr]; }
+	const std::string &value(size_t rec_i, int attr) const
+	{
+		return values[attr][records[rec_i].attr[attr]];
+	}
+
+	// Records whose attribute matches any of the given values.
+	dataset_bitmap_t select(int attr, const std::vector<std::string> &vals) const
+	{
+		dataset_bitmap_t b(size(), false);
+		for (const auto &val : vals) {
+			int vi = value_id(attr, val);
+			if (vi >= 0)
+				b |= bitmaps[attr][vi];
+		}
+		return b;
+	}
+
+	// Evaluate a query string. See the top of this file for the syntax.
+	dataset_bitmap_t query(const std::string &expr) const
+	{
+		dataset_bitmap_t b(size(), true);
+		for (const auto &term : split(expr, ',')) {
+			if (term.empty())
+				continue;
+			auto eq = term.find('=');
+			if (eq == std::string::npos)
+				fatal("invalid query term \"" + term + "\"");
+			int attr = attr_id(term.substr(0, eq));
+			if (attr < 0)
+				fatal("unknown attribute in query term \"" + term + "\"");
+			b &= select(attr, split(term.substr(eq + 1), '|'));
+		}
+		return b;
+	}
+
+	std::filesystem::path shard_path(size_t rec_i) const
+	{
+		return dirpath / dataset_shard_filename(records[rec_i].shard);
+	}
+	off_t record_offset(size_t rec_i) const
+	{
+		return off_t(records[rec_i].slot) * record_nbytes;
+	}
+
+private:
+	std::vector<std::string> values[DATASET_NATTRS];
+	std::vector<dataset_bitmap_t> bitmaps[DATASET_NATTRS];
+
+	dataset_index_t(const std::filesystem::path &_dirpath) : dirpath(_dirpath) {}
+
+	static std::vector<std::string> split(const std::string &s, char sep)
+	{
+		std::vector<std::string> v;
+		size_t start = 0;
+		for (;;) {
+			auto pos = s.find(sep, start);
+			v.push_back(s.substr(start, pos - start));
+			if (pos == std::string::npos)
+				return v;
+			start = pos + 1;
+		}
+	}
+
+	void load(const std::filesystem::path &path)
+	{
+		std::ifstream s {path, s.binary};
+		if (!s.is_open())
+			fatal("failed to open dataset index \"" + path.string() + "\"");
+		std::vector<char> buf(std::filesystem::file_size(path));
+		if (!s.read(buf.data(), buf.size()))
+			fatal("failed to read dataset index \"" + path.string() + "\"");
+		size_t pos = 0;
+
+		auto get = [&](void *dst, size_t n) {
+			if (pos + n > buf.size())
+				fatal("truncated dataset index \"" + path.string() + "\"");
+			std::memcpy(dst, buf.data() + pos, n);
+			pos += n;
+		};
+		auto get_u32 = [&]() { uint32_t v; get(&v, sizeof(v)); return v; };
+		auto align = [&]() { pos = (pos + 7) & ~size_t(7); };
+
+		char magic[sizeof(DATASET_INDEX_MAGIC)];
+		get(magic, sizeof(magic));
+		if (std::memcmp(magic, DATASET_INDEX_MAGIC, sizeof(magic)))
+			fatal("\"" + path.string() + "\" is not a dataset index");
+		const uint32_t nrecords = get_u32();
+		record_nbytes = get_u32();
+		nshards = get_u32();
+		if (get_u32() != DATASET_NATTRS)
+			fatal("unsupported number of attributes in \"" + path.string() + "\"");
+
+		for (int a = 0; a < DATASET_NATTRS; a++) {
+			const uint32_t nvalues = get_u32();
+			for (uint32_t vi = 0; vi < nvalues; vi++) {
+				uint16_t len;
+				get(&len, sizeof(len));
+				std::string str(len, '\0');
+				get(str.data(), len);
+				values[a].push_back(str);
+			}
+		}
+		align();
+		records.resize(nrecords);
+		get(records.data(), nrecords * sizeof(records[0]));
+		align();
+		for (int a = 0; a < DATASET_NATTRS; a++) {
+			for (size_t vi = 0; vi < values[a].size(); vi++) {
+				dataset_bitmap_t b(nrecords, false);
+				get(b.words.data(), b.words.size() * sizeof(b.words[0]));
+				bitmaps[a].push_back(std::move(b));
+			}
+		}
+	}
+};
+
+//----------------------------------------------------------------------------
+
+// Build a dataset index while the records are being stored.
+class dataset_index_writer {
+public:
+	dataset_index_writer(uint32_t _record_nbytes) : record_nbytes(_record_nbytes) {}
+
+	void add(uint32_t shard, uint32_t slot, const dataset_attrs_t &attrs)
+	{
+		dataset_record_t r {};
+		r.shard = shard;
+		r.slot = slot;
+		for (int a = 0; a < DATASET_NATTRS; a++) {
+			auto [it, inserted] = value_ids[a].try_emplace(attrs[a], values[a].size());
+			if (inserted) {
+				if (values[a].size() > UINT16_MAX)
+					fatal("too many distinct values for attribute " + std::string(dataset_attr_names[a]));
+				values[a].push_back(attrs[a]);
+			}
+			r.attr[a] = it->second;
+		}
+		records.push_back(r);
+		nshards = std::max(nshards, shard + 1);
+	}
+
+	size_t size() const { return records.size(); }
+
+	// Move the records, e.g. after the shards are shuffled, and list them
+	// in the order of the shards.
+	template <typename F> void relocate(F move)
+	{
+		nshards = 0;
+		for (auto &r : records) {
+			move(r);
+			nshards = std::max(nshards, r.shard + 1);
+		}
+		std::stable_sort(records.begin(), records.end(), [](const dataset_record_t &a, const dataset_record_t &b) {
+			return a.shard < b.shard || (a.shard == b.shard && a.slot < b.slot);
+		});
+	}
+
+	void save(const std::filesystem::path &path) const
+	{
+		std::fstream s {path, s.binary | s.trunc | s.out};
+		if (!s.is_open())
+			fatal("Failed to open " + path.string());
+
+		auto put_u32 = [&](uint32_t v) { s.write(reinterpret_cast<const char *>(&v), sizeof(v)); };
+		auto align = [&]() {
+			static const char zeros[8] = { };
+			s.write(zeros, (8 - (s.tellp() % 8)) % 8);
+		};
+
+		s.write(DATASET_INDEX_MAGIC, sizeof(DATASET_INDEX_MAGIC));
+		put_u32(records.size());
+		put_u32(record_nbytes);
+		put_u32(nshards);
+		put_u32(DATASET_NATTRS);
+		for (int a = 0; a < DATASET_NATTRS; a++) {
+			put_u32(values[a].size());
+			for (const auto &str : values[a]) {
+				const uint16_t len = str.size();
+				s.write(reinterpret_cast<const char *>(&len), sizeof(len));
+				s.write(str.data(), len);
+			}
+		}
+		align();
+		s.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(records[0]));
+		align();
+		for (int a = 0; a < DATASET_NATTRS; a++) {
+			std::vector<dataset_bitmap_t> bitmaps(values[a].size(), dataset_bitmap_t(records.size(), false));
+			for (size_t ri = 0; ri < records.size(); ri++)
+				bitmaps[records[ri].attr[a]].set(ri);
+			for (const auto &b : bitmaps)
+				s.write(reinterpret_cast<const char *>(b.words.data()), b.words.size() * sizeof(b.words[0]));
+		}
+		if (!s.good())
+			fatal("Failed to write " + path.string());
+	}
+
+private:
+	const uint32_t record_nbytes;
+	uint32_t nshards = 0;
+	std::vector<dataset_record_t> records;
+	std::vector<std::string> values[DATASET_NATTRS];
+	std::unordered_map<std::string, uint16_t> value_ids[DATASET_NATTRS];
+};
+
+#endif
@@ -0,0 +1,128 @@
+# SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Read the index of a sharded dataset, written by "prepare-data -s".
+# See dataset-index.h for the file layout and the query syntax.
+#
+# Example usage:
+#    idx = dataset_index.DatasetIndex('dataset')
+#    recs = idx.query('elev=0.0,distance=1.0,split=train')
+#    audio = idx.read_records(recs)
+
+import numpy as np
+import struct
+import os
+
+# Keep in sync with dataset-index.h!
+ATTR_NAMES = ['class', 'elev', 'distance', 'source', 'split']
+INDEX_MAGIC = b'DOAIDX1\0'
+INDEX_FILENAME = 'index.bin'
+SHUFFLED_FILENAME = 'shuffled'
+
+RECORD_DTYPE = np.dtype([('shard', '<u4'), ('slot', '<u4'),
+                         ('attr', '<u2', (len(ATTR_NAMES),)), ('pad', '<u2')])
+
+def _align8(pos):
+    return (pos + 7) & ~7
+
+def has_index(dirname):
+    return os.path.exists(os.path.join(dirname, INDEX_FILENAME))
+
+def shard_filename(shard):
+    return 'shard-{:05d}.dat'.format(shard)
+
+class DatasetIndex:
+    def __init__(self, dirname):
+        self.dirname = dirname
+        buf = np.fromfile(os.path.join(dirname, INDEX_FILENAME), dtype=np.uint8)
+        if bytes(buf[:8]) != INDEX_MAGIC:
+            raise ValueError('{} is not a dataset index'.format(dirname))
+        nrecords, self.record_nbytes, self.nshards, nattrs = struct.unpack_from('<4I', buf, 8)
+        if nattrs != len(ATTR_NAMES):
+            raise ValueError('unsupported number of attributes in {}'.format(dirname))
+        pos = 24
+
+        # Attribute value strings.
+        self.values = []
+        for a in range(nattrs):
+            (nvalues,) = struct.unpack_from('<I', buf, pos)
+            pos += 4
+            vals = []
+            for vi in range(nvalues):
+                (slen,) = struct.unpack_from('<H', buf, pos)
+                pos += 2
+                vals.append(bytes(buf[pos:pos+slen]).decode())
+                pos += slen
+            self.values.append(vals)
+
+        pos = _align8(pos)
+        self.records = np.frombuffer(buf, dtype=RECORD_DTYPE, count=nrecords, offset=pos)
+        pos = _align8(pos + nrecords * RECORD_DTYPE.itemsize)
+
+        nwords = (nrecords + 63) // 64
+        self.bitmaps = []
+        for a in range(nattrs):
+            bms = []
+            for vi in range(len(self.values[a])):
+                bms.append(np.frombuffer(buf, dtype='<u8', count=nwords, offset=pos))
+                pos += nwords * 8
+            self.bitmaps.append(bms)
+
+        self._shards = {}
+        # Whether the records are shuffled across the shards, in index order.
+        self.shuffled = os.path.exists(os.path.join(dirname, SHUFFLED_FILENAME))
+
+    def __len__(self):
+        return len(self.records)
+
+    def attr_values(self, attr):
+        return self.values[ATTR_NAMES.index(attr)]
+
+    def attr_ids(self, attr, indices):
+        """Value IDs of the given attribute for the given records."""
+        return self.records['attr'][indices, ATTR_NAMES.index(attr)]
+
+    def select_bitmap(self, attr, vals):
+        """Bitmap of records whose attribute matches any of the given values."""
+        a = ATTR_NAMES.index(attr)
+        b = np.zeros((len(self.records) + 63) // 64, dtype='<u8')
+        for val in vals:
+            if val in self.values[a]:
+                b |= self.bitmaps[a][self.values[a].index(val)]
+        return b
+
+    def query(self, expr):
+        """Evaluate a query, and return the indices of the matching records."""
+        b = np.full((len(self.records) + 63) // 64, ~np.uint64(0), dtype='<u8')
+        for term in expr.split(','):
+            if not term:
+                continue
+            attr, sep, vals = term.partition('=')
+            if not sep or attr not in ATTR_NAMES:
+                raise ValueError('invalid query term "{}"'.format(term))
+            b &= self.select_bitmap(attr, vals.split('|'))
+        bits = np.unpackbits(b.view(np.uint8), bitorder='little')[:len(self.records)]
+        return np.flatnonzero(bits)
+
+    def record_offsets(self, indices):
+        """Shard number and byte offset of each of the given records."""
+        recs = self.records[indices]
+        return recs['shard'], recs['slot'].astype(np.int64) * self.record_nbytes
+
+    def shard(self, shard):
+        """Memory-mapped shard, as an array of records of S32LE words."""
+        if shard not in self._shards:
+            path = os.path.join(self.dirname, shard_filename(shard))
+            self._shards[shard] = np.memmap(path, dtype='<i4', mode='r').reshape(
+                    -1, self.record_nbytes // 4)
+        return self._shards[shard]
+
+    def read_records(self, indices):
+        """Gather the audio of the given records into a new array."""
+        recs = self.records[indices]
+        out = np.empty((len(recs), self.record_nbytes // 4), dtype='<i4')
+        for shard in np.unique(recs['shard']):
+            sel = np.flatnonzero(recs['shard'] == shard)
+            out[sel] = self.shard(shard)[recs['slot'][sel]]
+        return out
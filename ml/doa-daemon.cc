@@ -0,0 +1,322 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Continuously estimate the DOA of a live capture from BeagleMic, and
+// export the health of the service as Prometheus metrics.
+//
+// Raw S32_LE 8-channel frames are read from INPUT, or from the standard
+// input. For each hop, the estimate is printed as "TIME_S CLASS PROB".
+// Windows gated as silent are printed with the class "gated", and those
+// skipped under overload with "skipped".
+//
+// With -w, the model file is watched, and each new version of it is
+// swapped in without interrupting the capture. A version which fails to
+// load, or does not fit the stream, is rejected, and the service keeps
+// running the model it has. With -A, the service degrades when it cannot
+// keep up, to a longer hop, and then to the smaller model given with -M.
+//
+// With -S SECONDS, instead of reading an input, a capture of noise is
+// simulated at real-time pace, and the worst stall of the capture thread
+// is reported. The simulation fails if any frames were dropped, or handing
+// over a block took longer than a capture period. With -w, the model file
+// is replaced halfway through with a copy of itself, renamed over it, and
+// the simulation also fails unless that was reloaded and swapped in. With
+// -C THREADS, as many threads spin alongside it, to check that the service
+// keeps up on a busy box. With -T, a timeline of the threads is written at
+// exit, in the Chrome trace format.
+//
+// Example invocations:
+//    $ arecord -D hw:0 -c 8 -r 24000 -f S32_LE -t raw | ./doa-daemon -m model.nn -p 9464
+//    $ curl http://127.0.0.1:9464/metrics
+//
+//    $ ./doa-daemon -m model.nn -g 200000 -u /run/doa.sock < /dev/beaglemic
+//
+//    $ ./doa-daemon -m model.nn -w -S 10 -q
+//
+//    $ ./doa-daemon -m model.nn -A -M small-model.nn -S 60 -C 4 -q
+
+#include <cstdlib>
+#include <cstdint>
+#include <csignal>
+
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "doa-service.h"
+#include "metrics.h"
+#include "nn-engine.h"
+#include "raw-audio.h"
+#include "trace.h"
+
+// Frames per read from the input, like an ALSA period. 5.3ms.
+const size_t CAPTURE_FRAMES = 128;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop_signal(int)
+{
+	stop_requested = 1;
+}
+
+// Read a whole block, unless the input ends or a stop is requested.
+static bool read_block(int fd, void *buf, size_t n)
+{
+	char *p = static_cast<char *>(buf);
+	while (n) {
+		const ssize_t r = read(fd, p, n);
+		if (r < 0 && errno == EINTR && !stop_requested)
+			continue;
+		if (r < 0 && errno != EINTR)
+			fatal("read error");
+		if (r <= 0)
+			return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+// Keep a CPU busy until stopped.
+static void spin(const std::atomic<bool> &stop)
+{
+	trace_thread_name("contention");
+	volatile uint64_t x = 1;
+	while (!stop.load(std::memory_order_relaxed))
+		for (int i = 0; i < 1000; i++)
+			x = x * 6364136223846793005ull + 1;
+}
+
+// Halfway through a simulated capture, replace the model file atomically
+// with a copy of itself, as a retrained model would be, so that the
+// reloader has a new version to swap in.
+static void replace_model_file(const std::filesystem::path &path, double seconds, const std::atomic<bool> &done)
+{
+	trace_thread_name("model replacer");
+	const auto t = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds / 2);
+	while (std::chrono::steady_clock::now() < t) {
+		if (done || stop_requested)
+			return;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	std::filesystem::path tmp = path;
+	tmp += ".tmp";
+	std::error_code ec;
+	std::filesystem::copy_file(path, tmp, std::filesystem::copy_options::overwrite_existing, ec);
+	if (!ec)
+		std::filesystem::rename(tmp, path, ec);
+	if (ec)
+		std::cerr << "Failed to replace " << path << ": " << ec.message() << std::endl;
+}
+
+// Capture noise at real-time pace, with the given number of threads
+// competing for the CPUs, and report the worst time the capture thread
+// spent handing over a block, and how late it woke up. Returns false if
+// a hand-over stalled the capture for longer than a block.
+static bool simulate_capture(doa_service_t &service, double seconds, unsigned ncontention)
+{
+	using namespace std::chrono;
+	std::atomic<bool> stop {false};
+	std::vector<std::thread> contention;
+	for (unsigned i = 0; i < ncontention; i++)
+		contention.emplace_back(spin, std::cref(stop));
+
+	std::vector<int32_t> block(CAPTURE_FRAMES * NCHANNELS);
+	std::minstd_rand rng(1);
+	std::uniform_int_distribution<int32_t> noise(-(1 << 24), 1 << 24);
+	const nanoseconds period(CAPTURE_FRAMES * 1000000000ull / SAMPLES_PER_SECOND);
+	const size_t nblocks = seconds * SAMPLES_PER_SECOND / CAPTURE_FRAMES;
+	steady_clock::duration max_capture {}, max_late {};
+
+	auto t = steady_clock::now();
+	for (size_t i = 0; i < nblocks && !stop_requested; i++) {
+		for (auto &x : block)
+			x = noise(rng);
+		t += period;
+		std::this_thread::sleep_until(t);
+		const auto t0 = steady_clock::now();
+		service.capture(block.data(), CAPTURE_FRAMES);
+		max_capture = std::max(max_capture, steady_clock::now() - t0);
+		max_late = std::max(max_late, t0 - t);
+	}
+	stop = true;
+	for (auto &t : contention)
+		t.join();
+	std::cerr << "Simulated capture: longest hand-over " << duration<double, std::micro>(max_capture).count();
+	std::cerr << " us, latest wake-up " << duration<double, std::micro>(max_late).count() << " us" << std::endl;
+	return max_capture < period;
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage =
+		"Usage: doa-daemon -m MODEL [-w] [-A [-M FALLBACK_MODEL]] [-H HOP] [-g SILENCE_MAX]\n"
+		"                  [-R RING_FRAMES] [-p PORT | -u SOCKET_PATH] [-q] [-T TRACE_FILE]\n"
+		"                  [-S SECONDS [-C THREADS] | INPUT]";
+	std::string model_path, fallback_path, unix_path;
+	doa_service_t::config_t cfg;
+	int port = 0;
+	bool quiet = false, watch = false;
+	double simulate_s = 0;
+	unsigned ncontention = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:wAM:H:g:R:p:u:qT:S:C:")) != -1) {
+		switch (opt) {
+		case 'm':
+			model_path = optarg;
+			break;
+		case 'A':
+			cfg.adaptive = true;
+			break;
+		case 'M':
+			fallback_path = optarg;
+			break;
+		case 'H':
+			cfg.hop = std::atol(optarg);
+			break;
+		case 'g':
+			cfg.silence_max = std::atol(optarg);
+			break;
+		case 'R':
+			cfg.ring_frames = std::atol(optarg);
+			break;
+		case 'p':
+			port = std::atoi(optarg);
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'w':
+			watch = true;
+			break;
+		case 'S':
+			simulate_s = std::atof(optarg);
+			break;
+		case 'C':
+			ncontention = std::atoi(optarg);
+			break;
+		case 'T':
+			trace_start(optarg);
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind > 1 || model_path.empty() || (port && !unix_path.empty()) ||
+	    (simulate_s && argc - optind) || (ncontention && !simulate_s) || (!fallback_path.empty() && !cfg.adaptive))
+		fatal(usage);
+
+	int in_fd = STDIN_FILENO;
+	if (argc - optind == 1) {
+		in_fd = open(argv[optind], O_RDONLY);
+		if (in_fd < 0)
+			fatal(std::string("failed to open ") + argv[optind]);
+	}
+
+	metrics_t metrics;
+	doa_service_t service(nn_model_t::load(model_path), cfg, metrics,
+			      fallback_path.empty() ? nullptr : nn_model_t::load(fallback_path));
+
+	// Only the capture thread, i.e. this one, handles the stop signals.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
+	std::unique_ptr<metrics_server_t> server;
+	if (port)
+		server = std::make_unique<metrics_server_t>(metrics, port);
+	else if (!unix_path.empty())
+		server = std::make_unique<metrics_server_t>(metrics, unix_path);
+	std::unique_ptr<doa_model_reloader_t> reloader;
+	if (watch)
+		reloader = std::make_unique<doa_model_reloader_t>(service, metrics, model_path);
+
+	std::thread inference([&]() {
+		service.run([&](const doa_estimate_t &e) {
+			if (quiet)
+				return;
+			std::cout << std::fixed << std::setprecision(4);
+			std::cout << double(e.frame) / SAMPLES_PER_SECOND << " ";
+			if (e.cls == -1)
+				std::cout << "gated -" << std::endl;
+			else if (e.cls < 0)
+				std::cout << "skipped -" << std::endl;
+			else
+				std::cout << e.model->class_names[e.cls] << " " << e.prob << std::endl;
+		});
+	});
+
+	struct sigaction sa {};
+	sa.sa_handler = on_stop_signal;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+	pthread_sigmask(SIG_UNBLOCK, &sigs, nullptr);
+
+	trace_thread_name("capture");
+	bool ok = true;
+	if (simulate_s) {
+		std::atomic<bool> done {false};
+		std::thread replacer;
+		if (reloader)
+			replacer = std::thread(replace_model_file, model_path, simulate_s, std::cref(done));
+		ok = simulate_capture(service, simulate_s, ncontention);
+		done = true;
+		if (replacer.joinable())
+			replacer.join();
+	} else {
+		std::vector<int32_t> block(CAPTURE_FRAMES * NCHANNELS);
+		while (!stop_requested && read_block(in_fd, block.data(), block.size() * sizeof(int32_t)))
+			service.capture(block.data(), CAPTURE_FRAMES);
+	}
+	service.close();
+	inference.join();
+	if (simulate_s && reloader) {
+		const auto accepted = reloader->accepted();
+		if (!accepted)
+			std::cerr << "The replaced model was not loaded during the simulation" << std::endl;
+		else if (service.latest_model() != accepted.get())
+			std::cerr << "The last loaded model was not swapped in" << std::endl;
+		ok = ok && accepted && service.latest_model() == accepted.get();
+	}
+	reloader.reset();
+	trace_flush();
+
+	std::cerr << "Windows: " << service.total(service.m_windows);
+	std::cerr << ", gated: " << service.total(service.m_gated);
+	std::cerr << ", skipped: " << service.total(service.m_skipped);
+	std::cerr << ", dropped frames: " << service.total(service.m_dropped);
+	std::cerr << ", model swaps: " << service.total(service.m_swaps);
+	std::cerr << ", rejected: " << service.total(service.m_rejected) << std::endl;
+	if (cfg.adaptive) {
+		std::cerr << "Hop increases/decreases: " << service.total(service.m_hop_ups) << "/";
+		std::cerr << service.total(service.m_hop_downs) << ", fallback switches/recoveries: ";
+		std::cerr << service.total(service.m_fallbacks) << "/" << service.total(service.m_recoveries) << std::endl;
+	}
+	std::cerr << "Inference p50/p99: " << service.inference_quantile_ns(0.5) / 1e3 << "/";
+	std::cerr << service.inference_quantile_ns(0.99) / 1e3 << " us" << std::endl;
+	std::cerr << "Capture to estimate p50/p99: " << service.latency_quantile_ns(0.5) / 1e3 << "/";
+	std::cerr << service.latency_quantile_ns(0.99) / 1e3 << " us" << std::endl;
+
+	// A simulated capture is a check that the service keeps up.
+	if (simulate_s && (!ok || service.total(service.m_dropped)))
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
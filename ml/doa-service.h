@@ -0,0 +1,513 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Streaming DOA estimation service. Audio frames come from a capture
+// thread, through a lock-free ring buffer, to an inference thread which
+// runs the model over a sliding window after each hop.
+//
+// Windows which have been silent for their whole length are gated, and
+// the model is not run for them. When the sound resumes, the cached
+// activations of the stream are recomputed from the recent frames.
+//
+// The model can be replaced while running, without stalling the capture.
+// Another thread loads the new model and warms it up, and the inference
+// thread swaps it in between two windows, RCU-style. The old model is
+// handed back to be freed outside of the audio path.
+//
+// With adaptive degradation, the service keeps up when the model is too
+// slow for the hop, e.g. on a busy box. It measures the time spent on
+// each window against the audio time of its hop, and when the load stays
+// high, it runs the model less often, doubling the hop, and then switches
+// to a smaller fallback model. It steps back when the load drops, after a
+// hold time which grows if it keeps switching back and forth. If frames
+// still pile up in the ring buffer, windows are skipped until it drains.
+
+#ifndef DOA_DOA_SERVICE_H
+#define DOA_DOA_SERVICE_H
+
+#include <cstdint>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "nn-engine.h"
+#include "raw-audio.h"
+#include "ring-buffer.h"
+#include "trace.h"
+
+static inline int64_t doa_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct doa_estimate_t {
+	uint64_t frame;		// Stream position of the end of the window.
+	int64_t capture_ns;	// Capture time of the last frame of the window.
+	int64_t done_ns;	// Time the estimate was ready.
+	int64_t infer_ns;	// Time spent running the model.
+	const nn_model_t *model;	// Model which made the estimate.
+	int cls;		// Output class, -1 for a gated silent window, or -2 for a skipped one.
+	float prob;
+};
+
+// A model, along with the state of the streams running it, one per hop.
+struct doa_engine_t {
+	std::shared_ptr<const nn_model_t> model;
+	std::vector<nn_stream_t> streams;
+
+	doa_engine_t(std::shared_ptr<const nn_model_t> _model, const std::vector<size_t> &hops)
+		: model(_model)
+	{
+		streams.reserve(hops.size());
+		for (size_t hop : hops)
+			streams.emplace_back(_model, hop, NCHANNELS);
+	}
+
+	// Run it a few times, so that the first real window is not slowed
+	// down by page faults, lazy allocations and cold caches.
+	void warm_up(unsigned nhops)
+	{
+		std::vector<float> out(model->output_size());
+		for (auto &s : streams) {
+			std::vector<int32_t> zeros(s.hop * NCHANNELS);
+			for (unsigned i = 0; i < nhops; i++)
+				s.push(zeros.data(), out.data());
+		}
+	}
+};
+
+class doa_service_t {
+public:
+	struct config_t {
+		size_t hop = 64;		// In frames.
+		size_t ring_frames = 1 << 14;	// Power of 2.
+		int32_t silence_max = 0;	// Maximum amplitude of silence, 0 to not gate.
+		bool adaptive = false;		// Degrade under overload.
+	};
+
+	// Hops of zeros to run a new model over, before swapping it in.
+	static const unsigned WARMUP_HOPS = 16;
+	// Largest hop under overload, relative to the configured one.
+	static const size_t MAX_HOP_FACTOR = 8;
+	// Smoothing of the load, in windows. Also the least number of windows
+	// at a level before degrading further, so that the effect of the last
+	// step shows.
+	static constexpr double LOAD_WINDOWS = 8;
+	// Load, i.e. busy time per audio time, above which to degrade, and
+	// below which to step back.
+	static constexpr double LOAD_HIGH = 0.8;
+	static constexpr double LOAD_LOW = 0.35;
+	// Least time at a level before stepping back. Doubled each time the
+	// load rises again within the hold, up to the maximum.
+	static constexpr double HOLD_SECONDS = 1;
+	static constexpr double MAX_HOLD_SECONDS = 32;
+
+	const config_t cfg;
+	const size_t window;	// In frames.
+	// Hops of the degradation levels of the model. The fallback model, if
+	// any, runs at the last one.
+	std::vector<size_t> hops;
+
+	doa_service_t(std::shared_ptr<const nn_model_t> _model, const config_t &_cfg, metrics_t &_metrics,
+		      std::shared_ptr<const nn_model_t> _fallback = nullptr)
+		: cfg(_cfg), window(_model->input_size / NCHANNELS), metrics(_metrics),
+		  ring(_cfg.ring_frames, NCHANNELS)
+	{
+		if (cfg.ring_frames < 2 * cfg.hop)
+			fatal("ring buffer must hold at least two hops");
+		hops.push_back(cfg.hop);
+		while (cfg.adaptive && hops.size() < std::bit_width(MAX_HOP_FACTOR) &&
+		       2 * hops.back() <= window && 4 * hops.back() <= cfg.ring_frames)
+			hops.push_back(2 * hops.back());
+		engine = std::make_unique<doa_engine_t>(_model, hops);
+		if (_fallback) {
+			if (!cfg.adaptive)
+				fatal("a fallback model needs adaptive degradation");
+			std::string err = nn_stream_t::check(*_fallback, hops.back(), NCHANNELS);
+			if (err.empty() && _fallback->input_size != window * NCHANNELS)
+				err = "it has a different window";
+			if (!err.empty())
+				fatal("invalid fallback model: " + err);
+			fallback = std::make_unique<doa_engine_t>(_fallback, std::vector<size_t> {hops.back()});
+			fallback->warm_up(WARMUP_HOPS);
+		}
+		nlevels = hops.size() + (fallback ? 1 : 0);
+		hold_frames = HOLD_SECONDS * SAMPLES_PER_SECOND;
+
+		const auto time_bounds = metrics_t::bounds_125(1e-5, 10);
+		m_captured = metrics.counter("doa_captured_frames_total", "Audio frames captured.");
+		m_dropped = metrics.counter("doa_dropped_frames_total", "Audio frames dropped, because the ring buffer was full.");
+		m_windows = metrics.counter("doa_windows_total", "Sliding windows processed.");
+		m_gated = metrics.counter("doa_gated_windows_total", "Windows gated as silent, without running the model.");
+		m_estimates = metrics.counter("doa_estimates_total", "DOA estimates by the model.");
+		m_swaps = metrics.counter("doa_model_swaps_total", "New models swapped in.");
+		m_rejected = metrics.counter("doa_model_rejects_total", "New models rejected, because they failed to load or do not fit the stream.");
+		m_latency = metrics.histogram("doa_capture_to_estimate_seconds",
+			"Time from the capture of the last frame of a window to its estimate.", 1e-9, time_bounds);
+		m_inference = metrics.histogram("doa_inference_seconds", "Model inference time per window.", 1e-9, time_bounds);
+		std::vector<double> fill_bounds;
+		for (size_t f = cfg.hop; f <= cfg.ring_frames; f *= 2)
+			fill_bounds.push_back(f);
+		m_fill = metrics.histogram("doa_ring_fill_frames",
+			"Frames waiting in the ring buffer, before processing each window.", 1, fill_bounds);
+		metrics.gauge("doa_ring_fill_ratio", "Current fill level of the ring buffer.",
+			[this]() { return double(ring.available()) / ring.capacity; });
+		metrics.ratio("doa_gated_silence_ratio", "Fraction of the windows gated as silent.", m_gated, m_windows);
+		metrics.rate("doa_estimates_per_second", "DOA estimates per second, since the last scrape.", m_estimates);
+		m_load = metrics.histogram("doa_model_load_seconds", "Time to load and warm up a new model.",
+			1e-9, time_bounds);
+		m_skipped = metrics.counter("doa_skipped_windows_total", "Windows skipped under overload, to drain the ring buffer.");
+		m_hop_ups = metrics.counter("doa_hop_increases_total", "Hop doublings under overload.");
+		m_hop_downs = metrics.counter("doa_hop_decreases_total", "Hop halvings, after the load dropped.");
+		m_fallbacks = metrics.counter("doa_fallback_switches_total", "Switches to the fallback model under overload.");
+		m_recoveries = metrics.counter("doa_fallback_recoveries_total", "Switches back from the fallback model.");
+		metrics.gauge("doa_degradation_level", "Current degradation level, 0 for none.",
+			[this]() { return double(level_now.load(std::memory_order_relaxed)); });
+		metrics.gauge("doa_hop_frames", "Current hop.",
+			[this]() { return double(hops[std::min(level_now.load(std::memory_order_relaxed), hops.size() - 1)]); });
+		metrics.gauge("doa_load_ratio", "Smoothed processing time per window, relative to the audio time of its hop.",
+			[this]() { return load_now.load(std::memory_order_relaxed); });
+
+		capture_shard = &metrics.shard();
+		infer_shard = &metrics.shard();
+
+		silence.silence_max = cfg.silence_max;
+		silence.silence_threshold = double(cfg.silence_max) * VALID_SAMPLE_THRESHOLD;
+		set_silence_hop(cfg.hop);
+	}
+
+	// Capture thread: queue interleaved frames. Never blocks. Returns
+	// false if they were dropped, because processing fell behind.
+	bool capture(const int32_t *frames, size_t n)
+	{
+		trace_span_t span("capture");
+		capture_shard->add(m_captured, n);
+		if (ring.write(frames, n, doa_now_ns()))
+			return true;
+		capture_shard->add(m_dropped, n);
+		return false;
+	}
+
+	// Capture thread: frames which can be queued without dropping.
+	size_t room() const { return ring.room(); }
+
+	// Capture thread: the stream has ended.
+	void close() { ring.close(); }
+
+	~doa_service_t()
+	{
+		delete next.exchange(nullptr);
+		collect();
+	}
+
+	// Any thread but the inference one: queue a model to be swapped in
+	// before the next window. Returns why it was rejected, or empty.
+	std::string offer(std::shared_ptr<const nn_model_t> new_model, metrics_t::shard_t &shard)
+	{
+		trace_span_t span("offer");
+		const int64_t t0 = doa_now_ns();
+		std::string err;
+		for (size_t hop : hops)
+			if (err.empty())
+				err = nn_stream_t::check(*new_model, hop, NCHANNELS);
+		if (err.empty() && new_model->input_size != window * NCHANNELS)
+			err = "the new model has a different window";
+		if (!err.empty()) {
+			shard.add(m_rejected);
+			return err;
+		}
+
+		auto e = std::make_unique<doa_engine_t>(new_model, hops);
+		e->warm_up(WARMUP_HOPS);
+		shard.record(m_load, doa_now_ns() - t0);
+
+		// Replace any model offered before, but not taken yet.
+		delete next.exchange(e.release(), std::memory_order_acq_rel);
+		collect();
+		return "";
+	}
+
+	// Any thread but the inference one: free the swapped out model.
+	void collect()
+	{
+		delete retired.exchange(nullptr, std::memory_order_acquire);
+	}
+
+	// Inference thread: process the stream until it is closed, and pass
+	// each estimate to the callback.
+	void run(const std::function<void(const doa_estimate_t &)> &on_estimate)
+	{
+		std::vector<int32_t> frames(hops.back() * NCHANNELS);
+		// The last window of frames, for starting a new stream state.
+		std::vector<int32_t> history(window * NCHANNELS);
+		std::vector<float> out;
+		size_t silent_frames = 0;
+		uint64_t pos = 0;
+
+		trace_thread_name("inference");
+		while (ring.wait(hops[hop_level()])) {
+			trace_span_t span("window");
+			const int64_t t_start = doa_now_ns();
+			if (next.load(std::memory_order_relaxed))
+				swap();
+
+			const size_t hop = hops[hop_level()];
+			const size_t n = hop * NCHANNELS;
+			infer_shard->record(m_fill, ring.available());
+			doa_estimate_t e;
+			e.capture_ns = ring.read(frames.data(), hop);
+			e.frame = pos += hop;
+			infer_shard->add(m_windows);
+
+			if (cfg.silence_max && count_valid_samples(silence, frames.data(), n) < silence.nvals_threshold)
+				silent_frames += hop;
+			else
+				silent_frames = 0;
+			doa_engine_t &active = level < hops.size() ? *engine : *fallback;
+			nn_stream_t &stream = active.streams[std::min(level, active.streams.size() - 1)];
+			e.model = active.model.get();
+			e.infer_ns = 0;
+			e.prob = 0;
+			if (silent_frames >= window) {
+				stale = true;
+				infer_shard->add(m_gated);
+				e.done_ns = doa_now_ns();
+				e.cls = -1;
+				on_estimate(e);
+			} else if (cfg.adaptive && 2 * ring.available() > ring.capacity) {
+				// Too far behind to catch up by degrading.
+				stale = true;
+				infer_shard->add(m_skipped);
+				e.done_ns = doa_now_ns();
+				e.cls = -2;
+				on_estimate(e);
+			} else {
+				if (stale) {
+					stream.prime(history.data());
+					stale = false;
+				}
+
+				const int64_t t0 = doa_now_ns();
+				out.resize(e.model->output_size());
+				{
+					trace_span_t infer_span("inference");
+					stream.push(frames.data(), out.data());
+				}
+				e.done_ns = doa_now_ns();
+				e.infer_ns = e.done_ns - t0;
+				e.cls = std::max_element(out.begin(), out.end()) - out.begin();
+				e.prob = out[e.cls];
+				infer_shard->record(m_inference, e.infer_ns);
+				infer_shard->record(m_latency, e.done_ns - e.capture_ns);
+				infer_shard->add(m_estimates);
+				on_estimate(e);
+			}
+
+			std::copy(history.begin() + n, history.end(), history.begin());
+			std::copy(frames.begin(), frames.begin() + n, history.end() - n);
+			if (cfg.adaptive)
+				govern(doa_now_ns() - t_start, hop);
+		}
+	}
+
+	// Once run() has returned: the model which made the last estimates,
+	// or the one offered after it, if any.
+	const nn_model_t *latest_model() const
+	{
+		const doa_engine_t *e = next.load(std::memory_order_acquire);
+		return (e ? e : engine.get())->model.get();
+	}
+
+	// Summed metrics, e.g. for a report at exit.
+	uint64_t total(size_t counter) { return metrics.counter_total(counter); }
+	uint64_t latency_quantile_ns(double q) { return hdr_histogram_t::quantile(metrics.histogram_total(m_latency), q); }
+	uint64_t inference_quantile_ns(double q) { return hdr_histogram_t::quantile(metrics.histogram_total(m_inference), q); }
+
+	size_t m_captured, m_dropped, m_windows, m_gated, m_estimates, m_swaps, m_rejected;
+	size_t m_skipped, m_hop_ups, m_hop_downs, m_fallbacks, m_recoveries;
+
+private:
+	metrics_t &metrics;
+	frame_ring_t ring;
+	// Owned by the inference thread.
+	std::unique_ptr<doa_engine_t> engine, fallback;
+	// Handed over to, and back from, the inference thread.
+	std::atomic<doa_engine_t *> next {nullptr};
+	std::atomic<doa_engine_t *> retired {nullptr};
+	silence_params_t silence {};
+	size_t m_latency, m_inference, m_fill, m_load;
+	metrics_t::shard_t *capture_shard, *infer_shard;
+	// State of the inference thread. The stream is stale when it has not
+	// seen the last window, and needs to be primed from the history.
+	bool stale = false;
+	size_t level = 0, nlevels;
+	size_t level_windows = 0;	// Since the last change of level.
+	size_t level_frames = 0;
+	size_t hold_frames;		// Before stepping back.
+	bool recovered = false;		// The last change of level was a step back.
+	double load = 0;
+	// Copies for the metrics.
+	std::atomic<size_t> level_now {0};
+	std::atomic<double> load_now {0};
+
+	// Inference thread: the level of the current hop.
+	size_t hop_level() const { return std::min(level, hops.size() - 1); }
+
+	void set_silence_hop(size_t hop)
+	{
+		silence.nvals_threshold = double(hop * NCHANNELS) * VALID_SAMPLES_PERCENT / 100.0;
+	}
+
+	// Inference thread: account for the time spent on a window, and move
+	// to another degradation level if the load calls for it.
+	void govern(int64_t busy_ns, size_t hop)
+	{
+		const double window_load = double(busy_ns) * SAMPLES_PER_SECOND / (1e9 * hop);
+		load += (window_load - load) / LOAD_WINDOWS;
+		load_now.store(load, std::memory_order_relaxed);
+		level_windows++;
+		level_frames += hop;
+
+		size_t to = level;
+		if (load > LOAD_HIGH && level_windows >= LOAD_WINDOWS && level + 1 < nlevels) {
+			// Rising again soon after a step back is flapping.
+			if (recovered && level_frames < hold_frames)
+				hold_frames = std::min(2 * hold_frames, size_t(MAX_HOLD_SECONDS * SAMPLES_PER_SECOND));
+			else
+				hold_frames = HOLD_SECONDS * SAMPLES_PER_SECOND;
+			to = level + 1;
+			infer_shard->add(to == hops.size() ? m_fallbacks : m_hop_ups);
+			recovered = false;
+		} else if (load < LOAD_LOW && level > 0 && level_frames >= hold_frames &&
+			   ring.available() < hops[0]) {
+			to = level - 1;
+			infer_shard->add(level == hops.size() ? m_recoveries : m_hop_downs);
+			recovered = true;
+		}
+		if (to == level)
+			return;
+
+		trace_span_t span("degrade");
+		level = to;
+		level_windows = level_frames = 0;
+		level_now.store(level, std::memory_order_relaxed);
+		set_silence_hop(hops[hop_level()]);
+		stale = true;
+	}
+
+	// Inference thread: switch to the offered model. Its streams continue
+	// from the last window of frames.
+	void swap()
+	{
+		trace_span_t span("swap");
+		std::unique_ptr<doa_engine_t> e(next.exchange(nullptr, std::memory_order_acquire));
+		if (level < hops.size())
+			stale = true;
+		std::swap(engine, e);
+		infer_shard->add(m_swaps);
+
+		// The old model is freed by collect(). Only if it has not picked
+		// up the one before yet, which is unlikely, free it here.
+		doa_engine_t *none = nullptr;
+		if (retired.compare_exchange_strong(none, e.get(), std::memory_order_release))
+			e.release();
+	}
+};
+
+// Watch an exported model file, and swap each new version of it into
+// the service. Replace the file atomically, i.e. write the new model to
+// another file, and rename it over the watched one, so that a partially
+// written model is never loaded.
+class doa_model_reloader_t {
+public:
+	// How often to check the file.
+	static const int POLL_MS = 200;
+
+	doa_model_reloader_t(doa_service_t &_service, metrics_t &metrics, const std::filesystem::path &_path)
+		: service(_service), path(_path), shard(metrics.shard()), last(file_id())
+	{
+		thread = std::thread([this]() { run(); });
+	}
+
+	~doa_model_reloader_t()
+	{
+		stop = true;
+		thread.join();
+	}
+
+	// The last version of the model accepted by the service, if any.
+	std::shared_ptr<const nn_model_t> accepted()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return last_accepted;
+	}
+
+private:
+	doa_service_t &service;
+	const std::filesystem::path path;
+	metrics_t::shard_t &shard;
+	std::string last;
+	std::atomic<bool> stop {false};
+	std::mutex mutex;
+	std::shared_ptr<const nn_model_t> last_accepted;
+	std::thread thread;
+
+	// Changes with each new version of the file, or empty if missing.
+	std::string file_id() const
+	{
+		struct stat st;
+		if (stat(path.c_str(), &st) < 0)
+			return "";
+		return std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":" +
+		       std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+	}
+
+	void run()
+	{
+		trace_thread_name("model reloader");
+		while (!stop) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(POLL_MS));
+			service.collect();
+			const std::string id = file_id();
+			if (id.empty() || id == last)
+				continue;
+			last = id;
+
+			// A bad file must not take the service down. It keeps
+			// running the model it has.
+			std::shared_ptr<const nn_model_t> model;
+			std::string err;
+			{
+				trace_span_t span("load model");
+				model = nn_model_t::try_load(path, err);
+			}
+			if (model)
+				err = service.offer(model, shard);
+			else
+				shard.add(service.m_rejected);
+			if (!err.empty()) {
+				std::cerr << "Rejected model " << path << ": " << err << std::endl;
+				continue;
+			}
+			std::cerr << "Reloaded model " << path << std::endl;
+			std::lock_guard<std::mutex> lock(mutex);
+			last_accepted = model;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,112 @@
+# SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Custom Keras layers for the rotation-equivariant DOA model.
+#
+# BeagleMic has 8 microphones placed on a circle. Rotating a sound source
+# by 45 degrees is equivalent to a circular shift of the microphone
+# channels. Layers here treat the microphones as a circular axis, and
+# share their weights along it. Hence the model is equivariant to such
+# shifts by construction, and need not learn all 8 rotations from data.
+#
+# Each layer has a counterpart in the native inference engine (nn-engine.h).
+
+import tensorflow as tf
+from tensorflow import keras
+
+class Denormalize(keras.layers.Layer):
+    """Undo the normalization done by prepare-data.
+
+    Input is (time, mic). Mics 1..N-1 are stored as a difference from
+    mic 0, which does not commute with rotations. Restore the raw audio."""
+    def call(self, x):
+        return tf.concat([x[:, :, :1], x[:, :, 1:] + x[:, :, :1]], axis=2)
+
+class MicCircularConv(keras.layers.Layer):
+    """Convolution over the (time, mic, channel) input.
+
+    Time is not padded. The mic axis is padded circularly."""
+    def __init__(self, filters, kernel_time, kernel_mics=3, stride=1, activation=None, **kwargs):
+        super().__init__(**kwargs)
+        if kernel_mics % 2 == 0:
+            raise ValueError('kernel_mics must be odd')
+        self.filters = filters
+        self.kernel_time = kernel_time
+        self.kernel_mics = kernel_mics
+        self.stride = stride
+        self.activation = keras.activations.get(activation)
+
+    def build(self, input_shape):
+        self.kernel = self.add_weight(name='kernel',
+            shape=(self.kernel_time, self.kernel_mics, input_shape[-1], self.filters),
+            initializer='glorot_uniform')
+        self.bias = self.add_weight(name='bias', shape=(self.filters,), initializer='zeros')
+
+    def call(self, x):
+        p = self.kernel_mics // 2
+        if p:
+            x = tf.concat([x[:, :, -p:, :], x, x[:, :, :p, :]], axis=2)
+        y = tf.nn.conv2d(x, self.kernel, strides=[1, self.stride, 1, 1], padding='VALID')
+        return self.activation(y + self.bias)
+
+    def get_config(self):
+        config = super().get_config()
+        config.update({
+            'filters': self.filters,
+            'kernel_time': self.kernel_time,
+            'kernel_mics': self.kernel_mics,
+            'stride': self.stride,
+            'activation': keras.activations.serialize(self.activation),
+        })
+        return config
+
+class MicDense(keras.layers.Layer):
+    """Dense layer applied to the (time, channel) features of each mic.
+
+    Input is (time, mic, channel), output is (mic, units). Weights
+    are shared between the mics."""
+    def __init__(self, units, activation=None, **kwargs):
+        super().__init__(**kwargs)
+        self.units = units
+        self.activation = keras.activations.get(activation)
+
+    def build(self, input_shape):
+        self.kernel = self.add_weight(name='kernel',
+            shape=(input_shape[1] * input_shape[3], self.units),
+            initializer='glorot_uniform')
+        self.bias = self.add_weight(name='bias', shape=(self.units,), initializer='zeros')
+
+    def call(self, x):
+        x = tf.transpose(x, [0, 2, 1, 3])
+        x = tf.reshape(x, [-1, x.shape[1], x.shape[2] * x.shape[3]])
+        return self.activation(tf.matmul(x, self.kernel) + self.bias)
+
+    def get_config(self):
+        config = super().get_config()
+        config.update({
+            'units': self.units,
+            'activation': keras.activations.serialize(self.activation),
+        })
+        return config
+
+class EquivariantHead(keras.layers.Layer):
+    """Turn per-mic (angle..., silence) logits into class logits.
+
+    Angle classes are ordered mic-major, so that rotating the input by
+    one mic rotates the angle classes by nangles_per_mic. Silence is
+    invariant to rotations, so it is averaged over the mics."""
+    def call(self, x):
+        k = x.shape[2] - 1
+        angles = tf.reshape(x[:, :, :k], [-1, x.shape[1] * k])
+        silence = tf.reduce_mean(x[:, :, k:], axis=1)
+        return tf.concat([angles, silence], axis=1)
+
+def custom_objects():
+    """For passing to keras.models.load_model()."""
+    return {
+        'Denormalize': Denormalize,
+        'MicCircularConv': MicCircularConv,
+        'MicDense': MicDense,
+        'EquivariantHead': EquivariantHead,
+    }
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+
+# SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Export a trained DOA model for the native inference engine.
+# See nn-engine.h for the output file layout.
+#
+# Example invocation:
+#    $ ./export-model.py -m model.h5 -o model.nn
+
+import numpy as np
+import argparse
+import struct
+import json
+import sys
+import os
+
+import tensorflow as tf
+from tensorflow import keras
+
+import doa_layers
+
+# Keep in sync with nn-engine.h!
+NN_MODEL_MAGIC = b'DOANN1\0\0'
+NN_DENSE = 1
+NN_DENORMALIZE = 2
+NN_MIC_CONV = 3
+NN_MIC_DENSE = 4
+NN_EQUIVARIANT_HEAD = 5
+NN_ACTIVATION = 6
+
+NN_ACTIVATIONS = {'linear': 0, 'relu': 1, 'softmax': 2}
+
+def activation_id(layer):
+    name = layer.activation.__name__
+    if name not in NN_ACTIVATIONS:
+        raise ValueError('unsupported activation {} in layer {}'.format(name, layer.name))
+    return NN_ACTIVATIONS[name]
+
+def shape_of(tensor):
+    return [int(d) for d in tensor.shape[1:]]
+
+def export_layer(layer):
+    """Returns (type, params, weights) for a layer, or None if it is a no-op."""
+    if isinstance(layer, (keras.layers.InputLayer, keras.layers.Flatten, keras.layers.Reshape)):
+        # Tensors are flat in the engine.
+        return None
+    in_shape = shape_of(layer.input)
+    out_shape = shape_of(layer.output)
+    w = [np.asarray(v, dtype=np.float32).ravel() for v in layer.get_weights()]
+
+    if isinstance(layer, keras.layers.Dense):
+        if len(in_shape) != 1:
+            raise ValueError('dense layer {} must follow a flatten'.format(layer.name))
+        return NN_DENSE, [in_shape[0], out_shape[0], activation_id(layer)], w
+    if isinstance(layer, doa_layers.Denormalize):
+        return NN_DENORMALIZE, in_shape, w
+    if isinstance(layer, doa_layers.MicCircularConv):
+        t, m, c = in_shape
+        return NN_MIC_CONV, [t, m, c, layer.filters, layer.kernel_time,
+                             layer.kernel_mics, layer.stride, activation_id(layer)], w
+    if isinstance(layer, doa_layers.MicDense):
+        t, m, c = in_shape
+        return NN_MIC_DENSE, [t, m, c, layer.units, activation_id(layer)], w
+    if isinstance(layer, doa_layers.EquivariantHead):
+        m, k = in_shape
+        return NN_EQUIVARIANT_HEAD, [m, k - 1], w
+    if isinstance(layer, keras.layers.Activation):
+        return NN_ACTIVATION, [int(np.prod(in_shape)), activation_id(layer)], w
+    raise ValueError('unsupported layer {} ({})'.format(layer.name, type(layer).__name__))
+
+def export_model(model, class_names, output_filename):
+    layers = [l for l in map(export_layer, model.layers) if l is not None]
+    with open(output_filename, 'wb') as o:
+        o.write(NN_MODEL_MAGIC)
+        o.write(struct.pack('<II', int(np.prod(shape_of(model.input))), len(class_names)))
+        for name in class_names:
+            b = name.encode()
+            o.write(struct.pack('<H', len(b)) + b)
+        o.write(struct.pack('<I', len(layers)))
+        for ltype, params, weights in layers:
+            o.write(struct.pack('<II', ltype, len(params)))
+            o.write(np.asarray(params, dtype='<u4').tobytes())
+            weights = np.concatenate(weights) if weights else np.zeros(0, dtype=np.float32)
+            o.write(struct.pack('<I', len(weights)))
+            o.write(weights.astype('<f4').tobytes())
+    print("Exported {} layers, {} weights.".format(len(layers), model.count_params()))
+
+# Load the mapping of NN output class IDs to their human-readable strings.
+def load_class_names(input_filename):
+    with open(input_filename, 'r') as f:
+        json_str = f.read()
+    return json.loads(json_str)['class_names']
+
+def main():
+    parser = argparse.ArgumentParser(description='Export a DOA model for the native inference engine.')
+    parser.add_argument('-m', '--model', required=True,
+        help = 'NN model file to export')
+    parser.add_argument('-o', '--output', required=True,
+        help = 'Output file for the native inference engine')
+    args = parser.parse_args()
+
+    model = keras.models.load_model(args.model, custom_objects=doa_layers.custom_objects())
+    class_names = load_class_names(os.path.splitext(args.model)[0] + '.json')
+    export_model(model, class_names, args.output)
+
+    sys.exit(0)
+
+main()
@@ -0,0 +1,114 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Minimal radix-2 FFT, sufficient for the short audio chunks we process.
+
+#ifndef DOA_FFT_H
+#define DOA_FFT_H
+
+#include <cstdint>
+#include <cmath>
+
+#include <complex>
+#include <numbers>
+#include <vector>
+
+#include "common.h"
+
+typedef std::complex<float> cfloat;
+
+// Plain complex multiplication. The std::complex operator must handle
+// infinities and NaNs as per C99 Annex G, which is considerably slower.
+static inline cfloat cmul(cfloat a, cfloat b)
+{
+	return cfloat(a.real() * b.real() - a.imag() * b.imag(),
+		      a.real() * b.imag() + a.imag() * b.real());
+}
+
+// In-place complex FFT of a fixed power-of-two size. Twiddle factors
+// and the bit-reversal permutation are precomputed.
+class fft_t {
+public:
+	const size_t n;
+
+	fft_t(size_t _n) : n(_n), twiddles(_n / 2), bitrev(_n)
+	{
+		if (n < 2 || (n & (n - 1)))
+			fatal("FFT size must be a power of two");
+		for (size_t i = 0; i < n / 2; i++)
+			twiddles[i] = std::polar(1.0, -2.0 * std::numbers::pi * i / n);
+		unsigned nbits = 0;
+		while ((size_t(1) << nbits) < n)
+			nbits++;
+		for (size_t i = 0; i < n; i++) {
+			size_t r = 0;
+			for (unsigned b = 0; b < nbits; b++)
+				if (i & (size_t(1) << b))
+					r |= size_t(1) << (nbits - 1 - b);
+			bitrev[i] = r;
+		}
+	}
+
+	void forward(cfloat *x) const { transform(x, false); }
+
+	// Scaled by 1/n, so that inverse(forward(x)) == x.
+	void inverse(cfloat *x) const
+	{
+		transform(x, true);
+		const float scale = 1.0f / n;
+		for (size_t i = 0; i < n; i++)
+			x[i] *= scale;
+	}
+
+	// Transform two real signals with a single complex FFT. Outputs
+	// are the n/2+1 non-negative frequency bins of each signal.
+	void forward_real2(const float *a, const float *b, cfloat *out_a, cfloat *out_b) const
+	{
+		std::vector<cfloat> z(n);
+		for (size_t i = 0; i < n; i++)
+			z[i] = cfloat(a[i], b[i]);
+		forward(z.data());
+		split_real2(z.data(), out_a, out_b);
+	}
+
+	// Separate the transform of z = a + jb into those of a and b.
+	void split_real2(const cfloat *z, cfloat *out_a, cfloat *out_b) const
+	{
+		for (size_t k = 0; k <= n / 2; k++) {
+			const cfloat zk = z[k];
+			const cfloat znk = std::conj(z[(n - k) % n]);
+			out_a[k] = 0.5f * (zk + znk);
+			out_b[k] = cmul(cfloat(0, -0.5f), zk - znk);
+		}
+	}
+
+private:
+	std::vector<cfloat> twiddles;
+	std::vector<uint32_t> bitrev;
+
+	void transform(cfloat *x, bool inverse) const
+	{
+		for (size_t i = 0; i < n; i++)
+			if (i < bitrev[i])
+				std::swap(x[i], x[bitrev[i]]);
+
+		for (size_t len = 2; len <= n; len *= 2) {
+			const size_t half = len / 2;
+			const size_t tstep = n / len;
+			for (size_t i = 0; i < n; i += len) {
+				for (size_t j = 0; j < half; j++) {
+					cfloat w = twiddles[j * tstep];
+					if (inverse)
+						w = std::conj(w);
+					const cfloat u = x[i + j];
+					const cfloat v = cmul(x[i + j + half], w);
+					x[i + j] = u + v;
+					x[i + j + half] = u - v;
+				}
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,463 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Minimal FLAC decoder, sufficient for archived microphone recordings.
+//
+// All FLAC frames are independent of each other. Once the frames are
+// located, by a quick scan for their sync codes, any of them can be
+// decoded on its own, in parallel with the others.
+//
+// Supported are all the subframe types and residual codings of the
+// format, with up to 32 bits per sample. The CRC of each frame is
+// checked. The MD5 signature of the whole stream is not.
+
+#ifndef DOA_FLAC_H
+#define DOA_FLAC_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+class flac_stream_t {
+public:
+	struct frame_t {
+		size_t offset;		// In the file.
+		size_t size;		// In bytes.
+		uint64_t first;		// Sample per channel.
+		uint32_t nsamples;	// Per channel.
+	};
+
+	unsigned nchannels;
+	unsigned bps;
+	unsigned sample_rate;
+	std::vector<frame_t> frames;
+
+	// Parse the metadata, and locate all frames of the mapped file.
+	flac_stream_t(const uint8_t *_data, size_t _len, const std::string &_path)
+		: data(_data), len(_len), path(_path)
+	{
+		if (len < 8 || std::memcmp(data, "fLaC", 4))
+			fatal("\"" + path + "\" is not a FLAC file");
+
+		size_t pos = 4;
+		bool last = false, have_info = false;
+		while (!last) {
+			if (pos + 4 > len)
+				fatal("truncated FLAC metadata in \"" + path + "\"");
+			last = data[pos] & 0x80;
+			const unsigned type = data[pos] & 0x7f;
+			const size_t n = data[pos + 1] << 16 | data[pos + 2] << 8 | data[pos + 3];
+			pos += 4;
+			if (pos + n > len)
+				fatal("truncated FLAC metadata in \"" + path + "\"");
+			if (type == 0 && n >= 34) {
+				bit_reader_t r(data + pos, n);
+				r.skip(16 + 16 + 24 + 24);
+				sample_rate = r.read(20);
+				nchannels = r.read(3) + 1;
+				bps = r.read(5) + 1;
+				// Two reads, in this order.
+				const uint64_t total_hi = r.read(4);
+				total_samples = total_hi << 32 | r.read(32);
+				have_info = true;
+			}
+			pos += n;
+		}
+		if (!have_info)
+			fatal("no STREAMINFO in \"" + path + "\"");
+
+		index_frames(pos);
+	}
+
+	uint64_t nsamples() const
+	{
+		return frames.empty() ? 0 : frames.back().first + frames.back().nsamples;
+	}
+
+	// Decode frame k to interleaved samples. The buffer has room for
+	// frames[k].nsamples * nchannels of them.
+	void decode(size_t k, int32_t *out) const
+	{
+		const frame_t &f = frames[k];
+		if (crc16(data + f.offset, f.size - 2) != (data[f.offset + f.size - 2] << 8 | data[f.offset + f.size - 1]))
+			fatal("CRC mismatch in frame " + std::to_string(k) + " of \"" + path + "\"");
+
+		header_t h;
+		size_t hlen;
+		if (!parse_header(f.offset, h, hlen))
+			fatal("bad header of frame " + std::to_string(k) + " of \"" + path + "\"");
+		bit_reader_t r(data + f.offset + hlen, f.size - hlen - 2);
+
+		thread_local std::vector<int64_t> chan;
+		chan.resize(size_t(h.nsamples) * h.nchannels);
+		for (unsigned c = 0; c < h.nchannels; c++) {
+			// The side channel takes an extra bit.
+			const bool side = (h.assignment == 8 && c == 1) || (h.assignment == 9 && c == 0) ||
+					  (h.assignment == 10 && c == 1);
+			decode_subframe(r, h.bps + side, h.nsamples, &chan[size_t(c) * h.nsamples], k);
+		}
+		if (r.overrun())
+			fatal("corrupt frame " + std::to_string(k) + " of \"" + path + "\"");
+
+		const int64_t *a = &chan[0], *b = &chan[h.nsamples];
+		for (uint32_t i = 0; i < h.nsamples; i++) {
+			switch (h.assignment) {
+			case 8:		// Left, side.
+				out[2 * i] = a[i];
+				out[2 * i + 1] = a[i] - b[i];
+				break;
+			case 9:		// Side, right.
+				out[2 * i] = a[i] + b[i];
+				out[2 * i + 1] = b[i];
+				break;
+			case 10: {	// Mid, side.
+				const int64_t mid = (a[i] << 1) | (b[i] & 1);
+				out[2 * i] = (mid + b[i]) >> 1;
+				out[2 * i + 1] = (mid - b[i]) >> 1;
+				break;
+			}
+			default:
+				for (unsigned c = 0; c < h.nchannels; c++)
+					out[size_t(i) * h.nchannels + c] = chan[size_t(c) * h.nsamples + i];
+			}
+		}
+	}
+
+private:
+	const uint8_t *data;
+	size_t len;
+	const std::string path;
+	uint64_t total_samples = 0;	// Or 0 if unknown.
+
+	// Big-endian bit stream of a frame. Reads past its end return zeros,
+	// and are reported by overrun().
+	class bit_reader_t {
+	public:
+		bit_reader_t(const uint8_t *_p, size_t _n) : p(_p), n(_n) {}
+
+		// Up to 57 bits.
+		uint64_t read(unsigned nbits)
+		{
+			if (!nbits)
+				return 0;
+			const uint64_t v = (load(pos >> 3) << (pos & 7)) >> (64 - nbits);
+			pos += nbits;
+			return v;
+		}
+
+		int64_t read_signed(unsigned nbits)
+		{
+			if (!nbits)
+				return 0;
+			const int64_t v = int64_t(load(pos >> 3) << (pos & 7)) >> (64 - nbits);
+			pos += nbits;
+			return v;
+		}
+
+		void skip(size_t nbits) { pos += nbits; }
+
+		// Number of zeros before the next one, which is skipped too.
+		uint64_t read_unary()
+		{
+			uint64_t zeros = 0;
+			for (;;) {
+				const uint64_t v = load(pos >> 3) << (pos & 7);
+				if (v) {
+					const unsigned z = __builtin_clzll(v);
+					pos += z + 1;
+					return zeros + z;
+				}
+				zeros += 64 - (pos & 7);
+				pos += 64 - (pos & 7);
+				if (overrun())
+					return zeros;
+			}
+		}
+
+		// A Rice-coded signed value with parameter k.
+		int64_t read_rice(unsigned k)
+		{
+			const uint64_t v = load(pos >> 3) << (pos & 7);
+			uint64_t u;
+			// Usually the whole code is within the loaded bits.
+			if (v && __builtin_clzll(v) + 1 + k <= 57) {
+				const unsigned z = __builtin_clzll(v);
+				u = uint64_t(z) << k | (k ? (v << (z + 1)) >> (64 - k) : 0);
+				pos += z + 1 + k;
+			} else {
+				u = read_unary() << k;
+				u |= read(k);
+			}
+			return int64_t(u >> 1) ^ -int64_t(u & 1);
+		}
+
+		void align() { pos = (pos + 7) & ~size_t(7); }
+		bool overrun() const { return pos > n * 8; }
+
+	private:
+		const uint8_t *p;
+		const size_t n;
+		size_t pos = 0;
+
+		uint64_t load(size_t byte) const
+		{
+			uint64_t v = 0;
+			if (byte + 8 <= n) {
+				std::memcpy(&v, p + byte, 8);
+				return __builtin_bswap64(v);
+			}
+			for (unsigned i = 0; i < 8; i++)
+				v = v << 8 | (byte + i < n ? p[byte + i] : 0);
+			return v;
+		}
+	};
+
+	struct header_t {
+		bool variable;
+		uint32_t nsamples;
+		unsigned assignment;
+		unsigned nchannels;
+		unsigned bps;
+		uint64_t number;	// Of the frame, or of the first sample if variable.
+	};
+
+	static uint8_t crc8(const uint8_t *p, size_t n)
+	{
+		uint8_t crc = 0;
+		while (n--) {
+			crc ^= *p++;
+			for (int i = 0; i < 8; i++)
+				crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+		return crc;
+	}
+
+	static uint16_t crc16(const uint8_t *p, size_t n)
+	{
+		static const auto table = []() {
+			std::vector<uint16_t> t(256);
+			for (unsigned i = 0; i < 256; i++) {
+				uint16_t crc = i << 8;
+				for (int j = 0; j < 8; j++)
+					crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+				t[i] = crc;
+			}
+			return t;
+		}();
+		uint16_t crc = 0;
+		while (n--)
+			crc = (crc << 8) ^ table[(crc >> 8) ^ *p++];
+		return crc;
+	}
+
+	// Parse a frame header at the given offset. Returns false if there is
+	// none, e.g. at a false sync code in the middle of a frame.
+	bool parse_header(size_t off, header_t &h, size_t &hlen) const
+	{
+		if (off + 6 > len || data[off] != 0xff || (data[off + 1] & 0xfe) != 0xf8)
+			return false;
+		const uint8_t *p = data + off;
+		h.variable = p[1] & 1;
+		const unsigned bs_code = p[2] >> 4, sr_code = p[2] & 15;
+		h.assignment = p[3] >> 4;
+		const unsigned ss_code = (p[3] >> 1) & 7;
+		if (bs_code == 0 || sr_code == 15 || h.assignment > 10 || ss_code == 3 || (p[3] & 1))
+			return false;
+
+		// The frame or sample number, coded like UTF-8.
+		size_t i = 4;
+		unsigned extra = 0;
+		uint64_t num = p[i];
+		if (num >= 0x80) {
+			while (num & (0x40 >> extra))
+				extra++;
+			if (extra == 0 || extra > 6)
+				return false;
+			num &= 0x3f >> extra;
+		}
+		i++;
+		// Room for the rest of the header, at most 5 bytes.
+		if (off + i + extra + 5 > len)
+			return false;
+		for (unsigned j = 0; j < extra; j++, i++) {
+			if ((p[i] & 0xc0) != 0x80)
+				return false;
+			num = num << 6 | (p[i] & 0x3f);
+		}
+		h.number = num;
+
+		if (bs_code == 1)
+			h.nsamples = 192;
+		else if (bs_code <= 5)
+			h.nsamples = 576 << (bs_code - 2);
+		else if (bs_code == 6)
+			h.nsamples = p[i++] + 1;
+		else if (bs_code == 7)
+			h.nsamples = (p[i] << 8 | p[i + 1]) + 1, i += 2;
+		else
+			h.nsamples = 256 << (bs_code - 8);
+
+		if (sr_code == 12)
+			i += 1;
+		else if (sr_code == 13 || sr_code == 14)
+			i += 2;
+
+		if (off + i + 1 > len || crc8(p, i) != p[i])
+			return false;
+		hlen = i + 1;
+
+		static const unsigned sizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+		h.bps = ss_code ? sizes[ss_code] : bps;
+		h.nchannels = h.assignment < 8 ? h.assignment + 1 : 2;
+		return h.nchannels == nchannels && h.bps == bps;
+	}
+
+	// Find the frames, each starting with a valid header, and numbered
+	// after the one before.
+	void index_frames(size_t pos)
+	{
+		uint64_t next_sample = 0;
+		header_t h;
+		size_t hlen;
+		while (pos < len) {
+			if (!parse_header(pos, h, hlen))
+				fatal("no FLAC frame at offset " + std::to_string(pos) + " of \"" + path + "\"");
+			frames.push_back({pos, 0, next_sample, h.nsamples});
+			next_sample += h.nsamples;
+			const bool variable = h.variable;
+
+			// The next frame is at the next sync code with a valid header,
+			// which continues the numbering. A false sync code in the
+			// middle of a frame passes all this very rarely, and then
+			// the CRC check at decoding catches it.
+			size_t next = len;
+			for (size_t s = pos + hlen; s + 1 < len; s++) {
+				const uint8_t *q = static_cast<const uint8_t *>(std::memchr(data + s, 0xff, len - s - 1));
+				if (!q)
+					break;
+				s = q - data;
+				if ((q[1] & 0xfe) != 0xf8)
+					continue;
+				header_t nh;
+				size_t nhlen;
+				if (parse_header(s, nh, nhlen) && nh.variable == variable &&
+				    nh.number == (variable ? next_sample : frames.size())) {
+					next = s;
+					break;
+				}
+			}
+			frames.back().size = next - pos;
+			if (frames.back().size < hlen + 2)
+				fatal("truncated FLAC frame in \"" + path + "\"");
+			pos = next;
+		}
+		if (total_samples && total_samples != next_sample)
+			fatal("\"" + path + "\" has " + std::to_string(next_sample) + " samples, instead of " +
+			      std::to_string(total_samples));
+	}
+
+	void decode_subframe(bit_reader_t &r, unsigned sbps, uint32_t n, int64_t *out, size_t k) const
+	{
+		if (r.read(1))
+			fatal("bad subframe in frame " + std::to_string(k) + " of \"" + path + "\"");
+		const unsigned type = r.read(6);
+		unsigned wasted = 0;
+		if (r.read(1))
+			wasted = r.read_unary() + 1;
+		if (wasted >= sbps)
+			fatal("bad wasted bits in frame " + std::to_string(k) + " of \"" + path + "\"");
+		sbps -= wasted;
+
+		if (type == 0) {
+			const int64_t v = r.read_signed(sbps);
+			for (uint32_t i = 0; i < n; i++)
+				out[i] = v;
+		} else if (type == 1) {
+			for (uint32_t i = 0; i < n; i++)
+				out[i] = r.read_signed(sbps);
+		} else if (type >= 8 && type <= 12) {
+			const unsigned order = type - 8;
+			if (order > n)
+				fatal("bad predictor order in frame " + std::to_string(k) + " of \"" + path + "\"");
+			for (unsigned i = 0; i < order; i++)
+				out[i] = r.read_signed(sbps);
+			decode_residual(r, order, n, out, k);
+			restore_fixed(order, n, out);
+		} else if (type >= 32) {
+			const unsigned order = type - 31;
+			if (order > n)
+				fatal("bad predictor order in frame " + std::to_string(k) + " of \"" + path + "\"");
+			for (unsigned i = 0; i < order; i++)
+				out[i] = r.read_signed(sbps);
+			const unsigned precision = r.read(4) + 1;
+			const int shift = r.read_signed(5);
+			if (precision == 16 || shift < 0)
+				fatal("bad LPC parameters in frame " + std::to_string(k) + " of \"" + path + "\"");
+			int64_t coefs[32];
+			for (unsigned i = 0; i < order; i++)
+				coefs[i] = r.read_signed(precision);
+			decode_residual(r, order, n, out, k);
+			for (uint32_t i = order; i < n; i++) {
+				int64_t sum = 0;
+				for (unsigned j = 0; j < order; j++)
+					sum += coefs[j] * out[i - 1 - j];
+				out[i] += sum >> shift;
+			}
+		} else {
+			fatal("reserved subframe type in frame " + std::to_string(k) + " of \"" + path + "\"");
+		}
+
+		if (wasted)
+			for (uint32_t i = 0; i < n; i++)
+				out[i] <<= wasted;
+	}
+
+	// The residual is stored after the warm-up samples.
+	void decode_residual(bit_reader_t &r, unsigned order, uint32_t n, int64_t *out, size_t k) const
+	{
+		const unsigned method = r.read(2);
+		if (method > 1)
+			fatal("reserved residual coding in frame " + std::to_string(k) + " of \"" + path + "\"");
+		const unsigned param_bits = method ? 5 : 4;
+		const unsigned escape = (1u << param_bits) - 1;
+		const unsigned porder = r.read(4);
+		const uint32_t psize = n >> porder;
+		if ((psize << porder) != n || psize < order)
+			fatal("bad residual partitions in frame " + std::to_string(k) + " of \"" + path + "\"");
+
+		uint32_t i = order;
+		for (uint32_t part = 0; part < (1u << porder); part++) {
+			const uint32_t end = (part + 1) * psize;
+			const unsigned param = r.read(param_bits);
+			if (param == escape) {
+				const unsigned nbits = r.read(5);
+				for (; i < end; i++)
+					out[i] = r.read_signed(nbits);
+			} else {
+				for (; i < end; i++)
+					out[i] = r.read_rice(param);
+			}
+			if (r.overrun())
+				return;
+		}
+	}
+
+	static void restore_fixed(unsigned order, uint32_t n, int64_t *s)
+	{
+		for (uint32_t i = order; i < n; i++) {
+			switch (order) {
+			case 1: s[i] += s[i - 1]; break;
+			case 2: s[i] += 2 * s[i - 1] - s[i - 2]; break;
+			case 3: s[i] += 3 * s[i - 1] - 3 * s[i - 2] + s[i - 3]; break;
+			case 4: s[i] += 4 * s[i - 1] - 6 * s[i - 2] + 4 * s[i - 3] - s[i - 4]; break;
+			}
+		}
+	}
+};
+
+#endif
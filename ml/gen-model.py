@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+
+# SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Generate C++ code for an exported DOA model (see export-model.py).
+#
+# The generic inference engine reads the layers and their shapes at run
+# time. Here they are instead compiled in: each layer becomes a call to
+# a kernel from nn-kernels.h, with all shapes as template arguments. The
+# weights are pre-packed for these kernels into a binary file next to the
+# C++ one, which embeds them into .rodata. Compiling millions of float
+# literals would take ages.
+#
+# Example invocation:
+#    $ ./export-model.py -m model.h5 -o model.nn
+#    $ ./gen-model.py -m model.nn -o model-gen.cc
+#
+# This writes model-gen.cc and model-gen.bin. Compile the former from
+# the directory of the latter, and link with code using nn-generated.h.
+
+import numpy as np
+import argparse
+import struct
+import sys
+import os
+
+# Keep in sync with nn-engine.h!
+NN_MODEL_MAGIC = b'DOANN1\0\0'
+NN_DENSE = 1
+NN_DENORMALIZE = 2
+NN_MIC_CONV = 3
+NN_MIC_DENSE = 4
+NN_EQUIVARIANT_HEAD = 5
+NN_ACTIVATION = 6
+
+NN_ACTIVATIONS = ['NN_ACT_LINEAR', 'NN_ACT_RELU', 'NN_ACT_SOFTMAX']
+
+# Keep in sync with nn-kernels.h!
+NN_PACK_ALIGN = 16
+
+def packed(n):
+    return (n + NN_PACK_ALIGN - 1) // NN_PACK_ALIGN * NN_PACK_ALIGN
+
+def read_model(filename):
+    with open(filename, 'rb') as f:
+        data = f.read()
+    if data[:8] != NN_MODEL_MAGIC:
+        raise ValueError('{} is not a DOA model'.format(filename))
+    pos = 8
+    def u32():
+        nonlocal pos
+        v, = struct.unpack_from('<I', data, pos)
+        pos += 4
+        return v
+    input_size = u32()
+    class_names = []
+    for _ in range(u32()):
+        n, = struct.unpack_from('<H', data, pos)
+        class_names.append(data[pos + 2:pos + 2 + n].decode())
+        pos += 2 + n
+    layers = []
+    for _ in range(u32()):
+        ltype = u32()
+        params = [u32() for _ in range(u32())]
+        n = u32()
+        weights = np.frombuffer(data, dtype='<f4', count=n, offset=pos)
+        pos += 4 * n
+        layers.append((ltype, params, weights))
+    return input_size, class_names, layers
+
+def pack_matrix(weights, nrows, ncols):
+    """[nrows][ncols] matrix and bias, with ncols padded."""
+    p = packed(ncols)
+    w = np.zeros((nrows + 1, p), dtype=np.float32)
+    w[:nrows, :ncols] = weights[:nrows * ncols].reshape(nrows, ncols)
+    w[nrows, :ncols] = weights[nrows * ncols:]
+    return w.ravel()
+
+def gen_layer(ltype, params, weights):
+    """Returns the kernel call template, its output size, and the packed weights."""
+    if ltype == NN_DENSE:
+        nin, nout, act = params
+        return ('nn_k_dense<{}, {}, {}>'.format(nin, nout, NN_ACTIVATIONS[act]),
+                nout, pack_matrix(weights, nin, nout))
+    if ltype == NN_DENORMALIZE:
+        t, m = params
+        return 'nn_k_denormalize<{}, {}>'.format(t, m), t * m, None
+    if ltype == NN_MIC_CONV:
+        t, m, c, f, kt, km, s, act = params
+        ot = (t - kt) // s + 1
+        return ('nn_k_mic_conv<{}, {}, {}, {}, {}, {}, {}, {}>'.format(
+                    t, m, c, f, kt, km, s, NN_ACTIVATIONS[act]),
+                ot * m * f, pack_matrix(weights, kt * km * c, f))
+    if ltype == NN_MIC_DENSE:
+        t, m, c, o, act = params
+        return ('nn_k_mic_dense<{}, {}, {}, {}, {}>'.format(t, m, c, o, NN_ACTIVATIONS[act]),
+                m * o, pack_matrix(weights, t * c, o))
+    if ltype == NN_EQUIVARIANT_HEAD:
+        m, k = params
+        return 'nn_k_equivariant_head<{}, {}>'.format(m, k), m * k + 1, None
+    if ltype == NN_ACTIVATION:
+        n, act = params
+        return 'nn_k_activation<{}, {}>'.format(n, NN_ACTIVATIONS[act]), n, None
+    raise ValueError('unsupported layer type {}'.format(ltype))
+
+def generate(model_filename, output_filename):
+    input_size, class_names, layers = read_model(model_filename)
+    bin_filename = os.path.splitext(output_filename)[0] + '.bin'
+
+    calls = []
+    blobs = []
+    offset = 0
+    max_size = input_size
+    for ltype, params, weights in layers:
+        kernel, out_size, w = gen_layer(ltype, params, weights)
+        max_size = max(max_size, out_size)
+        if w is None:
+            calls.append((kernel, None))
+        else:
+            calls.append((kernel, offset))
+            blobs.append(w)
+            # Keep each layer's weights aligned to a cache line.
+            pad = (-len(w)) % NN_PACK_ALIGN
+            blobs.append(np.zeros(pad, dtype=np.float32))
+            offset += len(w) + pad
+
+    with open(bin_filename, 'wb') as o:
+        for b in blobs:
+            o.write(b.astype('<f4').tobytes())
+
+    out = []
+    out.append('// Generated by gen-model.py from {}. Do not edit.'.format(os.path.basename(model_filename)))
+    out.append('')
+    out.append('#include "nn-generated.h"')
+    out.append('#include "nn-kernels.h"')
+    out.append('')
+    out.append('asm(".section .rodata\\n"')
+    out.append('    ".balign 64\\n"')
+    out.append('    "nn_generated_weights:\\n"')
+    out.append('    ".incbin \\"{}\\"\\n"'.format(os.path.basename(bin_filename)))
+    out.append('    ".previous\\n");')
+    out.append('extern "C" const float nn_generated_weights[{}];'.format(max(offset, 1)))
+    out.append('')
+    out.append('static const char *const class_names[] = {')
+    for name in class_names:
+        out.append('\t"{}",'.format(name.replace('\\', '\\\\').replace('"', '\\"')))
+    out.append('};')
+    out.append('')
+    out.append('static void predict(const float *in, float *out)')
+    out.append('{')
+    out.append('\talignas(64) float bufs[2][{}];'.format(max_size))
+    out.append('\tconst float *w = nn_generated_weights;')
+    out.append('')
+    src = 'in'
+    for li, (kernel, woffset) in enumerate(calls):
+        dst = 'out' if li + 1 == len(calls) else 'bufs[{}]'.format(li % 2)
+        args = [src, dst] + ([] if woffset is None else ['w + {}'.format(woffset)])
+        out.append('\t{}({});'.format(kernel, ', '.join(args)))
+        src = dst
+    out.append('}')
+    out.append('')
+    out.append('const nn_generated_model_t nn_generated_model = {')
+    out.append('\t{},'.format(input_size))
+    out.append('\t{},'.format(len(class_names)))
+    out.append('\tclass_names,')
+    out.append('\tpredict,')
+    out.append('};')
+
+    with open(output_filename, 'w') as o:
+        o.write('\n'.join(out) + '\n')
+    print("Generated {} layers, {} packed weights.".format(len(calls), offset))
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate C++ code for an exported DOA model.')
+    parser.add_argument('-m', '--model', required=True,
+        help = 'Exported model file, see export-model.py')
+    parser.add_argument('-o', '--output', required=True,
+        help = 'Output C++ file. Weights go to a .bin file next to it.')
+    args = parser.parse_args()
+
+    generate(args.model, args.output)
+
+    sys.exit(0)
+
+main()
@@ -0,0 +1,424 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Metrics of a long-running service, exported in the Prometheus text
+// format over HTTP, on a local TCP port or a Unix socket:
+//    $ curl http://127.0.0.1:9464/metrics
+//    $ curl --unix-socket /run/doa.sock http://localhost/metrics
+//
+// The audio path must neither take locks, nor contend on shared cache
+// lines. Hence each thread updates its own shard of the counters and
+// histograms with relaxed stores, and the shards are summed on a scrape.
+
+#ifndef DOA_METRICS_H
+#define DOA_METRICS_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+
+// Single-writer counter. Cheaper than fetch_add, which locks the bus.
+static inline void metric_inc(std::atomic<uint64_t> &c, uint64_t n = 1)
+{
+	c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// High dynamic range histogram with log-linear buckets: each power of 2
+// is split into 2^SUB_BITS equal buckets. Hence any value, from 1 to
+// 2^MAX_BITS, is known within 1/2^SUB_BITS = 6%.
+class hdr_histogram_t {
+public:
+	static const unsigned SUB_BITS = 4;
+	static const unsigned MAX_BITS = 40;
+	static const size_t NBUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+	static size_t bucket(uint64_t v)
+	{
+		if (v < (1u << SUB_BITS))
+			return v;
+		const unsigned msb = 63 - __builtin_clzll(v);
+		if (msb >= MAX_BITS)
+			return NBUCKETS - 1;
+		const unsigned shift = msb - SUB_BITS;
+		return ((shift + 1) << SUB_BITS) + ((v >> shift) & ((1u << SUB_BITS) - 1));
+	}
+
+	// Smallest value in the bucket.
+	static uint64_t bucket_low(size_t b)
+	{
+		if (b < (1u << SUB_BITS))
+			return b;
+		const unsigned shift = (b >> SUB_BITS) - 1;
+		return ((1u << SUB_BITS) + (b & ((1u << SUB_BITS) - 1))) << shift;
+	}
+
+	// Largest value in the bucket.
+	static uint64_t bucket_high(size_t b)
+	{
+		return bucket_low(b + 1) - 1;
+	}
+
+	void record(uint64_t v)
+	{
+		metric_inc(counts[bucket(v)]);
+		metric_inc(sum, v);
+	}
+
+	// Add the counts to a snapshot.
+	void add_to(std::vector<uint64_t> &snap, uint64_t &snap_sum) const
+	{
+		for (size_t b = 0; b < NBUCKETS; b++)
+			snap[b] += counts[b].load(std::memory_order_relaxed);
+		snap_sum += sum.load(std::memory_order_relaxed);
+	}
+
+	// Value below which the given fraction of a snapshot's values are.
+	static uint64_t quantile(const std::vector<uint64_t> &snap, double q)
+	{
+		uint64_t n = 0;
+		for (auto c : snap)
+			n += c;
+		if (n == 0)
+			return 0;
+		const uint64_t rank = std::max<uint64_t>(1, std::ceil(q * n));
+		uint64_t seen = 0;
+		for (size_t b = 0; b < NBUCKETS; b++) {
+			seen += snap[b];
+			if (seen >= rank)
+				return bucket_high(b);
+		}
+		return bucket_high(NBUCKETS - 1);
+	}
+
+private:
+	std::atomic<uint64_t> counts[NBUCKETS] {};
+	std::atomic<uint64_t> sum {0};
+};
+
+class metrics_t {
+public:
+	// Per-thread storage of all counters and histograms. Only the
+	// owning thread may update it.
+	class alignas(64) shard_t {
+	public:
+		void add(size_t counter, uint64_t n = 1) { metric_inc(counters[counter], n); }
+		void record(size_t hist, uint64_t v) { hists[hist].record(v); }
+
+	private:
+		friend class metrics_t;
+		std::unique_ptr<std::atomic<uint64_t>[]> counters;
+		std::unique_ptr<hdr_histogram_t[]> hists;
+	};
+
+	// All metrics must be defined before the first shard is created.
+
+	size_t counter(const std::string &name, const std::string &help)
+	{
+		counter_defs.push_back({name, help});
+		return counter_defs.size() - 1;
+	}
+
+	// Values are recorded as integers, and exported multiplied by scale,
+	// e.g. nanoseconds as seconds. Buckets are exported cumulatively at
+	// the given boundaries, within the precision of hdr_histogram_t.
+	size_t histogram(const std::string &name, const std::string &help,
+			 double scale, const std::vector<double> &bounds)
+	{
+		hist_defs.push_back({name, help, scale, bounds});
+		return hist_defs.size() - 1;
+	}
+
+	// Gauge computed on each scrape.
+	void gauge(const std::string &name, const std::string &help, std::function<double()> fn)
+	{
+		gauge_defs.push_back({name, help, fn, SIZE_MAX, SIZE_MAX});
+	}
+
+	// Gauge of the ratio of two counters.
+	void ratio(const std::string &name, const std::string &help, size_t num, size_t den)
+	{
+		gauge_defs.push_back({name, help, nullptr, num, den});
+	}
+
+	// Gauge of the per-second rate of a counter, since the last scrape.
+	void rate(const std::string &name, const std::string &help, size_t counter)
+	{
+		gauge_defs.push_back({name, help, nullptr, counter, SIZE_MAX});
+	}
+
+	// Boundaries 1, 2, 5, 10, 20, 50... from lo up to hi.
+	static std::vector<double> bounds_125(double lo, double hi)
+	{
+		std::vector<double> b;
+		for (double decade = lo; decade <= hi * 1.0001; decade *= 10)
+			for (double m : {1.0, 2.0, 5.0})
+				if (decade * m <= hi * 1.0001)
+					b.push_back(decade * m);
+		return b;
+	}
+
+	// Create the shard of the calling thread. Takes a lock, so call it
+	// once when the thread starts.
+	shard_t &shard()
+	{
+		auto s = std::make_unique<shard_t>();
+		s->counters.reset(new std::atomic<uint64_t>[counter_defs.size()] {});
+		s->hists.reset(new hdr_histogram_t[hist_defs.size()]);
+		std::lock_guard<std::mutex> lock(mutex);
+		shards.push_back(std::move(s));
+		return *shards.back();
+	}
+
+	// Sum of a counter over all shards.
+	uint64_t counter_total(size_t c)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return counter_total_locked(c);
+	}
+
+	// Summed histogram over all shards.
+	std::vector<uint64_t> histogram_total(size_t h)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<uint64_t> snap(hdr_histogram_t::NBUCKETS);
+		uint64_t sum = 0;
+		for (const auto &s : shards)
+			s->hists[h].add_to(snap, sum);
+		return snap;
+	}
+
+	// All metrics in the Prometheus text exposition format.
+	std::string scrape()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::ostringstream o;
+		o.precision(9);
+
+		for (size_t c = 0; c < counter_defs.size(); c++) {
+			header(o, counter_defs[c].name, counter_defs[c].help, "counter");
+			o << counter_defs[c].name << " " << counter_total_locked(c) << "\n";
+		}
+
+		const double now = std::chrono::duration<double>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		for (auto &g : gauge_defs) {
+			double v;
+			if (g.fn) {
+				v = g.fn();
+			} else if (g.den != SIZE_MAX) {
+				const uint64_t den = counter_total_locked(g.den);
+				v = den ? double(counter_total_locked(g.num)) / den : 0;
+			} else {
+				const uint64_t n = counter_total_locked(g.num);
+				v = g.last_time ? (n - g.last_value) / std::max(now - g.last_time, 1e-9) : 0;
+				g.last_value = n;
+				g.last_time = now;
+			}
+			header(o, g.name, g.help, "gauge");
+			o << g.name << " " << v << "\n";
+		}
+
+		for (size_t h = 0; h < hist_defs.size(); h++) {
+			const auto &d = hist_defs[h];
+			std::vector<uint64_t> snap(hdr_histogram_t::NBUCKETS);
+			uint64_t sum = 0, n = 0;
+			for (const auto &s : shards)
+				s->hists[h].add_to(snap, sum);
+
+			header(o, d.name, d.help, "histogram");
+			size_t b = 0;
+			for (double le : d.bounds) {
+				for (; b < hdr_histogram_t::NBUCKETS && hdr_histogram_t::bucket_high(b) * d.scale <= le; b++)
+					n += snap[b];
+				o << d.name << "_bucket{le=\"" << le << "\"} " << n << "\n";
+			}
+			for (; b < hdr_histogram_t::NBUCKETS; b++)
+				n += snap[b];
+			o << d.name << "_bucket{le=\"+Inf\"} " << n << "\n";
+			o << d.name << "_sum " << sum * d.scale << "\n";
+			o << d.name << "_count " << n << "\n";
+
+			// Each quantile is the upper edge of an HDR histogram bucket,
+			// so it is accurate to the bucket width, 1/2^SUB_BITS of it.
+			const std::string qname = d.name + "_quantile";
+			header(o, qname, d.help + " Quantiles.", "gauge");
+			for (double q : {0.5, 0.9, 0.99, 0.999, 1.0})
+				o << qname << "{quantile=\"" << q << "\"} "
+				  << hdr_histogram_t::quantile(snap, q) * d.scale << "\n";
+		}
+		return o.str();
+	}
+
+private:
+	struct counter_def_t {
+		std::string name, help;
+	};
+	struct hist_def_t {
+		std::string name, help;
+		double scale;
+		std::vector<double> bounds;
+	};
+	struct gauge_def_t {
+		std::string name, help;
+		std::function<double()> fn;
+		size_t num, den;
+		uint64_t last_value = 0;
+		double last_time = 0;
+	};
+
+	std::vector<counter_def_t> counter_defs;
+	std::vector<hist_def_t> hist_defs;
+	std::vector<gauge_def_t> gauge_defs;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<shard_t>> shards;
+
+	uint64_t counter_total_locked(size_t c) const
+	{
+		uint64_t n = 0;
+		for (const auto &s : shards)
+			n += s->counters[c].load(std::memory_order_relaxed);
+		return n;
+	}
+
+	static void header(std::ostream &o, const std::string &name, const std::string &help,
+			   const char *type)
+	{
+		o << "# HELP " << name << " " << help << "\n";
+		o << "# TYPE " << name << " " << type << "\n";
+	}
+};
+
+// Minimal HTTP server, answering "GET /metrics" with a scrape. Serves one
+// client at a time, which is plenty for a scraper.
+class metrics_server_t {
+public:
+	// Listen on the loopback interface.
+	metrics_server_t(metrics_t &_metrics, int port) : metrics(_metrics)
+	{
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			fatal("failed to create the metrics socket");
+		const int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in a {};
+		a.sin_family = AF_INET;
+		a.sin_port = htons(port);
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(fd, (sockaddr *)&a, sizeof(a)) < 0)
+			fatal("failed to bind the metrics port " + std::to_string(port));
+		start();
+	}
+
+	metrics_server_t(metrics_t &_metrics, const std::string &_unix_path)
+		: metrics(_metrics), unix_path(_unix_path)
+	{
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			fatal("failed to create the metrics socket");
+		sockaddr_un a {};
+		a.sun_family = AF_UNIX;
+		if (unix_path.size() >= sizeof(a.sun_path))
+			fatal("metrics socket path is too long");
+		std::strcpy(a.sun_path, unix_path.c_str());
+		unlink(unix_path.c_str());
+		if (bind(fd, (sockaddr *)&a, sizeof(a)) < 0)
+			fatal("failed to bind the metrics socket \"" + unix_path + "\"");
+		start();
+	}
+
+	~metrics_server_t()
+	{
+		stop = true;
+		thread.join();
+		close(fd);
+		if (!unix_path.empty())
+			unlink(unix_path.c_str());
+	}
+
+private:
+	// Poll interval, for noticing a stop request.
+	static const int POLL_MS = 100;
+
+	metrics_t &metrics;
+	std::string unix_path;
+	int fd;
+	std::atomic<bool> stop {false};
+	std::thread thread;
+
+	void start()
+	{
+		if (listen(fd, 8) < 0)
+			fatal("failed to listen on the metrics socket");
+		thread = std::thread([this]() { serve(); });
+	}
+
+	void serve()
+	{
+		while (!stop) {
+			pollfd p {fd, POLLIN, 0};
+			if (poll(&p, 1, POLL_MS) <= 0)
+				continue;
+			const int c = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (c < 0)
+				continue;
+			handle(c);
+			close(c);
+		}
+	}
+
+	void handle(int c)
+	{
+		// Read the request line and headers, but do not wait forever.
+		std::string req;
+		char buf[1024];
+		while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192) {
+			pollfd p {c, POLLIN, 0};
+			if (poll(&p, 1, 1000) <= 0)
+				return;
+			const ssize_t n = recv(c, buf, sizeof(buf), 0);
+			if (n <= 0)
+				return;
+			req.append(buf, n);
+		}
+
+		std::string status = "200 OK", body;
+		if (req.rfind("GET /metrics ", 0) == 0 || req.rfind("GET / ", 0) == 0) {
+			body = metrics.scrape();
+		} else {
+			status = "404 Not Found";
+			body = "Try /metrics\n";
+		}
+		const std::string resp = "HTTP/1.0 " + status + "\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: " + std::to_string(body.size()) + "\r\n"
+			"Connection: close\r\n\r\n" + body;
+		for (size_t done = 0; done < resp.size(); ) {
+			const ssize_t n = send(c, resp.data() + done, resp.size() - done, MSG_NOSIGNAL);
+			if (n <= 0)
+				return;
+			done += n;
+		}
+	}
+};
+
+#endif
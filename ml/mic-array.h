@@ -0,0 +1,40 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Geometry of the BeagleMic circular microphone array, and of the stand.
+
+#ifndef DOA_MIC_ARRAY_H
+#define DOA_MIC_ARRAY_H
+
+#include <cmath>
+#include <numbers>
+
+#include "raw-audio.h"
+
+// MIC0 is at angle 0, and the angles increase towards MIC1.
+//
+// The radius only scales the time differences of arrival. Hence a slightly
+// wrong value shifts the estimates far less than a wrong microphone order.
+const double MIC_ARRAY_RADIUS_M = 0.045;
+const double SPEED_OF_SOUND_M_S = 343.0;
+
+const int NMIC_PAIRS = NCHANNELS * (NCHANNELS - 1) / 2;
+
+// The stand has a marking for each of these angles in the full circle.
+const int STAND_NANGLES = 64;
+
+static inline double stand_angle_deg(int a)
+{
+	return a * 360.0 / STAND_NANGLES;
+}
+
+// Arrival delay at the given microphone, relative to the array
+// center, for a far-field source at angle theta (in radians).
+static inline double mic_delay_s(double theta, int mic)
+{
+	const double mic_angle = 2.0 * std::numbers::pi * mic / NCHANNELS;
+	return -MIC_ARRAY_RADIUS_M * std::cos(theta - mic_angle) / SPEED_OF_SOUND_M_S;
+}
+
+#endif
@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// C API of the native inference engine, for use from Python via ctypes.
+// See nn_engine.py.
+//
+// Errors are fatal, as in the rest of the engine, apart from those of
+// loading a model. A bad model file must not end the Python process, so
+// why it failed is returned instead.
+
+#include <cstdint>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "nn-engine.h"
+#include "thread-pool.h"
+
+struct nn_capi_model_t {
+	std::shared_ptr<nn_model_t> model;
+	std::unique_ptr<thread_pool_t> pool;
+	std::vector<nn_workspace_t> workspaces;
+};
+
+extern "C" {
+
+// Returns null if the model fails to load, with the reason in err, which
+// has room for err_size bytes.
+nn_capi_model_t *nn_capi_load(const char *path, char *err, size_t err_size)
+{
+	std::string why;
+	auto model = nn_model_t::try_load(path, why);
+	if (!model) {
+		if (err_size) {
+			std::strncpy(err, why.c_str(), err_size - 1);
+			err[err_size - 1] = '\0';
+		}
+		return nullptr;
+	}
+	auto h = new nn_capi_model_t;
+	h->model = model;
+	return h;
+}
+
+void nn_capi_free(nn_capi_model_t *h)
+{
+	delete h;
+}
+
+size_t nn_capi_input_size(const nn_capi_model_t *h)
+{
+	return h->model->input_size;
+}
+
+size_t nn_capi_output_size(const nn_capi_model_t *h)
+{
+	return h->model->output_size();
+}
+
+const char *nn_capi_class_name(const nn_capi_model_t *h, size_t i)
+{
+	return h->model->class_names.at(i).c_str();
+}
+
+// Run the model on nrecords dataset records, writing the class
+// probabilities of each to out. Records are split across nthreads.
+void nn_capi_predict_s32(nn_capi_model_t *h, const int32_t *records, size_t nrecords,
+			 float *out, unsigned nthreads)
+{
+	const nn_model_t &model = *h->model;
+	nthreads = std::max(1u, nthreads);
+	if (!h->pool || h->pool->size() != nthreads) {
+		h->pool = std::make_unique<thread_pool_t>(nthreads);
+		h->workspaces.resize(nthreads);
+	}
+
+	h->pool->run([&](unsigned t) {
+		std::vector<float> in(model.input_size);
+		for (size_t i = t; i < nrecords; i += nthreads) {
+			nn_input_from_s32(records + i * model.input_size, in.data(), in.size());
+			model.predict(in.data(), out + i * model.output_size(), h->workspaces[t]);
+		}
+	});
+}
+
+}
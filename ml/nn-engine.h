@@ -0,0 +1,806 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Native inference engine for the DOA models trained by train.py.
+//
+// TensorFlow is a heavy dependency for merely running a small model. The
+// models are instead converted by export-model.py into a flat file, which
+// this engine can run with no dependencies.
+//
+// Model file layout. All integers are little-endian:
+//
+//    char magic[8];                 "DOANN1\0\0"
+//    u32  input_size;               Number of input floats.
+//    u32  nclasses;
+//    nclasses times: { u16 len; char str[len]; }
+//    u32  nlayers;
+//    nlayers times:
+//        u32 type;                  nn_layer_type_t
+//        u32 nparams;
+//        u32 params[nparams];
+//        u32 nweights;
+//        f32 weights[nweights];
+//
+// Tensors are kept as flat float arrays, in the row-major order used by
+// TensorFlow. Hence reshape and flatten layers need no processing.
+// The inputs to the NN are laid out as the datasets: interleaved
+// samples, in (time, mic) order.
+
+#ifndef DOA_NN_ENGINE_H
+#define DOA_NN_ENGINE_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "thread-pool.h"
+
+// Keep in sync with export-model.py!
+enum nn_layer_type_t {
+	NN_DENSE = 1,			// params: in, out, activation
+	NN_DENORMALIZE = 2,		// params: nsamples, nmics
+	NN_MIC_CONV = 3,		// params: in_t, nmics, in_c, out_c, kernel_t, kernel_m, stride, activation
+	NN_MIC_DENSE = 4,		// params: in_t, nmics, in_c, out, activation
+	NN_EQUIVARIANT_HEAD = 5,	// params: nmics, nangles_per_mic
+	NN_ACTIVATION = 6,		// params: size, activation
+};
+
+enum nn_activation_t {
+	NN_ACT_LINEAR = 0,
+	NN_ACT_RELU = 1,
+	NN_ACT_SOFTMAX = 2,
+};
+
+static const char NN_MODEL_MAGIC[8] = { 'D', 'O', 'A', 'N', 'N', '1', '\0', '\0' };
+
+static inline bool nn_known_activation(uint32_t act)
+{
+	return act <= NN_ACT_SOFTMAX;
+}
+
+static inline void nn_activate(nn_activation_t act, float *x, size_t n)
+{
+	switch (act) {
+	case NN_ACT_LINEAR:
+		break;
+	case NN_ACT_RELU:
+		for (size_t i = 0; i < n; i++)
+			x[i] = std::max(x[i], 0.0f);
+		break;
+	case NN_ACT_SOFTMAX: {
+		const float m = *std::max_element(x, x + n);
+		float sum = 0;
+		for (size_t i = 0; i < n; i++) {
+			x[i] = std::exp(x[i] - m);
+			sum += x[i];
+		}
+		for (size_t i = 0; i < n; i++)
+			x[i] /= sum;
+		break;
+	}
+	default:
+		fatal("unknown activation " + std::to_string(act));
+	}
+}
+
+// Convert a dataset record into NN input, the same way train.py does.
+static inline void nn_input_from_s32(const int32_t *src, float *dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = src[i] * (1.0f / 2147483648.0f);
+}
+
+// Convert interleaved raw audio frames into NN input. They are
+// normalized the same way prepare-data does for the datasets.
+static inline void nn_input_from_frames(const int32_t *frames, float *dst, size_t nframes, size_t nmics)
+{
+	for (size_t t = 0; t < nframes; t++) {
+		const int32_t *x = frames + t * nmics;
+		float *y = dst + t * nmics;
+		y[0] = x[0] * (1.0f / 2147483648.0f);
+		// Wrap around exactly like the int32_t arithmetic in prepare-data.
+		for (size_t m = 1; m < nmics; m++)
+			y[m] = int32_t(uint32_t(x[m]) - uint32_t(x[0])) * (1.0f / 2147483648.0f);
+	}
+}
+
+//----------------------------------------------------------------------------
+
+class nn_layer_t {
+public:
+	const nn_layer_type_t type;
+	std::vector<uint32_t> params;
+	std::vector<float> weights;
+
+	nn_layer_t(nn_layer_type_t t) : type(t) {}
+	virtual ~nn_layer_t() {}
+
+	virtual size_t in_size() const = 0;
+	virtual size_t out_size() const = 0;
+	virtual void forward(const float *in, float *out) const = 0;
+
+	// Split the work across the threads of the pool, if supported.
+	virtual void forward_parallel(const float *in, float *out, thread_pool_t &) const
+	{
+		forward(in, out);
+	}
+
+	// Run on a batch of n inputs, stored one after the other, e.g. to
+	// read the weights once for all of them.
+	virtual void forward_batch(const float *in, float *out, size_t n) const
+	{
+		for (size_t b = 0; b < n; b++)
+			forward(in + b * in_size(), out + b * out_size());
+	}
+
+	// Layers which slide along the time axis map input frames
+	// [t * stride, t * stride + kernel) to output frame t. They can
+	// compute a subset of their output frames. Zero for other layers.
+	virtual size_t time_stride() const { return 0; }
+	virtual size_t out_frames() const { return 0; }
+	virtual void forward_frames(const float *, float *, size_t, size_t) const
+	{
+		fatal("layer type " + std::to_string(type) + " is not sliding in time");
+	}
+
+protected:
+	// Why the parameters are invalid, or empty if they are not.
+	std::string check(size_t nparams, size_t nweights, size_t activation = SIZE_MAX) const
+	{
+		if (params.size() != nparams || weights.size() != nweights)
+			return "invalid parameters for layer type " + std::to_string(type);
+		if (activation != SIZE_MAX && !nn_known_activation(params[activation]))
+			return "unknown activation " + std::to_string(params[activation]);
+		return "";
+	}
+};
+
+// Fully connected layer. Weights are a [in][out] matrix, followed by
+// the bias vector. Streaming the matrix row by row vectorizes well.
+//
+// The output columns can be split into slabs, which are computed in
+// parallel. Each slab is then stored contiguously as a [in][slab out]
+// matrix, so each thread streams only its own part of the weights.
+class nn_dense_t : public nn_layer_t {
+public:
+	nn_dense_t() : nn_layer_t(NN_DENSE) {}
+
+	size_t in_size() const { return params[0]; }
+	size_t out_size() const { return params[1]; }
+
+	std::string init()
+	{
+		if (params.size() != 3)
+			return "invalid parameters for dense layer";
+		slab_bounds = { 0, params[1] };
+		return check(3, size_t(params[0]) * params[1] + params[1], 2);
+	}
+
+	size_t num_slabs() const { return slab_bounds.size() - 1; }
+
+	// Repack the weights into nslabs slabs of about equal size. Slab
+	// bounds are aligned to cache lines, where the size permits.
+	void partition(size_t nslabs)
+	{
+		const size_t nin = params[0], nout = params[1];
+		const size_t align = nout >= nslabs * 16 ? 16 : 1;
+		std::vector<size_t> bounds(nslabs + 1);
+		for (size_t t = 0; t <= nslabs; t++)
+			bounds[t] = std::min(nout, (nout * t / nslabs + align - 1) / align * align);
+		bounds[nslabs] = nout;
+
+		// Via the plain [in][out] layout, which is a single slab.
+		std::vector<float> plain(weights.size()), w(weights.size());
+		repack(weights.data(), slab_bounds, plain.data(), { 0, nout });
+		repack(plain.data(), { 0, nout }, w.data(), bounds);
+		std::copy(weights.begin() + nin * nout, weights.end(), w.begin() + nin * nout);
+		weights = std::move(w);
+		slab_bounds = std::move(bounds);
+	}
+
+	void forward(const float *in, float *out) const
+	{
+		for (size_t s = 0; s < num_slabs(); s++)
+			forward_slab(in, out, s);
+		nn_activate(nn_activation_t(params[2]), out, params[1]);
+	}
+
+	void forward_parallel(const float *in, float *out, thread_pool_t &pool) const
+	{
+		if (pool.size() != num_slabs())
+			return forward(in, out);
+		pool.run([&](unsigned t) { forward_slab(in, out, t); });
+		nn_activate(nn_activation_t(params[2]), out, params[1]);
+	}
+
+	// Each row of weights is read once for the whole batch. The sums are
+	// accumulated in the same order as by forward(), so the results are
+	// exactly the same.
+	void forward_batch(const float *in, float *out, size_t n) const
+	{
+		const size_t nin = params[0], nout = params[1];
+		for (size_t s = 0; s < num_slabs(); s++) {
+			const size_t o0 = slab_bounds[s], sn = slab_bounds[s + 1] - o0;
+			const float *w = weights.data() + nin * o0;
+			for (size_t b = 0; b < n; b++)
+				std::memcpy(out + b * nout + o0, weights.data() + nin * nout + o0, sn * sizeof(float));
+			for (size_t i = 0; i < nin; i++) {
+				const float *row = w + i * sn;
+				for (size_t b = 0; b < n; b++) {
+					const float x = in[b * nin + i];
+					if (x == 0)
+						continue;
+					float *o = out + b * nout + o0;
+					for (size_t k = 0; k < sn; k++)
+						o[k] += x * row[k];
+				}
+			}
+		}
+		for (size_t b = 0; b < n; b++)
+			nn_activate(nn_activation_t(params[2]), out + b * nout, nout);
+	}
+
+private:
+	std::vector<size_t> slab_bounds;	// Output columns of each slab.
+
+	void repack(const float *src, const std::vector<size_t> &src_bounds,
+		    float *dst, const std::vector<size_t> &dst_bounds) const
+	{
+		const size_t nin = params[0];
+		for (size_t ss = 0; ss + 1 < src_bounds.size(); ss++) {
+			const size_t so0 = src_bounds[ss], sn = src_bounds[ss + 1] - so0;
+			for (size_t ds = 0; ds + 1 < dst_bounds.size(); ds++) {
+				const size_t do0 = dst_bounds[ds], dn = dst_bounds[ds + 1] - do0;
+				const size_t o0 = std::max(so0, do0), o1 = std::min(so0 + sn, do0 + dn);
+				for (size_t i = 0; o0 < o1 && i < nin; i++)
+					std::copy(src + nin * so0 + i * sn + (o0 - so0),
+						  src + nin * so0 + i * sn + (o1 - so0),
+						  dst + nin * do0 + i * dn + (o0 - do0));
+			}
+		}
+	}
+
+	void forward_slab(const float *in, float *out, size_t s) const
+	{
+		const size_t nin = params[0], nout = params[1];
+		const size_t o0 = slab_bounds[s], n = slab_bounds[s + 1] - o0;
+		const float *w = weights.data() + nin * o0;
+
+		std::memcpy(out + o0, weights.data() + nin * nout + o0, n * sizeof(float));
+		for (size_t i = 0; i < nin; i++) {
+			const float x = in[i];
+			const float *row = w + i * n;
+			// Inputs coming from a ReLU are often zero.
+			if (x == 0)
+				continue;
+			for (size_t o = 0; o < n; o++)
+				out[o0 + o] += x * row[o];
+		}
+	}
+};
+
+// prepare-data stores mics 1..N-1 as a difference from mic 0. Undo that,
+// so that a circular shift of the mics is a circular shift of the input.
+class nn_denormalize_t : public nn_layer_t {
+public:
+	nn_denormalize_t() : nn_layer_t(NN_DENORMALIZE) {}
+
+	size_t in_size() const { return params[0] * params[1]; }
+	size_t out_size() const { return in_size(); }
+
+	std::string init() { return check(2, 0); }
+
+	size_t time_stride() const { return 1; }
+	size_t out_frames() const { return params[0]; }
+
+	void forward(const float *in, float *out) const
+	{
+		forward_frames(in, out, 0, params[0]);
+	}
+
+	void forward_frames(const float *in, float *out, size_t t0, size_t t1) const
+	{
+		const size_t nmics = params[1];
+		for (size_t t = t0; t < t1; t++) {
+			const float *x = in + t * nmics;
+			float *y = out + t * nmics;
+			y[0] = x[0];
+			for (size_t m = 1; m < nmics; m++)
+				y[m] = x[m] + x[0];
+		}
+	}
+};
+
+// Convolution over the (time, mic) plane of a (time, mic, channel) tensor.
+// Time is not padded. The mic axis is padded circularly, so the layer
+// is equivariant to rotations of the array. Weights are [kt][km][in_c][out_c],
+// followed by the bias vector.
+class nn_mic_conv_t : public nn_layer_t {
+public:
+	nn_mic_conv_t() : nn_layer_t(NN_MIC_CONV) {}
+
+	size_t in_t() const { return params[0]; }
+	size_t nmics() const { return params[1]; }
+	size_t in_c() const { return params[2]; }
+	size_t out_c() const { return params[3]; }
+	size_t kernel_t() const { return params[4]; }
+	size_t kernel_m() const { return params[5]; }
+	size_t stride() const { return params[6]; }
+	size_t out_t() const { return (in_t() - kernel_t()) / stride() + 1; }
+
+	size_t in_size() const { return in_t() * nmics() * in_c(); }
+	size_t out_size() const { return out_t() * nmics() * out_c(); }
+
+	size_t time_stride() const { return stride(); }
+	size_t out_frames() const { return out_t(); }
+
+	std::string init()
+	{
+		if (params.size() != 8)
+			return "invalid parameters for mic conv layer";
+		if (params[6] == 0 || params[4] > params[0] || !(params[5] % 2) || params[5] > params[1])
+			return "invalid geometry for mic conv layer";
+		return check(8, kernel_t() * kernel_m() * in_c() * out_c() + out_c(), 7);
+	}
+
+	void forward(const float *in, float *out) const
+	{
+		forward_frames(in, out, 0, out_t());
+	}
+
+	// Compute output frames [t0, t1) only.
+	void forward_frames(const float *in, float *out, size_t t0, size_t t1) const
+	{
+		const size_t M = nmics(), C = in_c(), F = out_c();
+		const size_t KT = kernel_t(), KM = kernel_m(), S = stride();
+		const float *bias = weights.data() + KT * KM * C * F;
+
+		for (size_t t = t0; t < t1; t++) {
+			for (size_t m = 0; m < M; m++) {
+				float *y = out + (t * M + m) * F;
+				std::memcpy(y, bias, F * sizeof(float));
+				for (size_t dt = 0; dt < KT; dt++) {
+					for (size_t dm = 0; dm < KM; dm++) {
+						const size_t sm = (m + M + dm - KM / 2) % M;
+						const float *x = in + ((t * S + dt) * M + sm) * C;
+						const float *w = weights.data() + (dt * KM + dm) * C * F;
+						for (size_t c = 0; c < C; c++)
+							for (size_t f = 0; f < F; f++)
+								y[f] += x[c] * w[c * F + f];
+					}
+				}
+				nn_activate(nn_activation_t(params[7]), y, F);
+			}
+		}
+	}
+};
+
+// Dense layer applied to each mic's features, with weights shared
+// between the mics. Input is (time, mic, channel), and the features
+// of mic m are its (time, channel) slice. Weights are [in_t * in_c][out],
+// followed by the bias vector. Output is (mic, out).
+class nn_mic_dense_t : public nn_layer_t {
+public:
+	nn_mic_dense_t() : nn_layer_t(NN_MIC_DENSE) {}
+
+	size_t in_size() const { return params[0] * params[1] * params[2]; }
+	size_t out_size() const { return params[1] * params[3]; }
+
+	std::string init()
+	{
+		if (params.size() != 5)
+			return "invalid parameters for mic dense layer";
+		return check(5, size_t(params[0]) * params[2] * params[3] + params[3], 4);
+	}
+
+	void forward(const float *in, float *out) const
+	{
+		const size_t T = params[0], M = params[1], C = params[2], O = params[3];
+		const float *bias = weights.data() + T * C * O;
+
+		for (size_t m = 0; m < M; m++) {
+			float *y = out + m * O;
+			std::memcpy(y, bias, O * sizeof(float));
+			for (size_t t = 0; t < T; t++) {
+				const float *x = in + (t * M + m) * C;
+				const float *w = weights.data() + t * C * O;
+				for (size_t c = 0; c < C; c++)
+					for (size_t o = 0; o < O; o++)
+						y[o] += x[c] * w[c * O + o];
+			}
+			nn_activate(nn_activation_t(params[4]), y, O);
+		}
+	}
+};
+
+// Turn per-mic (angle..., silence) logits into the class logits. Angle
+// classes are ordered mic-major, so rotating the input by one mic rotates
+// the angle classes by nangles_per_mic. Silence is averaged over the mics.
+class nn_equivariant_head_t : public nn_layer_t {
+public:
+	nn_equivariant_head_t() : nn_layer_t(NN_EQUIVARIANT_HEAD) {}
+
+	size_t in_size() const { return params[0] * (params[1] + 1); }
+	size_t out_size() const { return params[0] * params[1] + 1; }
+
+	std::string init() { return check(2, 0); }
+
+	void forward(const float *in, float *out) const
+	{
+		const size_t M = params[0], K = params[1];
+		float silence = 0;
+		for (size_t m = 0; m < M; m++) {
+			std::memcpy(out + m * K, in + m * (K + 1), K * sizeof(float));
+			silence += in[m * (K + 1) + K];
+		}
+		out[M * K] = silence / M;
+	}
+};
+
+class nn_activation_layer_t : public nn_layer_t {
+public:
+	nn_activation_layer_t() : nn_layer_t(NN_ACTIVATION) {}
+
+	size_t in_size() const { return params[0]; }
+	size_t out_size() const { return params[0]; }
+
+	std::string init() { return check(2, 0, 1); }
+
+	void forward(const float *in, float *out) const
+	{
+		std::memcpy(out, in, params[0] * sizeof(float));
+		nn_activate(nn_activation_t(params[1]), out, params[0]);
+	}
+};
+
+//----------------------------------------------------------------------------
+
+// Scratch memory for running a model. Each thread running
+// the model must have its own workspace.
+//
+// With a pool, the layers which support it are split across its
+// threads. The model must be partitioned for the pool's size.
+struct nn_workspace_t {
+	std::vector<float> bufs[2];
+	thread_pool_t *pool = nullptr;
+};
+
+class nn_model_t {
+public:
+	size_t input_size;
+	std::vector<std::string> class_names;
+	std::vector<std::unique_ptr<nn_layer_t>> layers;
+
+	static std::shared_ptr<nn_model_t> load(const std::filesystem::path &path)
+	{
+		std::string err;
+		auto o = try_load(path, err);
+		if (!o)
+			fatal(err);
+		return o;
+	}
+
+	// Like load(), but returns null and why, instead of aborting, e.g. for
+	// reloading a model in a running service.
+	static std::shared_ptr<nn_model_t> try_load(const std::filesystem::path &path, std::string &err)
+	{
+		auto o = std::shared_ptr<nn_model_t>(new nn_model_t());
+		err = o->load_file(path);
+		return err.empty() ? o : nullptr;
+	}
+
+	size_t output_size() const { return layers.back()->out_size(); }
+
+	size_t max_tensor_size() const
+	{
+		size_t n = input_size;
+		for (const auto &l : layers)
+			n = std::max(n, l->out_size());
+		return n;
+	}
+
+	size_t num_weights() const
+	{
+		size_t n = 0;
+		for (const auto &l : layers)
+			n += l->weights.size();
+		return n;
+	}
+
+	// Split the work of each layer that supports it into nparts, to be
+	// run in parallel by a pool of that size. Not thread-safe.
+	void partition(size_t nparts)
+	{
+		for (auto &l : layers)
+			if (l->type == NN_DENSE)
+				static_cast<nn_dense_t &>(*l).partition(nparts);
+	}
+
+	// Run the model on one input, writing the class probabilities to out.
+	void predict(const float *in, float *out, nn_workspace_t &ws) const
+	{
+		predict_from(0, in, out, ws);
+	}
+
+	// Run the layers from first onwards, with in being the input of first.
+	void predict_from(size_t first, const float *in, float *out, nn_workspace_t &ws) const
+	{
+		const size_t n = max_tensor_size();
+		for (auto &b : ws.bufs)
+			if (b.size() < n)
+				b.resize(n);
+
+		const float *src = in;
+		for (size_t li = first; li < layers.size(); li++) {
+			float *dst = (li + 1 == layers.size()) ? out : ws.bufs[li % 2].data();
+			if (ws.pool)
+				layers[li]->forward_parallel(src, dst, *ws.pool);
+			else
+				layers[li]->forward(src, dst);
+			src = dst;
+		}
+	}
+
+	// Run the layers from first onwards on a batch of n inputs, stored
+	// one after the other. The same as predict_from() on each of them.
+	void predict_batch_from(size_t first, const float *in, float *out, size_t n, nn_workspace_t &ws) const
+	{
+		const size_t size = max_tensor_size() * n;
+		for (auto &b : ws.bufs)
+			if (b.size() < size)
+				b.resize(size);
+
+		const float *src = in;
+		for (size_t li = first; li < layers.size(); li++) {
+			float *dst = (li + 1 == layers.size()) ? out : ws.bufs[li % 2].data();
+			layers[li]->forward_batch(src, dst, n);
+			src = dst;
+		}
+	}
+
+	// Index of the most probable class.
+	int classify(const float *in, nn_workspace_t &ws) const
+	{
+		std::vector<float> out(output_size());
+		predict(in, out.data(), ws);
+		return std::max_element(out.begin(), out.end()) - out.begin();
+	}
+
+private:
+	nn_model_t() {}
+
+	// Null for an unknown type.
+	static std::unique_ptr<nn_layer_t> new_layer(uint32_t type)
+	{
+		switch (type) {
+		case NN_DENSE: return std::make_unique<nn_dense_t>();
+		case NN_DENORMALIZE: return std::make_unique<nn_denormalize_t>();
+		case NN_MIC_CONV: return std::make_unique<nn_mic_conv_t>();
+		case NN_MIC_DENSE: return std::make_unique<nn_mic_dense_t>();
+		case NN_EQUIVARIANT_HEAD: return std::make_unique<nn_equivariant_head_t>();
+		case NN_ACTIVATION: return std::make_unique<nn_activation_layer_t>();
+		default: return nullptr;
+		}
+	}
+
+	static std::string init_layer(nn_layer_t &l)
+	{
+		switch (l.type) {
+		case NN_DENSE: return static_cast<nn_dense_t &>(l).init();
+		case NN_DENORMALIZE: return static_cast<nn_denormalize_t &>(l).init();
+		case NN_MIC_CONV: return static_cast<nn_mic_conv_t &>(l).init();
+		case NN_MIC_DENSE: return static_cast<nn_mic_dense_t &>(l).init();
+		case NN_EQUIVARIANT_HEAD: return static_cast<nn_equivariant_head_t &>(l).init();
+		case NN_ACTIVATION: return static_cast<nn_activation_layer_t &>(l).init();
+		}
+		return "";
+	}
+
+	// Returns why the file is not a valid model, or empty.
+	std::string load_file(const std::filesystem::path &path)
+	{
+		std::string name = "\"";
+		name += path.string() + "\"";
+		std::ifstream s {path, s.binary};
+		if (!s.is_open())
+			return "failed to open model " + name;
+		s.seekg(0, s.end);
+		size_t left = s.tellg();
+		s.seekg(0);
+
+		// Sizes are checked against the rest of the file before allocating,
+		// so that a truncated or garbled file cannot exhaust the memory.
+		bool ok = true;
+		auto get = [&](void *dst, size_t n) {
+			ok = ok && n <= left && s.read(static_cast<char *>(dst), n);
+			left -= ok ? n : 0;
+			return ok;
+		};
+		auto get_u32 = [&]() { uint32_t v = 0; get(&v, sizeof(v)); return v; };
+		auto fits = [&](size_t count, size_t size) { ok = ok && count <= left / size; return ok; };
+		const std::string truncated = "truncated model " + name;
+
+		char magic[sizeof(NN_MODEL_MAGIC)];
+		if (!get(magic, sizeof(magic)))
+			return truncated;
+		if (std::memcmp(magic, NN_MODEL_MAGIC, sizeof(magic)))
+			return name + " is not a DOA model";
+
+		input_size = get_u32();
+		const uint32_t nclasses = get_u32();
+		for (uint32_t i = 0; ok && i < nclasses; i++) {
+			uint16_t len = 0;
+			get(&len, sizeof(len));
+			std::string str(fits(len, 1) ? len : 0, '\0');
+			get(str.data(), str.size());
+			class_names.push_back(str);
+		}
+
+		const uint32_t nlayers = get_u32();
+		size_t size = input_size;
+		for (uint32_t li = 0; ok && li < nlayers; li++) {
+			const uint32_t type = get_u32();
+			auto l = new_layer(type);
+			if (!ok)
+				break;
+			if (!l)
+				return "unknown layer type " + std::to_string(type) + " in " + name;
+			const uint32_t nparams = get_u32();
+			l->params.resize(fits(nparams, sizeof(uint32_t)) ? nparams : 0);
+			get(l->params.data(), l->params.size() * sizeof(uint32_t));
+			const uint32_t nweights = get_u32();
+			l->weights.resize(fits(nweights, sizeof(float)) ? nweights : 0);
+			get(l->weights.data(), l->weights.size() * sizeof(float));
+			if (!ok)
+				break;
+			const std::string err = init_layer(*l);
+			if (!err.empty())
+				return err + " in " + name;
+			if (l->in_size() != size)
+				return "layer " + std::to_string(li) + " input size mismatch in " + name;
+			size = l->out_size();
+			layers.push_back(std::move(l));
+		}
+		if (!ok)
+			return truncated;
+		if (layers.empty() || size != class_names.size())
+			return "output size does not match the classes in " + name;
+		return "";
+	}
+};
+
+//----------------------------------------------------------------------------
+
+// Run a model over a sliding window of a continuous audio stream.
+//
+// When the window slides by a hop, the output frames of the layers at the
+// start of the model, which slide in time, are merely shifted. Only the
+// frames depending on the new input are computed. Hence the cost per hop
+// is roughly proportional to the hop instead of to the window. The rest
+// of the layers are run as usual. Results are exactly the same as running
+// the model on the whole window, since each frame is computed the same way.
+//
+// The hop must be a multiple of the combined stride of those layers. Each
+// stream must have its own nn_stream_t, but they can share the model.
+class nn_stream_t {
+public:
+	const size_t nmics;
+	const size_t window;	// In frames.
+	const size_t hop;
+
+	nn_stream_t(std::shared_ptr<const nn_model_t> _model, size_t _hop, size_t _nmics)
+		: nmics(_nmics), window(_model->input_size / _nmics), hop(_hop),
+		  model(_model)
+	{
+		const std::string err = check(*model, hop, nmics);
+		if (!err.empty())
+			fatal(err);
+
+		acts.emplace_back(model->input_size);
+		hops.push_back(hop);
+		frames.push_back(window);
+		size_t stride = 1;
+		for (const auto &l : model->layers) {
+			if (!is_sliding(*model, *l))
+				break;
+			stride *= l->time_stride();
+			acts.emplace_back(l->out_size());
+			hops.push_back(hop / stride);
+			frames.push_back(l->out_frames());
+		}
+		nsliding = acts.size() - 1;
+		reset();
+	}
+
+	// Why the model cannot be streamed with that hop, or empty if it can.
+	static std::string check(const nn_model_t &model, size_t hop, size_t nmics)
+	{
+		const size_t window = model.input_size / nmics;
+		if (hop == 0 || hop > window || window * nmics != model.input_size)
+			return "invalid stream hop or channels for the model";
+		size_t stride = 1;
+		for (const auto &l : model.layers) {
+			if (!is_sliding(model, *l))
+				break;
+			stride *= l->time_stride();
+			if (hop % stride)
+				return "stream hop must be a multiple of " + std::to_string(stride) + " frames";
+		}
+		return "";
+	}
+
+	// Start over, as if all the past input was zero.
+	void reset()
+	{
+		std::fill(acts[0].begin(), acts[0].end(), 0.0f);
+		for (size_t li = 0; li < nsliding; li++)
+			model->layers[li]->forward(acts[li].data(), acts[li + 1].data());
+	}
+
+	// Start over from a whole window of past interleaved frames, e.g.
+	// when switching to another model in the middle of a stream.
+	void prime(const int32_t *in)
+	{
+		nn_input_from_frames(in, acts[0].data(), window, nmics);
+		for (size_t li = 0; li < nsliding; li++)
+			model->layers[li]->forward(acts[li].data(), acts[li + 1].data());
+	}
+
+	// Consume hop interleaved frames, and write the class
+	// probabilities for the current window to out.
+	void push(const int32_t *in, float *out)
+	{
+		slide(in);
+		model->predict_from(nsliding, acts[nsliding].data(), out, ws);
+	}
+
+	// Consume hop interleaved frames, updating only the leading layers
+	// which slide in time. The rest of the model, from tail_layer() on,
+	// is then to be run on tail_input(), e.g. batched with other windows.
+	void slide(const int32_t *in)
+	{
+		for (size_t i = 0; i <= nsliding; i++) {
+			auto &a = acts[i];
+			const size_t fsize = a.size() / frames[i];
+			const size_t n = std::min(hops[i], frames[i]);
+			std::copy(a.begin() + n * fsize, a.end(), a.begin());
+			if (i == 0)
+				nn_input_from_frames(in, &a[(window - hop) * nmics], hop, nmics);
+			else
+				model->layers[i - 1]->forward_frames(acts[i - 1].data(), a.data(),
+								     frames[i] - n, frames[i]);
+		}
+	}
+
+	size_t tail_layer() const { return nsliding; }
+	const float *tail_input() const { return acts[nsliding].data(); }
+	size_t tail_size() const { return acts[nsliding].size(); }
+
+	// The input of the model for the current window.
+	const float *input() const { return acts[0].data(); }
+
+private:
+	std::shared_ptr<const nn_model_t> model;
+	size_t nsliding;			// Leading layers sliding in time.
+	std::vector<std::vector<float>> acts;	// Their input, then outputs.
+	std::vector<size_t> hops;		// Hop in frames, for each.
+	std::vector<size_t> frames;		// Frames in the window, for each.
+	nn_workspace_t ws;
+
+	// The last layer is never sliding, but guard against odd models.
+	static bool is_sliding(const nn_model_t &model, const nn_layer_t &l)
+	{
+		return l.time_stride() && &l != model.layers.back().get();
+	}
+};
+
+#endif
@@ -0,0 +1,24 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Interface of a model generated into C++ by gen-model.py. Link with
+// the generated translation unit.
+
+#ifndef DOA_NN_GENERATED_H
+#define DOA_NN_GENERATED_H
+
+#include <cstddef>
+
+struct nn_generated_model_t {
+	size_t input_size;
+	size_t output_size;
+	const char *const *class_names;
+
+	// Write the class probabilities for one input to out. Reentrant.
+	void (*predict)(const float *in, float *out);
+};
+
+extern const nn_generated_model_t nn_generated_model;
+
+#endif
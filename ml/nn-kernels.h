@@ -0,0 +1,129 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Layer kernels with compile-time shapes, for models generated into C++
+// by gen-model.py.
+//
+// They compute exactly what the layers of the generic engine (nn-engine.h)
+// do, in the same order, hence give the same results. But with all sizes
+// known, the compiler unrolls and vectorizes the small inner loops.
+//
+// Weights are pre-packed by gen-model.py: the output dimension of each
+// matrix is padded with zeros to NN_PACK_ALIGN floats, so that all rows
+// are aligned and the kernels need no remainder loops.
+
+#ifndef DOA_NN_KERNELS_H
+#define DOA_NN_KERNELS_H
+
+#include <cstddef>
+#include <cstring>
+
+#include "nn-engine.h"
+
+// Keep in sync with gen-model.py!
+constexpr size_t NN_PACK_ALIGN = 16;
+
+constexpr size_t nn_packed(size_t n)
+{
+	return (n + NN_PACK_ALIGN - 1) / NN_PACK_ALIGN * NN_PACK_ALIGN;
+}
+
+// Weights: [NIN][nn_packed(NOUT)], then bias[nn_packed(NOUT)].
+template <size_t NIN, size_t NOUT, nn_activation_t ACT>
+static inline void nn_k_dense(const float *__restrict in, float *__restrict out, const float *__restrict w)
+{
+	constexpr size_t P = nn_packed(NOUT);
+	alignas(64) float acc[P];
+
+	std::memcpy(acc, w + NIN * P, sizeof(acc));
+	for (size_t i = 0; i < NIN; i++) {
+		const float x = in[i];
+		if (x == 0)
+			continue;
+		for (size_t o = 0; o < P; o++)
+			acc[o] += x * w[i * P + o];
+	}
+	std::memcpy(out, acc, NOUT * sizeof(float));
+	nn_activate(ACT, out, NOUT);
+}
+
+template <size_t T, size_t M>
+static inline void nn_k_denormalize(const float *__restrict in, float *__restrict out)
+{
+	for (size_t t = 0; t < T; t++) {
+		out[t * M] = in[t * M];
+		for (size_t m = 1; m < M; m++)
+			out[t * M + m] = in[t * M + m] + in[t * M];
+	}
+}
+
+// Weights: [KT][KM][C][nn_packed(F)], then bias[nn_packed(F)].
+template <size_t T, size_t M, size_t C, size_t F, size_t KT, size_t KM, size_t S, nn_activation_t ACT>
+static inline void nn_k_mic_conv(const float *__restrict in, float *__restrict out, const float *__restrict w)
+{
+	constexpr size_t P = nn_packed(F);
+	constexpr size_t OT = (T - KT) / S + 1;
+
+	for (size_t t = 0; t < OT; t++) {
+		for (size_t m = 0; m < M; m++) {
+			alignas(64) float acc[P];
+			std::memcpy(acc, w + KT * KM * C * P, sizeof(acc));
+			for (size_t dt = 0; dt < KT; dt++) {
+				#pragma GCC unroll 8
+				for (size_t dm = 0; dm < KM; dm++) {
+					const size_t sm = (m + M + dm - KM / 2) % M;
+					const float *x = in + ((t * S + dt) * M + sm) * C;
+					const float *wk = w + (dt * KM + dm) * C * P;
+					for (size_t c = 0; c < C; c++)
+						for (size_t f = 0; f < P; f++)
+							acc[f] += x[c] * wk[c * P + f];
+				}
+			}
+			float *y = out + (t * M + m) * F;
+			std::memcpy(y, acc, F * sizeof(float));
+			nn_activate(ACT, y, F);
+		}
+	}
+}
+
+// Weights: [T * C][nn_packed(O)], then bias[nn_packed(O)].
+template <size_t T, size_t M, size_t C, size_t O, nn_activation_t ACT>
+static inline void nn_k_mic_dense(const float *__restrict in, float *__restrict out, const float *__restrict w)
+{
+	constexpr size_t P = nn_packed(O);
+
+	for (size_t m = 0; m < M; m++) {
+		alignas(64) float acc[P];
+		std::memcpy(acc, w + T * C * P, sizeof(acc));
+		for (size_t t = 0; t < T; t++) {
+			const float *x = in + (t * M + m) * C;
+			const float *wt = w + t * C * P;
+			for (size_t c = 0; c < C; c++)
+				for (size_t o = 0; o < P; o++)
+					acc[o] += x[c] * wt[c * P + o];
+		}
+		std::memcpy(out + m * O, acc, O * sizeof(float));
+		nn_activate(ACT, out + m * O, O);
+	}
+}
+
+template <size_t M, size_t K>
+static inline void nn_k_equivariant_head(const float *__restrict in, float *__restrict out)
+{
+	float silence = 0;
+	for (size_t m = 0; m < M; m++) {
+		std::memcpy(out + m * K, in + m * (K + 1), K * sizeof(float));
+		silence += in[m * (K + 1) + K];
+	}
+	out[M * K] = silence / M;
+}
+
+template <size_t N, nn_activation_t ACT>
+static inline void nn_k_activation(const float *__restrict in, float *__restrict out)
+{
+	std::memcpy(out, in, N * sizeof(float));
+	nn_activate(ACT, out, N);
+}
+
+#endif
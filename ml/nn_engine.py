@@ -0,0 +1,65 @@
+# SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Python binding of the native inference engine (nn-engine.h), for
+# running exported models without TensorFlow.
+#
+# Needs libnn-engine.so, built by the Makefile in this directory.
+
+import numpy as np
+import ctypes
+import os
+
+LIBRARY_FILENAME = 'libnn-engine.so'
+
+_lib = None
+
+def _load_library():
+    global _lib
+    if _lib is None:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)), LIBRARY_FILENAME)
+        lib = ctypes.CDLL(path)
+        lib.nn_capi_load.restype = ctypes.c_void_p
+        lib.nn_capi_load.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t]
+        lib.nn_capi_free.argtypes = [ctypes.c_void_p]
+        lib.nn_capi_input_size.restype = ctypes.c_size_t
+        lib.nn_capi_input_size.argtypes = [ctypes.c_void_p]
+        lib.nn_capi_output_size.restype = ctypes.c_size_t
+        lib.nn_capi_output_size.argtypes = [ctypes.c_void_p]
+        lib.nn_capi_class_name.restype = ctypes.c_char_p
+        lib.nn_capi_class_name.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+        lib.nn_capi_predict_s32.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                                            ctypes.c_void_p, ctypes.c_uint]
+        _lib = lib
+    return _lib
+
+class NativeModel:
+    """Exported model (see export-model.py), run by the native engine."""
+    def __init__(self, filename, nthreads=None):
+        if not os.path.exists(filename):
+            raise FileNotFoundError(filename)
+        self._lib = _load_library()
+        err = ctypes.create_string_buffer(1024)
+        self._h = self._lib.nn_capi_load(filename.encode(), err, len(err))
+        if not self._h:
+            raise ValueError(err.value.decode(errors='replace'))
+        self.input_size = self._lib.nn_capi_input_size(self._h)
+        self.output_size = self._lib.nn_capi_output_size(self._h)
+        self.class_names = [self._lib.nn_capi_class_name(self._h, i).decode()
+                            for i in range(self.output_size)]
+        self.nthreads = nthreads or os.cpu_count() or 1
+
+    def __del__(self):
+        if getattr(self, '_h', None):
+            self._lib.nn_capi_free(self._h)
+
+    def predict_records(self, records):
+        """Class probabilities for a (n, input_size) array of S32LE dataset records."""
+        records = np.ascontiguousarray(records, dtype='<i4')
+        if records.ndim != 2 or records.shape[1] != self.input_size:
+            raise ValueError('records must have shape (n, {})'.format(self.input_size))
+        out = np.empty((len(records), self.output_size), dtype=np.float32)
+        self._lib.nn_capi_predict_s32(self._h, records.ctypes.data, len(records),
+                                      out.ctypes.data, self.nthreads)
+        return out
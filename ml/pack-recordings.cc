@@ -0,0 +1,174 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Convert raw recordings to the packed 24-bit format, or back.
+//
+// BeagleMic delivers 24-bit samples, which arecord stores in 32-bit
+// words. The packed ".s24" recording is written next to the ".raw" one,
+// and takes a quarter less space. All the tools read either format.
+// The 24 bits are the least significant ones of the 32-bit words, or if
+// they do not fit there, the most significant ones. A recording which
+// fits neither way is left alone, since it would not convert back to
+// the same.
+//
+// With -d, each converted recording is deleted. With -u, packed
+// recordings are converted back, e.g. for tools which need S32_LE.
+//
+// Example invocations:
+//    $ ./pack-recordings -d records/output-*.raw
+//    $ ./pack-recordings -u records/output-silence.s24
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "raw-audio.h"
+
+// Samples converted at once.
+const size_t BLOCK_SAMPLES = 1 << 20;
+
+static void write_all(int fd, const void *buf, size_t n, const std::string &path)
+{
+	const char *p = static_cast<const char *>(buf);
+	while (n) {
+		const ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0)
+			fatal("failed to write \"" + path + "\"");
+		p += w;
+		n -= w;
+	}
+}
+
+static size_t read_all(int fd, void *buf, size_t n, const std::string &path)
+{
+	char *p = static_cast<char *>(buf);
+	size_t total = 0;
+	while (total < n) {
+		const ssize_t r = read(fd, p + total, n - total);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			fatal("failed to read \"" + path + "\"");
+		if (r == 0)
+			break;
+		total += r;
+	}
+	return total;
+}
+
+// Returns false if the recording does not fit in the packed format, with
+// the given shift.
+static bool convert(const std::string &src, const std::string &dst, bool unpack, unsigned shift)
+{
+	const int in = open(src.c_str(), O_RDONLY);
+	if (in < 0)
+		fatal("failed to open \"" + src + "\"");
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	const std::string tmp = dst + ".tmp";
+	const int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+		fatal("failed to create \"" + tmp + "\"");
+
+	packed_header_t h {};
+	if (unpack) {
+		if (read_all(in, &h, sizeof(h), src) != sizeof(h) ||
+		    std::memcmp(h.magic, PACKED_MAGIC, sizeof(PACKED_MAGIC)) || (h.shift != 0 && h.shift != 8))
+			fatal("\"" + src + "\" is not a packed recording");
+		shift = h.shift;
+	} else {
+		std::memcpy(h.magic, PACKED_MAGIC, sizeof(PACKED_MAGIC));
+		h.shift = shift;
+		write_all(out, &h, sizeof(h), tmp);
+	}
+
+	std::vector<int32_t> wide(BLOCK_SAMPLES);
+	std::vector<uint8_t> packed(BLOCK_SAMPLES * 3);
+	bool ok = true;
+	while (ok) {
+		size_t n;
+		if (unpack) {
+			n = read_all(in, packed.data(), packed.size(), src) / 3;
+			unpack_s24le(packed.data(), wide.data(), n, shift);
+			write_all(out, wide.data(), n * sizeof(int32_t), tmp);
+		} else {
+			n = read_all(in, wide.data(), wide.size() * sizeof(int32_t), src) / sizeof(int32_t);
+			ok = pack_s24le(wide.data(), packed.data(), n, shift);
+			write_all(out, packed.data(), n * 3, tmp);
+		}
+		if (n < BLOCK_SAMPLES)
+			break;
+	}
+	close(in);
+
+	if (!ok) {
+		close(out);
+		std::remove(tmp.c_str());
+		return false;
+	}
+	if (fsync(out) < 0 || close(out) < 0)
+		fatal("failed to write \"" + tmp + "\"");
+	if (std::rename(tmp.c_str(), dst.c_str()) < 0)
+		fatal("failed to rename \"" + tmp + "\"");
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: pack-recordings [-d] [-u] RECORDING...";
+	bool delete_src = false, unpack = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "du")) != -1) {
+		switch (opt) {
+		case 'd':
+			delete_src = true;
+			break;
+		case 'u':
+			unpack = true;
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind < 1)
+		fatal(usage);
+
+	const std::string src_ext = unpack ? PACKED_EXTENSION : RAW_EXTENSION;
+	const std::string dst_ext = unpack ? RAW_EXTENSION : PACKED_EXTENSION;
+	int nfailed = 0;
+	for (int i = optind; i < argc; i++) {
+		const std::string src = argv[i];
+		if (!src.ends_with(src_ext))
+			fatal("\"" + src + "\" is not named *" + src_ext);
+		const std::string dst = src.substr(0, src.size() - src_ext.size()) + dst_ext;
+
+		const auto t0 = std::chrono::steady_clock::now();
+		// Most likely the samples are sign-extended, so try that first.
+		if (!convert(src, dst, unpack, 0) && !convert(src, dst, unpack, 8)) {
+			std::cerr << src << ": samples do not fit in 24 bits, skipped" << std::endl;
+			nfailed++;
+			continue;
+		}
+		const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		std::cout << src << " -> " << dst << std::fixed << std::setprecision(2);
+		std::cout << " (" << secs << " s)" << std::endl;
+		if (delete_src && std::remove(src.c_str()) < 0)
+			fatal("failed to delete \"" + src + "\"");
+	}
+
+	return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -15,6 +15,8 @@ import sys
 import tensorflow as tf
 from tensorflow import keras
 
+import doa_layers
+
 
 def main():
     parser = argparse.ArgumentParser(description='Plot the DOA estimation model.')
@@ -24,7 +26,7 @@ def main():
         help = 'Output PNG file')
     args = parser.parse_args()
 
-    model = keras.models.load_model(args.model)
+    model = keras.models.load_model(args.model, custom_objects=doa_layers.custom_objects())
     keras.utils.plot_model(model, to_file=args.output, show_shapes=True)
     sys.exit(0)
 
@@ -11,11 +11,28 @@
 // no efficient. Storing a large number of small files in a filesystem
 // directory structure is orders of magnitude faster.
 //
+// Alternatively, with "-s" the datasets are appended as fixed-size records
+// to a few large shard files, and an index with bitmaps per attribute
+// is written alongside them. See dataset-index.h. With "-S SEED" instead,
+// the records are also shuffled across the shards.
+//
+// With "-u" only the unrotated datasets are stored, for training
+// the rotation-equivariant model.
+//
+// Recordings compressed to FLAC are decoded by "-j THREADS" threads,
+// ahead of the scan.
+//
+// With "-n FRACTION" nothing is written. Only the given fraction of chunks
+// is scanned, and the output size and processing time are projected. The
+// time to write the output is included only with "-W", which measures the
+// write throughput with a probe file next to the output directory.
+//
 // TODO - remove the "Cisms" and switch to modern C++ paradigms and style.
 
 #include <cstdlib>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
 
 #include <iostream>
 #include <fstream>
@@ -23,23 +40,22 @@
 #include <algorithm>
 #include <filesystem>
 #include <chrono>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <unordered_map>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
-#include <wordexp.h>
-
-// Input (and output!) audio format.
-const int NCHANNELS = 8;
-const int BITS_PER_SAMPLE = 32;
-const int SAMPLES_PER_SECOND = 24000;
 
-// Parsing parameters
-const float INITIAL_SKIP_S = 0.5;	// Recording sometimes starts with a glitch.
-const float SILENCE_TRAINING_S = 1.0;	// A period which we know is silent.
-const float VALID_SAMPLE_THRESHOLD = 1.1; // Threshold over maximum silence to consider a sample valid.
-const float VALID_SAMPLES_PERCENT = 10;	// Minimum percentage of valid samples to consider a chunk valid.
+#include "chunk-stats.h"
+#include "common.h"
+#include "dataset-index.h"
+#include "raw-audio.h"
+#include "trace.h"
 
 // Neural Network's input parameters.
 const int OUT_NSAMPLES = 512;		//Output audio chunk size to save.
@@ -53,69 +69,340 @@ const bool VERBOSE = true;
 const int OUT_DROP_PERCENT = 95;	// Randomly drop this number of datasets. Useful if
 					// the input raw data is too large.
 
+const int VALID_SPLIT_PERCENT = 10;	// Percentage of chunks to mark for validation.
+const int SHARD_NRECORDS = 4096;	// Maximum number of records in a single shard file.
+const int SHUFFLE_NBUCKETS = 256;	// Temporary files of the global shuffle.
+const size_t SHUFFLE_BUCKET_NBYTES = size_t(256) << 20; // Largest bucket shuffled in memory.
+
 namespace fs = std::filesystem;
 
 //----------------------------------------------------------------------------
-static void fatal(const std::string &s)
+
+// Destination where the datasets are saved.
+class dataset_store {
+public:
+	virtual ~dataset_store()
+	{
+	}
+
+	// Save one dataset. The name is unique for the dataset's origin.
+	virtual void save(const dataset_attrs_t &attrs, const int32_t *arr, const std::string &name) = 0;
+
+	// Called once after all datasets have been saved.
+	virtual void finish()
+	{
+	}
+};
+
+// Store each dataset as a separate file, in a directory tree named per the features.
+class tree_store : public dataset_store {
+public:
+	tree_store(const fs::path &_outbase) : outbase(_outbase)
+	{
+	}
+
+	virtual void save(const dataset_attrs_t &attrs, const int32_t *arr, const std::string &name)
+	{
+		fs::path path = attrs[ATTR_CLASS];
+		if (attrs[ATTR_ELEV] != ATTR_NONE)
+			path = path / attrs[ATTR_ELEV] / attrs[ATTR_DISTANCE];
+		fs::create_directories(outbase / path);
+		const fs::path dst = outbase / path / name;
+		std::fstream s {dst, s.binary | s.trunc | s.out};
+		if (!s.is_open()) {
+			fatal("Failed to open " + dst.string());
+		}
+		s.write(reinterpret_cast<const char *>(arr), sizeof(arr[0]) * OUT_DATASET_NWORDS);
+	}
+
+private:
+	const fs::path outbase;
+};
+
+// Fast non-cryptographic 128-bit hash of a dataset, in the spirit of xxHash64.
+// The four independent lanes keep the multipliers busy (and are friendly
+// to vectorization), so hashing costs a small fraction of a ns per byte.
+struct record_hash_t {
+	uint64_t lo, hi;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
 {
-	std::cerr << "ERROR: " << s << std::endl;
-	std::cerr << "   errno=" << errno << std::endl;
-	std::abort();
+	return (x << r) | (x >> (64 - r));
 }
 
-// Helper class for access to a large file consisting of
-// consecutive signed 32-bit little-endian integer values.
-class s32le_buf_t {
-public:
-	~s32le_buf_t() {
-		if (this->raw)
-			munmap((void *)this->raw, this->len * sizeof(int32_t));
+static inline uint64_t hash_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xC2B2AE3D27D4EB4Full;
+	h ^= h >> 29;
+	h *= 0x165667B19E3779F9ull;
+	h ^= h >> 32;
+	return h;
+}
+
+static record_hash_t hash_record(const int32_t *arr)
+{
+	const uint64_t P1 = 0x9E3779B185EBCA87ull;
+	const uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+	const size_t nwords = OUT_DATASET_NWORDS * sizeof(int32_t) / sizeof(uint64_t);
+	static_assert(nwords % 4 == 0);
+	uint64_t acc[4] = { P1 + P2, P2, 0, 0 - P1 };
+
+	for (size_t i = 0; i < nwords; i += 4) {
+		for (size_t lane = 0; lane < 4; lane++) {
+			uint64_t v;
+			std::memcpy(&v, reinterpret_cast<const char *>(arr) + (i + lane) * sizeof(v), sizeof(v));
+			acc[lane] = rotl64(acc[lane] + v * P2, 31) * P1;
+		}
 	}
 
-	// TODO - hide these under a sane iterator/container/operator[] interface.
-	const int32_t *raw;
-	off_t len;
+	return {
+		hash_avalanche(rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18)),
+		hash_avalanche(acc[0] ^ rotl64(acc[1], 13) ^ rotl64(acc[2], 29) ^ rotl64(acc[3], 41)),
+	};
+}
 
-	static std::shared_ptr<s32le_buf_t> open(std::string fpath)
+// Append datasets as records to large shard files, and index them.
+//
+// Overlapping recordings and re-runs may produce identical datasets. Each
+// record's content is hashed, and duplicates are stored only once. Their
+// index entries simply refer to the already stored record.
+//
+// With a seed, the records are shuffled across all the shards, so that
+// training can read them front to back and still get well mixed batches.
+// Each record is first appended to one of SHUFFLE_NBUCKETS temporary files,
+// picked at random. Then each bucket in turn is read, shuffled in memory,
+// and appended to the shards. A bucket too large for memory is split
+// again the same way, so the shuffle takes bounded memory for any size.
+class shard_store : public dataset_store {
+public:
+	shard_store(const fs::path &_outbase, std::optional<uint64_t> _shuffle_seed = std::nullopt)
+		: outbase(_outbase), index(sizeof(int32_t) * OUT_DATASET_NWORDS),
+		  shuffle_seed(_shuffle_seed), rng(_shuffle_seed.value_or(0))
 	{
-		int fd = ::open(fpath.c_str(), O_RDONLY);
-		if (fd < 0)
-			fatal("failed to open file \"" + fpath + "\"");
+		fs::create_directories(outbase);
+		fs::remove(outbase / DATASET_SHUFFLED_FILENAME);
+		if (shuffle_seed) {
+			for (int b = 0; b < SHUFFLE_NBUCKETS; b++)
+				buckets.push_back(create_bucket(bucket_path(b)));
+			bucket_nrecords.resize(SHUFFLE_NBUCKETS);
+		}
+	}
 
-		struct stat statbuf;
-		int err = fstat(fd, &statbuf);
-		if (err < 0)
-			fatal("failed to fstat file \"" + fpath + "\"");
-		off_t len = statbuf.st_size  - (statbuf.st_size % sizeof(int32_t));
-		void *tmp = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
-		if (tmp == MAP_FAILED)
-			fatal("failed to mmap file \"" + fpath + "\"");
-		madvise(tmp, len, MADV_SEQUENTIAL);
-		auto o = new s32le_buf_t(static_cast<const int32_t *>(tmp), len / sizeof(int32_t));
+	// The chunk name is not needed, since the index records the source.
+	virtual void save(const dataset_attrs_t &attrs, const int32_t *arr, const std::string &)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		const record_hash_t h = hash_record(arr);
+		hash_time += std::chrono::steady_clock::now() - t0;
+
+		// A collision of the lower halves is astronomically unlikely.
+		// Still, do not mistake such records for duplicates.
+		auto it = stored.find(h.lo);
+		if (it != stored.end() && it->second.hash_hi == h.hi) {
+			index.add(it->second.shard, it->second.slot, attrs);
+			nduplicates++;
+			return;
+		}
 
-		close(fd);
+		if (shuffle_seed) {
+			// Stored once shuffled. Until then, the slot is the ID
+			// of the record in the buckets.
+			const int b = rng() % SHUFFLE_NBUCKETS;
+			bucket_buf.id = nunique++;
+			std::memcpy(bucket_buf.data, arr, sizeof(bucket_buf.data));
+			buckets[b].write(reinterpret_cast<const char *>(&bucket_buf), sizeof(bucket_buf));
+			bucket_nrecords[b]++;
+			if (it == stored.end())
+				stored.emplace(h.lo, stored_record {h.hi, 0, bucket_buf.id});
+			index.add(0, bucket_buf.id, attrs);
+			return;
+		}
 
-		return std::shared_ptr<s32le_buf_t>(o);
+		const auto [shard, slot] = append(arr);
+		if (it == stored.end())
+			stored.emplace(h.lo, stored_record {h.hi, shard, slot});
+		index.add(shard, slot, attrs);
+	}
+
+	virtual void finish()
+	{
+		if (shuffle_seed) {
+			auto t0 = std::chrono::steady_clock::now();
+			std::vector<uint32_t> pos(nunique);
+			for (int b = 0; b < SHUFFLE_NBUCKETS; b++)
+				close_bucket(buckets[b], bucket_path(b));
+			for (int b = 0; b < SHUFFLE_NBUCKETS; b++)
+				shuffle_bucket(bucket_path(b), bucket_nrecords[b], pos);
+			index.relocate([&pos](dataset_record_t &r) {
+				r.shard = pos[r.slot] / SHARD_NRECORDS;
+				r.slot = pos[r.slot] % SHARD_NRECORDS;
+			});
+			shuffle_time = std::chrono::steady_clock::now() - t0;
+		}
+		s.close();
+		index.save(outbase / DATASET_INDEX_FILENAME);
+		if (shuffle_seed) {
+			std::ofstream f {outbase / DATASET_SHUFFLED_FILENAME};
+			f << *shuffle_seed << std::endl;
+			if (!f)
+				fatal("Failed to write " + (outbase / DATASET_SHUFFLED_FILENAME).string());
+		}
+		if (VERBOSE) {
+			const double nbytes = double(index.size()) * sizeof(int32_t) * OUT_DATASET_NWORDS;
+			std::cout << "Stored " << index.size() << " records in " << nshards << " shards." << std::endl;
+			std::cout << "    Duplicates: " << nduplicates;
+			// Nothing to compare when no records were stored.
+			if (index.size() > nduplicates) {
+				std::cout << " (dedupe ratio " << double(index.size()) / (index.size() - nduplicates) << ")";
+				std::cout << std::endl << "    Hashing cost: ";
+				std::cout << std::chrono::duration<double, std::nano>(hash_time).count() / nbytes;
+				std::cout << " ns/byte";
+			}
+			std::cout << std::endl;
+			if (shuffle_seed) {
+				std::cout << "    Shuffled with seed " << *shuffle_seed << " in ";
+				std::cout << std::chrono::duration<double>(shuffle_time).count() << " s" << std::endl;
+			}
+		}
 	}
 
 private:
-	// Force usage only through shared_ptr.
-	s32le_buf_t() : raw(NULL), len(0) {}
-	s32le_buf_t(const int32_t *p, off_t l) : raw(p), len(l) {
-		if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
-			fatal("big endian hosts not yet supported");
+	struct stored_record {
+		uint64_t hash_hi;
+		uint32_t shard;
+		uint32_t slot;
+	};
+
+	struct bucket_record_t {
+		uint32_t id;
+		int32_t data[OUT_DATASET_NWORDS];
+	};
+
+	// Returns the shard and slot of the record.
+	std::pair<uint32_t, uint32_t> append(const int32_t *arr)
+	{
+		if (nshards == 0 || slot == SHARD_NRECORDS) {
+			const fs::path dst = outbase / dataset_shard_filename(nshards);
+			s.close();
+			s.open(dst, s.binary | s.trunc | s.out);
+			if (!s.is_open())
+				fatal("Failed to open " + dst.string());
+			nshards++;
+			slot = 0;
+		}
+		s.write(reinterpret_cast<const char *>(arr), sizeof(arr[0]) * OUT_DATASET_NWORDS);
+		return {nshards - 1, slot++};
+	}
+
+	fs::path bucket_path(int b) const
+	{
+		return outbase / (".shuffle-" + std::to_string(b) + ".tmp");
+	}
+
+	static std::ofstream create_bucket(const fs::path &path)
+	{
+		std::ofstream f {path, f.binary | f.trunc};
+		if (!f.is_open())
+			fatal("Failed to open " + path.string());
+		return f;
+	}
+
+	static void close_bucket(std::ofstream &f, const fs::path &path)
+	{
+		f.close();
+		if (!f)
+			fatal("Failed to write " + path.string());
+	}
+
+	// Append the records of a bucket to the shards, in random order, and
+	// note the position of each, by ID.
+	void shuffle_bucket(const fs::path &path, size_t n, std::vector<uint32_t> &pos)
+	{
+		std::ifstream f {path, f.binary};
+		if (!f.is_open())
+			fatal("Failed to open " + path.string());
+		auto read_record = [&](bucket_record_t &rec) {
+			if (!f.read(reinterpret_cast<char *>(&rec), sizeof(rec)))
+				fatal("Failed to read " + path.string());
+		};
+
+		if (n * sizeof(bucket_record_t) > SHUFFLE_BUCKET_NBYTES) {
+			const size_t nsub = std::min<size_t>(SHUFFLE_NBUCKETS,
+				2 * n * sizeof(bucket_record_t) / SHUFFLE_BUCKET_NBYTES + 1);
+			std::vector<std::ofstream> sub;
+			std::vector<size_t> sub_nrecords(nsub);
+			for (size_t k = 0; k < nsub; k++)
+				sub.push_back(create_bucket(path.string() + "." + std::to_string(k)));
+			for (size_t i = 0; i < n; i++) {
+				read_record(bucket_buf);
+				const size_t k = rng() % nsub;
+				sub[k].write(reinterpret_cast<const char *>(&bucket_buf), sizeof(bucket_buf));
+				sub_nrecords[k]++;
+			}
+			f.close();
+			fs::remove(path);
+			for (size_t k = 0; k < nsub; k++)
+				close_bucket(sub[k], path.string() + "." + std::to_string(k));
+			for (size_t k = 0; k < nsub; k++)
+				shuffle_bucket(path.string() + "." + std::to_string(k), sub_nrecords[k], pos);
+			return;
+		}
+
+		std::vector<bucket_record_t> recs(n);
+		for (auto &rec : recs)
+			read_record(rec);
+		f.close();
+		fs::remove(path);
+		// Records are large. Shuffle their order instead.
+		std::vector<uint32_t> order(n);
+		std::iota(order.begin(), order.end(), 0);
+		std::shuffle(order.begin(), order.end(), rng);
+		for (uint32_t i : order) {
+			const auto [shard, slot] = append(recs[i].data);
+			pos[recs[i].id] = shard * SHARD_NRECORDS + slot;
+		}
+	}
+
+	const fs::path outbase;
+	dataset_index_writer index;
+	std::fstream s;
+	uint32_t nshards = 0;
+	uint32_t slot = 0;
+	std::unordered_map<uint64_t, stored_record> stored;
+	size_t nduplicates = 0;
+	std::chrono::steady_clock::duration hash_time {};
+
+	const std::optional<uint64_t> shuffle_seed;
+	std::mt19937_64 rng;
+	std::vector<std::ofstream> buckets;
+	std::vector<size_t> bucket_nrecords;
+	bucket_record_t bucket_buf;
+	uint32_t nunique = 0;
+	std::chrono::steady_clock::duration shuffle_time {};
+};
+
+// Only count the datasets per class, in order to project the output size.
+class dry_run_store : public dataset_store {
+public:
+	std::map<std::string, size_t> class_counts;
+
+	virtual void save(const dataset_attrs_t &attrs, const int32_t *, const std::string &)
+	{
+		class_counts[attrs[ATTR_CLASS]]++;
 	}
 };
 
 //----------------------------------------------------------------------------
 
-// Base class for outputting datasets to a filesystem tree.
+// Base class for outputting datasets.
 class base_output {
 public:
 	const fs::path srcpath;
 
-	base_output(const fs::path &_srcpath, const fs::path &_outbase)
-		: srcpath(_srcpath), outbase(_outbase)
+	base_output(const fs::path &_srcpath, dataset_store &_store)
+		: srcpath(_srcpath), store(_store)
 	{
 	}
 	virtual ~base_output()
@@ -127,11 +414,15 @@ public:
 	// before the actual data save.
 	virtual bool save_chunk(const int32_t arr[OUT_NSAMPLES * NCHANNELS], off_t chunk_i, bool is_silence) = 0;
 
+	// Whether save_chunk() would save anything. Chunks which would not
+	// be saved are not even read, if their class is known beforehand.
+	virtual bool wants_chunk(bool is_silence) const = 0;
+
 protected:
-	const fs::path outbase;
+	dataset_store &store;
 
-	// Useful utility function to save raw data to a file.
-	void save_to_file(const fs::path &path,
+	// Useful utility function to save raw data to the store.
+	void save_to_file(dataset_attrs_t attrs,
 			const int32_t *arr, off_t chunk_i)
 	{
 		int rnd = std::rand() % 100;
@@ -139,21 +430,30 @@ protected:
 			return;
 		// Let's use filename() instead of stem() for a more definitive record of the origin.
 		const auto fname = this->srcpath.filename().string() + "_" + std::to_string(chunk_i);
-		fs::create_directories(outbase / path);
-		const fs::path dst = outbase / path / fname;
-		std::fstream s {dst, s.binary | s.trunc | s.out};
-		if (!s.is_open()) {
-			fatal("Failed to open " + dst.string());
-		}
-		s.write(reinterpret_cast<const char *>(arr), sizeof(arr[0]) * OUT_DATASET_NWORDS);
+		attrs[ATTR_SOURCE] = this->srcpath.filename().string();
+		attrs[ATTR_SPLIT] = is_validation_chunk(fname) ? "valid" : "train";
+		trace_span_t span("write");
+		store.save(attrs, arr, fname);
+	}
+
+private:
+	// All variants of a chunk must end up in the same split. Otherwise
+	// the validation set would leak into the training set. Hence pick
+	// the split using a hash (FNV-1a) of the chunk's origin.
+	static bool is_validation_chunk(const std::string &fname)
+	{
+		uint32_t h = 2166136261u;
+		for (unsigned char c : fname)
+			h = (h ^ c) * 16777619u;
+		return (h % 100) < VALID_SPLIT_PERCENT;
 	}
 };
 
 // Output silence datasets.
 class silence_output : public base_output {
 public:
-	silence_output(const fs::path &_srcpath, const fs::path &_outbase)
-		: base_output(_srcpath, _outbase)
+	silence_output(const fs::path &_srcpath, dataset_store &_store)
+		: base_output(_srcpath, _store)
 	{
 	}
 	virtual ~silence_output()
@@ -164,7 +464,11 @@ public:
 		if (is_silence) {
 			/* Doesn't matter.  We want to record the silence. */;
 		}
-		this->save_to_file("silence", arr, chunk_i);
+		this->save_to_file({"silence", ATTR_NONE, ATTR_NONE}, arr, chunk_i);
+		return true;
+	}
+	virtual bool wants_chunk(bool) const
+	{
 		return true;
 	}
 };
@@ -172,28 +476,18 @@ public:
 // Output speech datasets from a particular angle.
 class dataset_output : public base_output {
 public:
-	dataset_output(const fs::path &_srcpath, const fs::path &_outbase)
-		: base_output(_srcpath, _outbase),
-		  subangle(-1.0), elev(-1.0), distance(-1.0)
+	// Only the first nrotations rotated variants of each chunk are saved.
+	// A rotation-equivariant model needs only the unrotated one.
+	dataset_output(const fs::path &_srcpath, dataset_store &_store, int _nrotations = NCHANNELS)
+		: base_output(_srcpath, _store),
+		  subangle(-1.0), elev(-1.0), distance(-1.0), nrotations(_nrotations)
 	{
- 		/*
-		 * Extract the physical environment settings for a
-		 * microphone recording, given its filename.
-		 *
-		 * Example input: output-05.625deg-0elev-1.0m.raw
-		 * Example parameters: ('05.625', '0', '1.0')
-		 */
-		int i_elev = 0;
-		int n = std::sscanf(srcpath.filename().string().c_str(),
-				"output-%fdeg-%delev-%fm.raw",
-				&this->subangle, &i_elev, &this->distance);
-		this->elev = i_elev;
-
-		if (n != 3) {
+		if (!parse_recording_filename(srcpath.filename().string(),
+					      this->subangle, this->elev, this->distance)) {
 			fatal(srcpath.filename().string() + " has invalid filename.");
 		}
 
-		// Initialize the angle directory paths, so they
+		// Initialize the angle attributes, so they
 		// can be easily reused when saving the chunks.
 		for (int mic_offs = 0; mic_offs < NCHANNELS; mic_offs++) {
 			float angle = this->subangle + mic_offs * (360.0 / NCHANNELS);
@@ -201,10 +495,8 @@ public:
 			sprintf(a_str, "%1.3f", angle);
 			sprintf(e_str, "%1.1f", this->elev);
 			sprintf(d_str, "%1.1f", this->distance);
-			fs::path path = a_str;
-			path = path / e_str / d_str;
-			this->angle_dirs[mic_offs] = path;
-			//std::cout << "Directories: " << path << std::endl;
+			this->angle_attrs[mic_offs] = {a_str, e_str, d_str};
+			//std::cout << "Attributes: " << a_str << " " << e_str << " " << d_str << std::endl;
 		}
 	}
 	virtual ~dataset_output()
@@ -217,7 +509,8 @@ public:
 		if (is_silence)
 			return false;
 
-		for (int mic_offs = 0; mic_offs < NCHANNELS; mic_offs++) {
+		trace_span_t span("rotate");
+		for (int mic_offs = 0; mic_offs < nrotations; mic_offs++) {
 			int32_t data[OUT_DATASET_NWORDS];
 			// This is important!!!!
 			//
@@ -246,31 +539,28 @@ public:
 			for (size_t si = 0; si < OUT_DATASET_NWORDS; si += NCHANNELS)
 				for (size_t chi = 1; chi < NCHANNELS; chi++)
 					data[si + chi] -= data[si];
-			this->save_to_file(this->angle_dirs[mic_offs], data, chunk_i);
+			this->save_to_file(this->angle_attrs[mic_offs], data, chunk_i);
 		}
 		return true;
 	}
+	virtual bool wants_chunk(bool is_silence) const
+	{
+		return !is_silence;
+	}
 private:
 	float subangle;
 	float elev;
 	float distance;
-	fs::path angle_dirs[NCHANNELS];
+	const int nrotations;
+	dataset_attrs_t angle_attrs[NCHANNELS];
 };
 //----------------------------------------------------------------------------
 
-// Calculate offset (in number of S32LE words) out of the given
-// length of audio, in seconds.
-static inline off_t secs2offs(double nsecs)
-{
-	double nsamples = double(SAMPLES_PER_SECOND) * nsecs;
-
-	return off_t(std::floor(nsamples)) * NCHANNELS;
-}
-
-static bool int32_cmp_abs(int32_t a, int32_t b)
-{
-	return std::labs(a) < std::labs(b);
-}
+// Thresholds for selecting the chunks with useful audio.
+struct chunk_selection_t {
+	float sample_threshold = VALID_SAMPLE_THRESHOLD;
+	float samples_percent = VALID_SAMPLES_PERCENT;
+};
 
 /*
  Parse a raw micriphone recording file. Detect chunks (intervals) of audio
@@ -289,81 +579,251 @@ static bool int32_cmp_abs(int32_t a, int32_t b)
      Scan the rest of the file. If each successive chunk has
      enough samples above the threshold of silence, record
      them as useful for training.
+
+ Only every chunk_stride-th chunk is scanned. Larger strides are used
+ for quickly estimating the output size.
+
+ The statistics of the chunks are kept in a sidecar file, see
+ chunk-stats.h. With them, only the chunks which are saved, and those
+ too close to the thresholds to tell, are read from the recording.
+
+ The time spent scanning the chunks, i.e. apart from opening the
+ recording and training for silence, is added to scan_time.
+
+ Returns the number of bytes in the recording.
 */
-static void process_raw_audio_file(base_output &out)
+static off_t process_raw_audio_file(base_output &out, const chunk_selection_t &sel,
+				    std::chrono::steady_clock::duration &scan_time, off_t chunk_stride = 1)
 {
 	const std::string fpath = out.srcpath.string();
 
 	std::cout << "Processing " << fpath << " ..." << std::endl;
 
-	auto m = s32le_buf_t::open(fpath);
-
-	const auto silence_scan_i = secs2offs(INITIAL_SKIP_S);
-	const auto data_scan_i = silence_scan_i + secs2offs(SILENCE_TRAINING_S);
-
-	if (silence_scan_i >= m->len || data_scan_i >= m->len)
-		fatal("input file \"" + fpath + "\" is too short");
+	trace_span_t file_span("file");
+	const off_t chunk_len = OUT_NSAMPLES * NCHANNELS;
+	auto stats = chunk_stats_t::load(fpath, chunk_len);
 
-	const int32_t silence_max = std::labs(*std::max_element(m->raw + silence_scan_i, m->raw + data_scan_i, int32_cmp_abs));
+	std::shared_ptr<raw_audio_t> m;
+	{
+		trace_span_t span("open");
+		// Sparse access would only be slowed down by read-ahead. With
+		// the statistics, only the selected chunks are read, so leave
+		// read-ahead to the heuristics of the kernel.
+		int advice = stats ? MADV_NORMAL : MADV_SEQUENTIAL;
+		m = raw_audio_t::open(fpath, chunk_stride > 1 ? MADV_RANDOM : advice);
+	}
 
-	const int32_t silence_threshold = double(silence_max) * VALID_SAMPLE_THRESHOLD;
+	// A sparse scan does not compute them, since it would read it all.
+	// A full one adds each chunk as it goes, so that a compressed
+	// recording is decoded only once.
+	const bool computing = !stats && chunk_stride == 1;
+	if (computing) {
+		trace_span_t span("chunk_stats");
+		stats = chunk_stats_t::create(*m, chunk_len, fpath);
+	}
 
-	const off_t chunk_len = OUT_NSAMPLES * NCHANNELS;
-	const int nvals_threshold = double(chunk_len) * VALID_SAMPLES_PERCENT / 100.0;
+	silence_params_t sp;
+	if (stats) {
+		sp = stats->params(sel.sample_threshold, sel.samples_percent);
+	} else {
+		trace_span_t span("train_silence");
+		sp = train_silence(*m, chunk_len, fpath, sel.sample_threshold, sel.samples_percent);
+	}
 
 	if (VERBOSE) {
-		std::cout << "    Max silence sample: 0x" << std::hex << silence_max << std::endl;
+		std::cout << "    Max silence sample: 0x" << std::hex << sp.silence_max << std::endl;
 		std::cout << std::dec;
-		std::cout << "    Silence index: " << silence_scan_i << std::endl;
-		std::cout << "    Data scan index: " << data_scan_i << std::endl;
-		std::cout << "    Silence threshold: " << silence_max << std::endl;
-		std::cout << "    Num values threshold: " << nvals_threshold;
+		std::cout << "    Silence index: " << sp.silence_scan_i << std::endl;
+		std::cout << "    Data scan index: " << sp.data_scan_i << std::endl;
+		std::cout << "    Silence threshold: " << sp.silence_max << std::endl;
+		std::cout << "    Num values threshold: " << sp.nvals_threshold;
 		std::cout << "/" << chunk_len << std::endl;
 	}
 
-	int num_chunks = 0;
+	int num_chunks = 0, num_counted = 0;
 
-	for (off_t chunk_i = data_scan_i;
+	const auto t_scan = std::chrono::steady_clock::now();
+	for (off_t chunk_i = sp.data_scan_i;
 	     chunk_i <= (m->len - chunk_len);
-	     chunk_i += chunk_len) {
-		auto chunk = &m->raw[chunk_i];
-
-		auto cmp_to_threshold = [silence_threshold](const int32_t val) {
-			return std::labs(val) >= silence_threshold;
-		};
-
-		int nvals = std::count_if (chunk,
-					   chunk + chunk_len,
-					   cmp_to_threshold);
-
-		const bool is_silence = (nvals >= nvals_threshold);
+	     chunk_i += chunk_len * chunk_stride) {
+		const size_t k = (chunk_i - sp.data_scan_i) / chunk_len;
+		if (computing)
+			stats->add_chunk(k, m->samples(chunk_i, chunk_len));
+		int nvals_lo = 0, nvals_hi = chunk_len;
+		if (stats)
+			stats->valid_samples_bounds(sp, k, nvals_lo, nvals_hi);
+
+		// A chunk is silent unless enough of its samples are valid,
+		// i.e. louder than the silence.
+		bool is_silence;
+		if (nvals_lo >= sp.nvals_threshold) {
+			is_silence = false;
+		} else if (nvals_hi < sp.nvals_threshold) {
+			is_silence = true;
+		} else {
+			trace_span_t span("scan");
+			is_silence = (count_valid_samples(sp, m->samples(chunk_i, chunk_len), chunk_len) < sp.nvals_threshold);
+			num_counted++;
+		}
 
-		if (out.save_chunk(chunk, chunk_i, is_silence))
+		if (!out.wants_chunk(is_silence))
+			continue;
+		if (out.save_chunk(m->samples(chunk_i, chunk_len), chunk_i, is_silence))
 			num_chunks++;
 	}
+	scan_time += std::chrono::steady_clock::now() - t_scan;
+	if (computing && !stats->save(fpath))
+		std::cerr << "    Failed to save " << chunk_stats_t::sidecar_path(fpath) << std::endl;
 	if (VERBOSE) {
+		std::cout << "    Number of chunks counted from the recording: " << num_counted << std::endl;
 		std::cout << "    Number of data chunks recorded: " << num_chunks;
-		std::cout << " (" << ((num_chunks * chunk_len * 100) / m->len) << "%)" << std::endl;
+		std::cout << " (" << ((num_chunks * chunk_stride * chunk_len * 100) / m->len) << "%)" << std::endl;
+		if (m->nstalls) {
+			std::cout << "    Waited for decoding: " << m->nstalls << " times, ";
+			std::cout << std::lround(m->stall_secs * 1000) << " ms" << std::endl;
+		}
 	}
+
+	return m->file_size();
 }
 
 //----------------------------------------------------------------------------
 
-//----------------------------------------------------------------------------
+// Measure how fast datasets can be written next to the output directory,
+// i.e. in the closest existing directory above it, most likely on the same
+// filesystem. The output directory itself is left alone. Returns bytes per
+// second.
+static double measure_write_throughput(const fs::path &outdir)
+{
+	const size_t nbytes = 64 * 1024 * 1024;
+	const std::vector<char> buf(nbytes / 64);
+	fs::path dir = fs::absolute(outdir).lexically_normal();
+	if (!dir.has_filename())
+		dir = dir.parent_path();
+	dir = dir.parent_path();
+	while (!fs::is_directory(dir))
+		dir = dir.parent_path();
+	std::string probe = (dir / ".prepare-data-probe-XXXXXX").string();
+
+	auto t0 = std::chrono::steady_clock::now();
+	int fd = mkstemp(probe.data());
+	if (fd < 0)
+		fatal("failed to create a probe file in \"" + dir.string() + "\"");
+	for (size_t n = 0; n < nbytes; n += buf.size())
+		if (write(fd, buf.data(), buf.size()) != ssize_t(buf.size()))
+			fatal("failed to write \"" + probe + "\"");
+	fsync(fd);
+	close(fd);
+	auto t1 = std::chrono::steady_clock::now();
+	fs::remove(probe);
+
+	return nbytes / std::chrono::duration<double>(t1 - t0).count();
+}
 
-int main(int argc, char *argv[])
+// Project the full run's output, given the results of a sampled one.
+// Only the chunk scan is scaled up, and the rest of the time, e.g.
+// opening the recordings and training for silence, is taken as is. The
+// time to write the output is left out if the write throughput is 0.
+static void print_dry_run_report(const dry_run_store &store, off_t chunk_stride,
+				 off_t input_bytes, double scan_secs, double other_secs,
+				 double write_bytes_per_sec)
 {
-	// TODO - proper argv parsing
-	if (argc != 3)
-		fatal("Usage: create-hdf5-data <RAW_AUDIO_DIRECTORY> <OUTPUT_HDF5>");
+	const double record_bytes = sizeof(int32_t) * OUT_DATASET_NWORDS;
+	const double input_scanned = double(input_bytes) / chunk_stride;
+	size_t nrecords = 0;
+
+	std::cout << "Projected output, per class:" << std::endl;
+	for (const auto &[cls, n] : store.class_counts) {
+		std::cout << "    " << cls << ": " << n * chunk_stride << " datasets, ";
+		std::cout << (n * chunk_stride * record_bytes) / (1024 * 1024) << " MiB" << std::endl;
+		nrecords += n * chunk_stride;
+	}
 
-	const std::string fpattern = std::string(argv[1]) + "/output-*deg-*elev-*m.raw";
-	const std::string fpattern_silence = std::string(argv[1]) + "/output-silence*.raw";
+	const double output_bytes = nrecords * record_bytes;
+	const double scan_bytes_per_sec = input_scanned / scan_secs;
+	std::cout << "Projected total: " << nrecords << " datasets, ";
+	std::cout << output_bytes / (1024 * 1024) << " MiB" << std::endl;
+	std::cout << "Measured scan throughput: " << scan_bytes_per_sec / (1024 * 1024) << " MiB/s";
+	if (write_bytes_per_sec)
+		std::cout << ", write throughput: " << write_bytes_per_sec / (1024 * 1024) << " MiB/s";
+	std::cout << std::endl;
+	std::cout << "Projected wall time: ";
+	std::cout << other_secs + scan_secs * chunk_stride + (write_bytes_per_sec ? output_bytes / write_bytes_per_sec : 0);
+	std::cout << " s" << (write_bytes_per_sec ? "" : ", without writing the output") << std::endl;
+}
+
+//----------------------------------------------------------------------------
 
-	const std::string output_directory = argv[2];
+//----------------------------------------------------------------------------
 
-	wordexp_t exp;
-	int st;
+int main(int argc, char *argv[])
+{
+	const std::string usage =
+		"Usage: prepare-data [-s] [-S SEED] [-u] [-n FRACTION [-W]] [-t SAMPLE_THRESHOLD] [-p SAMPLES_PERCENT]\n"
+		"                    [-j THREADS] [-T TRACE_FILE] <RAW_AUDIO_DIRECTORY> <OUTPUT_DIRECTORY>";
+	chunk_selection_t sel;
+	bool use_shards = false;
+	std::optional<uint64_t> shuffle_seed;
+	int nrotations = NCHANNELS;
+	double dry_run_fraction = 0;
+	bool measure_write = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "sS:un:Wt:p:j:T:")) != -1) {
+		switch (opt) {
+		case 's':
+			use_shards = true;
+			break;
+		case 'S':
+			use_shards = true;
+			shuffle_seed = std::strtoull(optarg, nullptr, 0);
+			break;
+		case 'u':
+			nrotations = 1;
+			break;
+		case 'n':
+			dry_run_fraction = std::atof(optarg);
+			if (dry_run_fraction <= 0 || dry_run_fraction > 1)
+				fatal("dry-run fraction must be in the range (0, 1]");
+			break;
+		case 'W':
+			measure_write = true;
+			break;
+		case 't':
+			sel.sample_threshold = std::atof(optarg);
+			break;
+		case 'p':
+			sel.samples_percent = std::atof(optarg);
+			break;
+		case 'j':
+			raw_audio_t::decoder_threads = std::atoi(optarg);
+			break;
+		case 'T':
+			trace_start(optarg);
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind != 2 || (measure_write && !dry_run_fraction))
+		fatal(usage);
+
+	const std::string fpattern = std::string(argv[optind]) + "/output-*deg-*elev-*m";
+	const std::string fpattern_silence = std::string(argv[optind]) + "/output-silence*";
+
+	const std::string output_directory = argv[optind + 1];
+	std::unique_ptr<dataset_store> store;
+	const off_t chunk_stride = dry_run_fraction ? std::lround(1 / dry_run_fraction) : 1;
+	if (dry_run_fraction)
+		store = std::make_unique<dry_run_store>();
+	else if (use_shards)
+		store = std::make_unique<shard_store>(output_directory, shuffle_seed);
+	else
+		store = std::make_unique<tree_store>(output_directory);
+
+	off_t input_bytes = 0;
+	std::chrono::steady_clock::duration scan_time {};
+	const auto t_start = std::chrono::steady_clock::now();
 
 	if (1) {
 		// Let's gamble :)
@@ -375,24 +835,30 @@ int main(int argc, char *argv[])
 		std::srand(42);
 	}
 
-	st = wordexp(fpattern_silence.c_str(), &exp, WRDE_NOCMD | WRDE_SHOWERR | WRDE_UNDEF);
-	if (st < 0)
-		fatal("wordexp error");
-	for (size_t i = 0; i < exp.we_wordc; i++) {
+	for (const auto &path : find_recordings(fpattern_silence)) {
 		// TODO - multiple silence recordings are not really supported yet!
-		silence_output out(exp.we_wordv[i], output_directory);
-		process_raw_audio_file(out);
+		silence_output out(path, *store);
+		input_bytes += process_raw_audio_file(out, sel, scan_time, chunk_stride);
+	}
+
+	for (const auto &path : find_recordings(fpattern)) {
+		dataset_output out(path, *store, nrotations);
+		input_bytes += process_raw_audio_file(out, sel, scan_time, chunk_stride);
+	}
+
+	{
+		trace_span_t span("finish");
+		store->finish();
 	}
-	wordfree(&exp);
 
-	st = wordexp(fpattern.c_str(), &exp, WRDE_NOCMD | WRDE_SHOWERR | WRDE_UNDEF);
-	if (st < 0)
-		fatal("wordexp error");
-	for (size_t i = 0; i < exp.we_wordc; i++) {
-		dataset_output out(exp.we_wordv[i], output_directory);
-		process_raw_audio_file(out);
+	if (dry_run_fraction) {
+		const double total_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+		const double scan_secs = std::chrono::duration<double>(scan_time).count();
+		print_dry_run_report(static_cast<const dry_run_store &>(*store), chunk_stride,
+				     input_bytes, scan_secs, total_secs - scan_secs,
+				     measure_write ? measure_write_throughput(output_directory) : 0);
 	}
-	wordfree(&exp);
 
+	trace_flush();
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Select a subset of a sharded dataset, using its index.
+//
+// Example invocations:
+//    $ ./query-dataset ./dataset 'elev=0.0,distance=1.0'
+//    $ ./query-dataset -l ./dataset 'class=5.625|silence,split=valid'
+//
+// Without "-l" only the number of matching records per attribute value
+// is printed. With "-l" the shard and byte offset of each matching
+// record is listed.
+
+#include <cstdlib>
+#include <cstdint>
+
+#include <iostream>
+#include <chrono>
+#include <map>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "dataset-index.h"
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: query-dataset [-l] <DATASET_DIRECTORY> [QUERY]";
+	bool list = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l")) != -1) {
+		switch (opt) {
+		case 'l':
+			list = true;
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind < 1 || argc - optind > 2)
+		fatal(usage);
+
+	auto t0 = std::chrono::steady_clock::now();
+	auto index = dataset_index_t::open(argv[optind]);
+	auto t1 = std::chrono::steady_clock::now();
+	const auto matches = index->query(argc - optind == 2 ? argv[optind + 1] : "").indices();
+	auto t2 = std::chrono::steady_clock::now();
+
+	if (list) {
+		for (auto i : matches)
+			std::cout << index->shard_path(i).string() << " " << index->record_offset(i) << std::endl;
+	} else {
+		for (int a = 0; a < DATASET_NATTRS; a++) {
+			std::map<std::string, size_t> counts;
+			for (auto i : matches)
+				counts[index->value(i, a)]++;
+			std::cout << dataset_attr_names[a] << ":" << std::endl;
+			for (const auto &[val, n] : counts)
+				std::cout << "    " << val << ": " << n << std::endl;
+		}
+	}
+
+	using ms = std::chrono::duration<double, std::milli>;
+	std::cerr << matches.size() << "/" << index->size() << " records matched.";
+	std::cerr << " Index load: " << ms(t1 - t0).count() << " ms,";
+	std::cerr << " query: " << ms(t2 - t1).count() << " ms." << std::endl;
+
+	return EXIT_SUCCESS;
+}
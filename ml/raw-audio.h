@@ -0,0 +1,550 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Access to the raw microphone recordings, and detection of
+// the chunks in them which contain useful audio.
+
+#ifndef DOA_RAW_AUDIO_H
+#define DOA_RAW_AUDIO_H
+
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <wordexp.h>
+
+#include "common.h"
+#include "flac.h"
+
+// Input (and output!) audio format.
+const int NCHANNELS = 8;
+const int BITS_PER_SAMPLE = 32;
+const int SAMPLES_PER_SECOND = 24000;
+
+// Parsing parameters
+const float INITIAL_SKIP_S = 0.5;	// Recording sometimes starts with a glitch.
+const float SILENCE_TRAINING_S = 1.0;	// A period which we know is silent.
+const float VALID_SAMPLE_THRESHOLD = 1.1; // Threshold over maximum silence to consider a sample valid.
+const float VALID_SAMPLES_PERCENT = 10;	// Minimum percentage of valid samples to consider a chunk valid.
+
+// Recordings are stored either as captured, with each sample in a signed
+// 32-bit little-endian word (".raw"), or packed into 24 bits (".s24"),
+// which is all the microphones deliver. The packed format takes a quarter
+// less disk space, page cache, and I/O per recording.
+//
+// A packed recording starts with a header of the size of one frame, so
+// that the rest can still be played as S24_LE. The 24 bits are the least
+// significant ones of the samples, or, if shift is 8, the most
+// significant ones.
+//
+// For archiving, recordings may also be compressed to FLAC (".flac"), as
+// 24-bit samples, or 32-bit ones if they do not fit. The samples are
+// read back exactly as stored, i.e. the least significant bits.
+const char RAW_EXTENSION[] = ".raw";
+const char PACKED_EXTENSION[] = ".s24";
+const char FLAC_EXTENSION[] = ".flac";
+
+struct packed_header_t {
+	char magic[8];		// "DOAS24\0\0"
+	uint32_t shift;
+	uint32_t reserved[3];
+};
+static_assert(sizeof(packed_header_t) == NCHANNELS * 3);
+static const char PACKED_MAGIC[8] = { 'D', 'O', 'A', 'S', '2', '4', '\0', '\0' };
+
+typedef uint8_t u8x16_t __attribute__((vector_size(16)));
+typedef int32_t i32x4_t __attribute__((vector_size(16)));
+
+// Widen packed S24_LE samples to int32. Each 16-byte load holds 4 samples
+// and 4 spare bytes. A shuffle moves each sample to the upper 24 bits of
+// its lane, and an arithmetic shift extends its sign.
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "ssse3", "default")))
+#endif
+static inline void unpack_s24le(const uint8_t *src, int32_t *dst, size_t n, unsigned shift)
+{
+	const u8x16_t zero {};
+	const u8x16_t mask { 16, 0, 1, 2, 16, 3, 4, 5, 16, 6, 7, 8, 16, 9, 10, 11 };
+	const unsigned sign_shift = 8 - shift;
+	size_t i = 0;
+
+	// The last load must not read past the end.
+	for (; i + 6 <= n; i += 4) {
+		u8x16_t v;
+		std::memcpy(&v, src + 3 * i, sizeof(v));
+		i32x4_t w = reinterpret_cast<i32x4_t>(__builtin_shuffle(v, zero, mask)) >> sign_shift;
+		std::memcpy(dst + i, &w, sizeof(w));
+	}
+	for (; i < n; i++)
+		dst[i] = int32_t(uint32_t(src[3 * i]) << 8 | uint32_t(src[3 * i + 1]) << 16 |
+				 uint32_t(src[3 * i + 2]) << 24) >> sign_shift;
+}
+
+// Narrow int32 samples to packed S24_LE. Returns false if any of them
+// does not fit in the 24 bits, in which case the output is not usable.
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "ssse3", "default")))
+#endif
+static inline bool pack_s24le(const int32_t *src, uint8_t *dst, size_t n, unsigned shift)
+{
+	const u8x16_t mask { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0, 0, 0, 0 };
+	i32x4_t lost {};
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		i32x4_t w;
+		std::memcpy(&w, src + i, sizeof(w));
+		const i32x4_t p = w >> shift;
+		lost |= (((p << 8) >> 8) << shift) ^ w;
+		const u8x16_t v = __builtin_shuffle(reinterpret_cast<u8x16_t>(p), mask);
+		std::memcpy(dst + 3 * i, &v, 12);
+	}
+	bool ok = !(lost[0] | lost[1] | lost[2] | lost[3]);
+	for (; i < n; i++) {
+		const int32_t p = src[i] >> shift;
+		ok &= (((p << 8) >> 8) << shift) == src[i];
+		dst[3 * i] = p;
+		dst[3 * i + 1] = p >> 8;
+		dst[3 * i + 2] = p >> 16;
+	}
+	return ok;
+}
+
+// Read access to a large recording, in any of the formats. The samples
+// are addressed as in the captured format, i.e. as consecutive int32
+// values, interleaved per channel.
+//
+// A packed or FLAC recording is decoded on the fly, in blocks, as its
+// samples are accessed. The blocks of a FLAC recording are its frames.
+// Only the CACHE_BLOCKS most recently accessed blocks are kept, so that
+// even a full scan of a long recording takes little memory.
+//
+// FLAC frames are decoded by decoder_threads worker threads. Unless the
+// recording is opened for random access, the frames after the accessed
+// ones are decoded ahead, into a bounded window, so that a sequential
+// scan rarely has to wait for them. Not thread-safe, apart from the
+// workers.
+class raw_audio_t {
+public:
+	static const off_t BLOCK_SAMPLES = 1 << 16;	// 256 KiB once unpacked.
+	static const size_t CACHE_BLOCKS = 256;
+	// For FLAC recordings opened afterwards. With none, frames are
+	// decoded as they are accessed, and not ahead.
+	static inline unsigned decoder_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	~raw_audio_t() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		work_cv.notify_all();
+		for (auto &t : workers)
+			t.join();
+		if (this->map)
+			munmap(this->map, this->map_len);
+		if (this->decoded)
+			munmap(this->decoded, std::max<off_t>(this->len, 1) * sizeof(int32_t));
+	}
+
+	off_t len;	// In samples, of all channels.
+	bool packed;
+
+	// Times the accessed samples were not yet decoded, and the time spent
+	// waiting for them, or decoding them.
+	size_t nstalls = 0;
+	double stall_secs = 0;
+
+	static std::shared_ptr<raw_audio_t> open(std::string fpath, int advice = MADV_SEQUENTIAL)
+	{
+		int fd = ::open(fpath.c_str(), O_RDONLY);
+		if (fd < 0)
+			fatal("failed to open file \"" + fpath + "\"");
+
+		struct stat statbuf;
+		int err = fstat(fd, &statbuf);
+		if (err < 0)
+			fatal("failed to fstat file \"" + fpath + "\"");
+
+		if (is_flac(fpath)) {
+			if (statbuf.st_size == 0)
+				fatal("file \"" + fpath + "\" is truncated");
+			void *tmp = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (tmp == MAP_FAILED)
+				fatal("failed to mmap file \"" + fpath + "\"");
+			madvise(tmp, statbuf.st_size, advice);
+			close(fd);
+			auto flac = std::make_unique<flac_stream_t>(static_cast<const uint8_t *>(tmp),
+								    statbuf.st_size, fpath);
+			if (flac->nchannels != NCHANNELS)
+				fatal("\"" + fpath + "\" does not have " + std::to_string(NCHANNELS) + " channels");
+			auto o = new raw_audio_t(tmp, statbuf.st_size, flac->nsamples() * NCHANNELS, false, 0);
+			o->start_flac(std::move(flac), advice);
+			return std::shared_ptr<raw_audio_t>(o);
+		}
+
+		const bool packed = is_packed(fpath);
+		const off_t header_size = packed ? sizeof(packed_header_t) : 0;
+		const off_t sample_size = packed ? 3 : sizeof(int32_t);
+		if (statbuf.st_size < header_size)
+			fatal("file \"" + fpath + "\" is truncated");
+		off_t len = (statbuf.st_size - header_size) / sample_size;
+		const size_t map_len = header_size + len * sample_size;
+		void *tmp = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+		if (tmp == MAP_FAILED)
+			fatal("failed to mmap file \"" + fpath + "\"");
+		madvise(tmp, map_len, advice);
+
+		close(fd);
+
+		unsigned shift = 0;
+		if (packed) {
+			const auto h = static_cast<const packed_header_t *>(tmp);
+			if (std::memcmp(h->magic, PACKED_MAGIC, sizeof(PACKED_MAGIC)) || (h->shift != 0 && h->shift != 8))
+				fatal("\"" + fpath + "\" is not a packed recording");
+			shift = h->shift;
+		}
+		auto o = new raw_audio_t(tmp, map_len, len, packed, shift);
+
+		return std::shared_ptr<raw_audio_t>(o);
+	}
+
+	// Bytes read from the file for a full scan.
+	size_t file_size() const { return map_len; }
+
+	// Bits per sample, as stored in the file.
+	unsigned stored_bps() const { return flac ? flac->bps : packed ? 24 : 32; }
+
+	static bool is_packed(const std::string &fpath)
+	{
+		return fpath.ends_with(PACKED_EXTENSION);
+	}
+
+	static bool is_flac(const std::string &fpath)
+	{
+		return fpath.ends_with(FLAC_EXTENSION);
+	}
+
+	// The samples [i, i + n). For a packed or FLAC recording, the returned
+	// pointer stays valid while less than CACHE_BLOCKS / 4 blocks of other
+	// samples are accessed.
+	const int32_t *samples(off_t i, off_t n)
+	{
+		if (!decoded)
+			return static_cast<const int32_t *>(map) + i;
+
+		const off_t b0 = block_of(i), b1 = block_of(i + n - 1);
+		if (b1 - b0 >= off_t(CACHE_BLOCKS / 2))
+			fatal("too many samples accessed at once");
+		// Keep the blocks already decoded from being evicted.
+		for (off_t b = b0; b <= b1; b++)
+			if (cached[b] != lru.end())
+				lru.splice(lru.end(), lru, cached[b]);
+		for (off_t b = b0; b <= b1; b++)
+			if (cached[b] == lru.end())
+				load_block(b);
+		for (off_t b = b1 + 1; b <= b1 + readahead && b < nblocks(); b++)
+			if (cached[b] == lru.end())
+				load_block(b);
+		for (off_t b = b0; b <= b1; b++)
+			wait_block(b);
+		return decoded + i;
+	}
+
+private:
+	enum : uint8_t { EMPTY, QUEUED, DECODING, READY };
+
+	void *map;
+	size_t map_len;
+	unsigned shift;
+	std::unique_ptr<flac_stream_t> flac;
+	int32_t *decoded;
+	std::vector<off_t> block_start;		// And the end of the last one.
+	std::unique_ptr<std::atomic<uint8_t>[]> state;
+	std::list<off_t> lru;			// Of the blocks not EMPTY.
+	std::vector<std::list<off_t>::iterator> cached;	// Or lru.end().
+
+	off_t readahead = 0;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable work_cv;
+	std::deque<off_t> work;			// Of the QUEUED blocks.
+	bool stopping = false;
+
+	// Force usage only through shared_ptr.
+	raw_audio_t(void *p, size_t map_l, off_t l, bool pk, unsigned sh)
+		: len(l), packed(pk), map(p), map_len(map_l), shift(sh), decoded(nullptr) {
+		if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+			fatal("big endian hosts not yet supported");
+		if (!packed)
+			return;
+		for (off_t i = 0; i < len; i += BLOCK_SAMPLES)
+			block_start.push_back(i);
+		allocate();
+	}
+
+	void start_flac(std::unique_ptr<flac_stream_t> f, int advice)
+	{
+		flac = std::move(f);
+		for (const auto &frame : flac->frames)
+			block_start.push_back(frame.first * NCHANNELS);
+		allocate();
+		if (!decoder_threads)
+			return;
+		if (advice != MADV_RANDOM)
+			readahead = std::min<off_t>(4 * decoder_threads, CACHE_BLOCKS / 4);
+		for (unsigned t = 0; t < decoder_threads; t++)
+			workers.emplace_back([this] { decode_blocks(); });
+	}
+
+	void allocate()
+	{
+		block_start.push_back(len);
+		// Pages are allocated only when first decoded to.
+		void *tmp = mmap(NULL, std::max<off_t>(len, 1) * sizeof(int32_t), PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (tmp == MAP_FAILED)
+			fatal("failed to allocate memory for decoding");
+		decoded = static_cast<int32_t *>(tmp);
+		cached.assign(nblocks(), lru.end());
+		state = std::make_unique<std::atomic<uint8_t>[]>(nblocks());
+	}
+
+	off_t nblocks() const { return block_start.size() - 1; }
+
+	off_t block_of(off_t i) const
+	{
+		if (!flac)
+			return i / BLOCK_SAMPLES;
+		return std::upper_bound(block_start.begin(), block_start.end(), i) - block_start.begin() - 1;
+	}
+
+	void decode_block(off_t b)
+	{
+		const off_t i = block_start[b];
+		if (flac)
+			flac->decode(b, decoded + i);
+		else
+			unpack_s24le(static_cast<const uint8_t *>(map) + sizeof(packed_header_t) + 3 * i,
+				     decoded + i, block_start[b + 1] - i, shift);
+	}
+
+	// Worker thread.
+	void decode_blocks()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			work_cv.wait(lock, [this] { return stopping || !work.empty(); });
+			if (stopping)
+				return;
+			const off_t b = work.front();
+			work.pop_front();
+			// Taken over by the reader meanwhile.
+			if (state[b] != QUEUED)
+				continue;
+			state[b] = DECODING;
+			lock.unlock();
+			decode_block(b);
+			state[b] = READY;
+			state[b].notify_all();
+			lock.lock();
+		}
+	}
+
+	// Make room for block b, and have it decoded.
+	void load_block(off_t b)
+	{
+		if (lru.size() >= CACHE_BLOCKS)
+			evict_block(lru.front());
+		cached[b] = lru.insert(lru.end(), b);
+		if (workers.empty())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			state[b] = QUEUED;
+			work.push_back(b);
+		}
+		work_cv.notify_one();
+	}
+
+	void wait_block(off_t b)
+	{
+		if (state[b] == READY)
+			return;
+		const auto t0 = std::chrono::steady_clock::now();
+		bool take_over = workers.empty();
+		if (!take_over) {
+			std::lock_guard<std::mutex> lock(mutex);
+			take_over = state[b] == QUEUED;
+			if (take_over)
+				state[b] = DECODING;
+		}
+		if (take_over) {
+			decode_block(b);
+			state[b] = READY;
+		} else {
+			state[b].wait(DECODING);
+		}
+		nstalls++;
+		stall_secs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	}
+
+	// Blocks do not need to be page aligned. A page is released only
+	// once no block in it is kept.
+	void evict_block(off_t b)
+	{
+		wait_block(b);
+		lru.erase(cached[b]);
+		cached[b] = lru.end();
+		state[b] = EMPTY;
+
+		const uintptr_t page = sysconf(_SC_PAGESIZE);
+		const uintptr_t start = reinterpret_cast<uintptr_t>(decoded + block_start[b]);
+		const uintptr_t end = reinterpret_cast<uintptr_t>(decoded + block_start[b + 1]);
+		uintptr_t lo = start / page * page, hi = (end + page - 1) / page * page;
+		for (off_t c = b - 1; lo < start && c >= 0 && reinterpret_cast<uintptr_t>(decoded + block_start[c + 1]) > lo; c--)
+			if (cached[c] != lru.end())
+				lo += page;
+		for (off_t c = b + 1; hi > end && c < nblocks() && reinterpret_cast<uintptr_t>(decoded + block_start[c]) < hi; c++)
+			if (cached[c] != lru.end())
+				hi -= page;
+		if (hi > lo)
+			madvise(reinterpret_cast<void *>(lo), hi - lo, MADV_DONTNEED);
+	}
+};
+
+//----------------------------------------------------------------------------
+
+// Calculate offset (in number of S32LE words) out of the given
+// length of audio, in seconds.
+static inline off_t secs2offs(double nsecs)
+{
+	double nsamples = double(SAMPLES_PER_SECOND) * nsecs;
+
+	return off_t(std::floor(nsamples)) * NCHANNELS;
+}
+
+static inline bool int32_cmp_abs(int32_t a, int32_t b)
+{
+	return std::labs(a) < std::labs(b);
+}
+
+/*
+ * Extract the physical environment settings for a
+ * microphone recording, given its filename.
+ *
+ * Example input: output-05.625deg-0elev-1.0m.raw, or the packed
+ * output-05.625deg-0elev-1.0m.s24
+ * Example parameters: ('05.625', '0', '1.0')
+ */
+static inline bool parse_recording_filename(const std::string &fname,
+					    float &angle, float &elev, float &distance)
+{
+	int i_elev = 0;
+	int n = std::sscanf(fname.c_str(), "output-%fdeg-%delev-%fm.",
+			    &angle, &i_elev, &distance);
+	elev = i_elev;
+
+	return n == 3;
+}
+
+// Expand a wildcard pattern of recording names, without the extension,
+// to the recordings in any format. A recording stored in several formats
+// is taken only once, in the one cheapest to read: packed, raw, FLAC.
+static inline std::vector<std::string> find_recordings(const std::string &pattern)
+{
+	std::map<std::string, std::string> found;
+	for (const char *ext : {FLAC_EXTENSION, RAW_EXTENSION, PACKED_EXTENSION}) {
+		wordexp_t exp;
+		if (wordexp((pattern + ext).c_str(), &exp, WRDE_NOCMD | WRDE_SHOWERR | WRDE_UNDEF) < 0)
+			fatal("wordexp error");
+		for (size_t i = 0; i < exp.we_wordc; i++) {
+			const std::string path = exp.we_wordv[i];
+			// An unmatched pattern is left as is.
+			if (access(path.c_str(), F_OK) == 0)
+				found[path.substr(0, path.size() - std::strlen(ext))] = path;
+		}
+		wordfree(&exp);
+	}
+	std::vector<std::string> paths;
+	for (const auto &[stem, path] : found)
+		paths.push_back(path);
+	return paths;
+}
+
+// Thresholds for telling apart chunks with useful audio from silent ones.
+struct silence_params_t {
+	off_t silence_scan_i;		// Start of the silence training period.
+	off_t data_scan_i;		// Start of the useful data.
+	int32_t silence_max;		// Maximum amplitude during silence.
+	int32_t silence_threshold;	// Minimum amplitude of a valid sample.
+	int nvals_threshold;		// Minimum number of valid samples in a chunk.
+};
+
+// Derive the thresholds from the trained maximum amplitude of silence.
+static inline void set_valid_thresholds(silence_params_t &p, off_t chunk_len,
+					float sample_threshold = VALID_SAMPLE_THRESHOLD,
+					float samples_percent = VALID_SAMPLES_PERCENT)
+{
+	p.silence_threshold = double(p.silence_max) * sample_threshold;
+	p.nvals_threshold = double(chunk_len) * samples_percent / 100.0;
+}
+
+// Train for silence at the start of the recording. The recording must
+// start with a glitch, followed by silence.
+static inline silence_params_t train_silence(raw_audio_t &m, off_t chunk_len,
+					     const std::string &fpath,
+					     float sample_threshold = VALID_SAMPLE_THRESHOLD,
+					     float samples_percent = VALID_SAMPLES_PERCENT)
+{
+	silence_params_t p;
+
+	p.silence_scan_i = secs2offs(INITIAL_SKIP_S);
+	p.data_scan_i = p.silence_scan_i + secs2offs(SILENCE_TRAINING_S);
+
+	if (p.silence_scan_i >= m.len || p.data_scan_i >= m.len)
+		fatal("input file \"" + fpath + "\" is too short");
+
+	// In chunks, since a FLAC recording may have so short frames that
+	// the whole silence does not fit in the cache.
+	p.silence_max = 0;
+	for (off_t i = p.silence_scan_i; i < p.data_scan_i; i += chunk_len) {
+		const off_t n = std::min(chunk_len, p.data_scan_i - i);
+		const int32_t *silence = m.samples(i, n);
+		p.silence_max = std::max<int32_t>(p.silence_max, std::labs(*std::max_element(silence, silence + n, int32_cmp_abs)));
+	}
+	set_valid_thresholds(p, chunk_len, sample_threshold, samples_percent);
+
+	return p;
+}
+
+// Count the samples in a chunk which are above the silence threshold.
+static inline int count_valid_samples(const silence_params_t &p, const int32_t *chunk, off_t chunk_len)
+{
+	auto cmp_to_threshold = [&p](const int32_t val) {
+		return std::labs(val) >= p.silence_threshold;
+	};
+
+	return std::count_if (chunk, chunk + chunk_len, cmp_to_threshold);
+}
+
+#endif
@@ -0,0 +1,246 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Replay raw microphone recordings through the streaming DOA service, as
+// if they were captured live, for reproducible latency benchmarks.
+//
+// The recordings are delivered in blocks like an ALSA capture, one after
+// the other, at real-time pace (scaled with -x), or as fast as the service
+// can take them (-F). In the latter case the ring buffer stays full, so
+// the latency is mostly queueing, and the throughput is what counts.
+//
+// Delivery can be delayed by a random jitter, and blocks can arrive in
+// bursts, as after a stall of the capture. Random choices are seeded, so
+// a replay can be repeated exactly.
+//
+// With -A, the service degrades under overload, as in doa-daemon, to a
+// longer hop and then to the fallback model given with -M. With -F, the
+// ring buffer stays full, so most windows are skipped.
+//
+// With -o, a trace of every window is written, as CSV:
+//    frame,class,prob,latency_us,inference_us
+// Gated and skipped windows have the class "gated" or "skipped".
+// The estimates must not change between builds, and the latencies can
+// be compared. With -T, a timeline of the capture and inference threads
+// is written, for viewing in https://ui.perfetto.dev
+//
+// Example invocations:
+//    $ ./replay-doa -m model.nn -o trace.csv records/output-*.raw
+//    $ ./replay-doa -m model.nn -j 2000 -b 8 -P 0.01 -o trace.csv output-5.6deg-0elev-1m.raw
+//    $ ./replay-doa -m model.nn -F output-5.6deg-0elev-1m.raw
+
+#include <cstdlib>
+#include <cstdint>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "doa-service.h"
+#include "metrics.h"
+#include "nn-engine.h"
+#include "raw-audio.h"
+#include "trace.h"
+
+// Frames per delivered block, like an ALSA period. 5.3ms.
+const size_t CAPTURE_FRAMES = 128;
+
+struct replay_opts_t {
+	double speed = 1;		// Relative to real time.
+	bool fast = false;		// As fast as possible.
+	double jitter_us = 0;		// Maximum random delay of a delivery.
+	unsigned burst_blocks = 0;	// Blocks delivered at once in a burst.
+	double burst_prob = 0.01;	// Probability of a burst starting at each block.
+	unsigned seed = 1;
+};
+
+// Deliver the recordings to the service. Returns the number of frames.
+static size_t replay(doa_service_t &service, const std::vector<std::string> &paths,
+		     const replay_opts_t &o)
+{
+	using namespace std::chrono;
+	std::minstd_rand rng(o.seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	const duration<double> period(CAPTURE_FRAMES / (double(SAMPLES_PER_SECOND) * o.speed));
+	const size_t block_len = CAPTURE_FRAMES * NCHANNELS;
+	const auto start = steady_clock::now();
+	size_t nblocks = 0;
+	std::vector<const int32_t *> held;
+	unsigned burst_left = 0;
+
+	for (const auto &path : paths) {
+		auto m = raw_audio_t::open(path);
+		for (off_t i = 0; i + off_t(block_len) <= m->len; i += block_len) {
+			nblocks++;
+			if (o.fast) {
+				while (service.room() < CAPTURE_FRAMES)
+					std::this_thread::yield();
+				service.capture(m->samples(i, block_len), CAPTURE_FRAMES);
+				continue;
+			}
+
+			// In a burst, hold the blocks, and deliver them all when
+			// the last one is due.
+			held.push_back(m->samples(i, block_len));
+			if (!burst_left && o.burst_blocks > 1 && uniform(rng) < o.burst_prob)
+				burst_left = o.burst_blocks;
+			if (burst_left && --burst_left)
+				continue;
+
+			const auto due = start + duration_cast<steady_clock::duration>(
+				period * nblocks + duration<double, std::micro>(o.jitter_us * uniform(rng)));
+			std::this_thread::sleep_until(due);
+			for (auto b : held)
+				service.capture(b, CAPTURE_FRAMES);
+			held.clear();
+		}
+		// The mapping is released here, so deliver what is held.
+		for (auto b : held)
+			service.capture(b, CAPTURE_FRAMES);
+		held.clear();
+	}
+	return nblocks * CAPTURE_FRAMES;
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage =
+		"Usage: replay-doa -m MODEL [-A [-M FALLBACK_MODEL]] [-H HOP] [-g SILENCE_MAX] [-R RING_FRAMES]\n"
+		"                  [-x SPEED | -F] [-j JITTER_US] [-b BURST_BLOCKS] [-P BURST_PROB] [-s SEED]\n"
+		"                  [-o TRACE] [-T TIMELINE] RECORDING...";
+	std::string model_path, fallback_path, trace_path;
+	doa_service_t::config_t cfg;
+	replay_opts_t ro;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:AM:H:g:R:x:Fj:b:P:s:o:T:")) != -1) {
+		switch (opt) {
+		case 'm':
+			model_path = optarg;
+			break;
+		case 'A':
+			cfg.adaptive = true;
+			break;
+		case 'M':
+			fallback_path = optarg;
+			break;
+		case 'H':
+			cfg.hop = std::atol(optarg);
+			break;
+		case 'g':
+			cfg.silence_max = std::atol(optarg);
+			break;
+		case 'R':
+			cfg.ring_frames = std::atol(optarg);
+			break;
+		case 'x':
+			ro.speed = std::atof(optarg);
+			break;
+		case 'F':
+			ro.fast = true;
+			break;
+		case 'j':
+			ro.jitter_us = std::atof(optarg);
+			break;
+		case 'b':
+			ro.burst_blocks = std::atoi(optarg);
+			break;
+		case 'P':
+			ro.burst_prob = std::atof(optarg);
+			break;
+		case 's':
+			ro.seed = std::atoi(optarg);
+			break;
+		case 'o':
+			trace_path = optarg;
+			break;
+		case 'T':
+			trace_start(optarg);
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind < 1 || model_path.empty() || ro.speed <= 0 || (!fallback_path.empty() && !cfg.adaptive))
+		fatal(usage);
+	const std::vector<std::string> paths(argv + optind, argv + argc);
+
+	metrics_t metrics;
+	doa_service_t service(nn_model_t::load(model_path), cfg, metrics,
+			      fallback_path.empty() ? nullptr : nn_model_t::load(fallback_path));
+
+	std::ofstream trace;
+	if (!trace_path.empty()) {
+		trace.open(trace_path);
+		if (!trace)
+			fatal("failed to open \"" + trace_path + "\"");
+		trace << "# replay-doa -m " << model_path << " -H " << cfg.hop << " -g " << cfg.silence_max;
+		trace << " -R " << cfg.ring_frames;
+		if (cfg.adaptive)
+			trace << " -A";
+		if (!fallback_path.empty())
+			trace << " -M " << fallback_path;
+		if (ro.fast)
+			trace << " -F";
+		else
+			trace << " -x " << ro.speed << " -j " << ro.jitter_us << " -b " << ro.burst_blocks
+			      << " -P " << ro.burst_prob << " -s " << ro.seed;
+		for (const auto &p : paths)
+			trace << " " << p;
+		trace << "\nframe,class,prob,latency_us,inference_us\n";
+		trace << std::fixed;
+	}
+
+	std::thread inference([&]() {
+		service.run([&](const doa_estimate_t &e) {
+			if (!trace.is_open())
+				return;
+			trace << e.frame << ",";
+			if (e.cls == -1)
+				trace << "gated,0";
+			else if (e.cls < 0)
+				trace << "skipped,0";
+			else
+				trace << e.model->class_names[e.cls] << "," << std::setprecision(6) << e.prob;
+			trace << "," << std::setprecision(1) << (e.done_ns - e.capture_ns) / 1e3;
+			trace << "," << e.infer_ns / 1e3 << "\n";
+		});
+	});
+
+	trace_thread_name("capture");
+	const auto t0 = std::chrono::steady_clock::now();
+	const size_t nframes = replay(service, paths, ro);
+	service.close();
+	inference.join();
+	const double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	trace_flush();
+
+	std::cerr << std::fixed << std::setprecision(1);
+	std::cerr << "Replayed " << double(nframes) / SAMPLES_PER_SECOND << " s of audio in " << wall_s;
+	std::cerr << " s, " << nframes / (wall_s * SAMPLES_PER_SECOND) << "x real time" << std::endl;
+	std::cerr << "Windows: " << service.total(service.m_windows);
+	std::cerr << ", gated: " << service.total(service.m_gated);
+	std::cerr << ", skipped: " << service.total(service.m_skipped);
+	std::cerr << ", dropped frames: " << service.total(service.m_dropped) << std::endl;
+	if (cfg.adaptive) {
+		std::cerr << "Hop increases/decreases: " << service.total(service.m_hop_ups) << "/";
+		std::cerr << service.total(service.m_hop_downs) << ", fallback switches/recoveries: ";
+		std::cerr << service.total(service.m_fallbacks) << "/" << service.total(service.m_recoveries) << std::endl;
+	}
+	std::cerr << "Latency p50/p99/p99.9/max: ";
+	for (double q : {0.5, 0.99, 0.999, 1.0})
+		std::cerr << service.latency_quantile_ns(q) / 1e3 << (q < 1 ? "/" : " us\n");
+	std::cerr << "Inference p50/p99/p99.9/max: ";
+	for (double q : {0.5, 0.99, 0.999, 1.0})
+		std::cerr << service.inference_quantile_ns(q) / 1e3 << (q < 1 ? "/" : " us\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Lock-free ring buffer of interleaved audio frames, between one capture
+// thread and one processing thread.
+//
+// The capture thread must never wait. If there is no room for a block
+// of frames, the whole block is dropped, and the processing thread sees
+// a gap in the stream, rather than a stall of the capture.
+//
+// Each write is stamped with the time of its capture, so that the
+// latency from the capture of a frame to a result can be measured.
+
+#ifndef DOA_RING_BUFFER_H
+#define DOA_RING_BUFFER_H
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+
+class frame_ring_t {
+public:
+	// Timestamps are kept per granule of that many frames.
+	static const size_t STAMP_GRANULE = 16;
+
+	const size_t capacity;	// In frames, a power of 2.
+	const size_t nchannels;
+
+	frame_ring_t(size_t _capacity, size_t _nchannels)
+		: capacity(_capacity), nchannels(_nchannels),
+		  buf(_capacity * _nchannels),
+		  nstamps(std::max<size_t>(_capacity / STAMP_GRANULE, 1)),
+		  stamps(new std::atomic<int64_t>[nstamps])
+	{
+		if (capacity == 0 || (capacity & (capacity - 1)) || capacity % STAMP_GRANULE)
+			fatal("ring buffer capacity must be a power of 2, and at least " +
+			      std::to_string(STAMP_GRANULE));
+	}
+
+	frame_ring_t(const frame_ring_t &) = delete;
+	frame_ring_t &operator=(const frame_ring_t &) = delete;
+
+	// Producer: append n frames captured at time stamp. Returns false,
+	// and drops them, if they do not fit.
+	bool write(const int32_t *frames, size_t n, int64_t stamp)
+	{
+		const uint64_t w = wpos.load(std::memory_order_relaxed);
+		if (w + n - rpos.load(std::memory_order_acquire) > capacity)
+			return false;
+		for (size_t done = 0; done < n; ) {
+			const size_t i = (w + done) & (capacity - 1);
+			const size_t len = std::min(n - done, capacity - i);
+			std::memcpy(&buf[i * nchannels], frames + done * nchannels,
+				    len * nchannels * sizeof(int32_t));
+			done += len;
+		}
+		for (uint64_t g = w / STAMP_GRANULE; g <= (w + n - 1) / STAMP_GRANULE; g++)
+			stamps[g % nstamps].store(stamp, std::memory_order_relaxed);
+		wpos.store(w + n, std::memory_order_release);
+		events.fetch_add(1, std::memory_order_release);
+		events.notify_one();
+		return true;
+	}
+
+	// Producer: number of frames which can be written.
+	size_t room() const
+	{
+		return capacity - (wpos.load(std::memory_order_relaxed) - rpos.load(std::memory_order_acquire));
+	}
+
+	// Consumer: number of frames ready to be read.
+	size_t available() const
+	{
+		return wpos.load(std::memory_order_acquire) - rpos.load(std::memory_order_relaxed);
+	}
+
+	// Consumer: block until at least n frames are available, or the
+	// producer closes the ring. Returns whether they are available.
+	bool wait(size_t n)
+	{
+		for (;;) {
+			const uint32_t e = events.load(std::memory_order_acquire);
+			if (available() >= n)
+				return true;
+			if (closed.load(std::memory_order_acquire))
+				return false;
+			events.wait(e, std::memory_order_acquire);
+		}
+	}
+
+	// Consumer: copy out n <= available() frames, and return the capture
+	// time of the last of them.
+	int64_t read(int32_t *frames, size_t n)
+	{
+		const uint64_t r = rpos.load(std::memory_order_relaxed);
+		for (size_t done = 0; done < n; ) {
+			const size_t i = (r + done) & (capacity - 1);
+			const size_t len = std::min(n - done, capacity - i);
+			std::memcpy(frames + done * nchannels, &buf[i * nchannels],
+				    len * nchannels * sizeof(int32_t));
+			done += len;
+		}
+		const int64_t stamp = stamps[((r + n - 1) / STAMP_GRANULE) % nstamps].load(std::memory_order_relaxed);
+		rpos.store(r + n, std::memory_order_release);
+		return stamp;
+	}
+
+	// Consumer: discard n <= available() frames.
+	void skip(size_t n)
+	{
+		rpos.store(rpos.load(std::memory_order_relaxed) + n, std::memory_order_release);
+	}
+
+	// Producer: no more frames will be written.
+	void close()
+	{
+		closed.store(true, std::memory_order_release);
+		events.fetch_add(1, std::memory_order_release);
+		events.notify_all();
+	}
+
+private:
+	std::vector<int32_t> buf;
+	const size_t nstamps;
+	std::unique_ptr<std::atomic<int64_t>[]> stamps;
+	alignas(64) std::atomic<uint64_t> wpos {0};
+	// Bumped on each write, for the consumer to wait on.
+	std::atomic<uint32_t> events {0};
+	alignas(64) std::atomic<uint64_t> rpos {0};
+	std::atomic<bool> closed {false};
+};
+
+#endif
@@ -0,0 +1,194 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Run an exported DOA model with the native inference engine against
+// a dataset, and report its accuracy and latency.
+//
+// Example invocations:
+//    $ ./run-model -m model.nn ./dataset
+//    $ ./run-model -m model.nn -q 'split=valid' ./sharded-dataset
+//
+// Both the directory tree and the sharded dataset layouts are supported.
+// For the latter, a subset can be selected with a query.
+//
+// With -j, each inference is split across that many threads. With -S,
+// no dataset is needed. Instead, the latency for 1 to NTHREADS threads
+// is measured on random inputs:
+//    $ ./run-model -m model.nn -S -j 4
+
+#include <cstdlib>
+#include <cstdint>
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "dataset-index.h"
+#include "nn-engine.h"
+#include "thread-pool.h"
+
+namespace fs = std::filesystem;
+
+struct eval_stats_t {
+	size_t ntotal = 0;
+	size_t nexact = 0;
+	std::chrono::steady_clock::duration elapsed {};
+};
+
+static void eval_record(const nn_model_t &model, nn_workspace_t &ws,
+			const std::vector<int32_t> &rec, const std::string &expected,
+			eval_stats_t &st)
+{
+	std::vector<float> in(model.input_size);
+	nn_input_from_s32(rec.data(), in.data(), in.size());
+
+	auto t0 = std::chrono::steady_clock::now();
+	const int ci = model.classify(in.data(), ws);
+	st.elapsed += std::chrono::steady_clock::now() - t0;
+
+	st.ntotal++;
+	if (model.class_names[ci] == expected)
+		st.nexact++;
+}
+
+static void eval_sharded(const nn_model_t &model, nn_workspace_t &ws, const fs::path &dir,
+			 const std::string &query, eval_stats_t &st)
+{
+	auto index = dataset_index_t::open(dir);
+	std::vector<int32_t> rec(model.input_size);
+
+	if (index->record_nbytes != rec.size() * sizeof(rec[0]))
+		fatal("dataset record size does not match the model input");
+
+	for (auto i : index->query(query).indices()) {
+		std::ifstream s {index->shard_path(i), s.binary};
+		s.seekg(index->record_offset(i));
+		if (!s.read(reinterpret_cast<char *>(rec.data()), index->record_nbytes))
+			fatal("failed to read " + index->shard_path(i).string());
+		eval_record(model, ws, rec, index->value(i, ATTR_CLASS), st);
+	}
+}
+
+static void eval_tree(const nn_model_t &model, nn_workspace_t &ws, const fs::path &dir, eval_stats_t &st)
+{
+	std::vector<int32_t> rec(model.input_size);
+
+	for (const auto &e : fs::recursive_directory_iterator(dir)) {
+		if (!e.is_regular_file())
+			continue;
+		// The top-level directory is the class name.
+		const std::string expected = *fs::relative(e.path(), dir).begin();
+		std::ifstream s {e.path(), s.binary};
+		if (!s.read(reinterpret_cast<char *>(rec.data()), rec.size() * sizeof(rec[0])))
+			fatal("failed to read " + e.path().string());
+		eval_record(model, ws, rec, expected, st);
+	}
+}
+
+// Measure the latency for an increasing number of threads. Weights are
+// streamed from memory for each inference, so the bandwidth is reported.
+static void run_scaling(nn_model_t &model, unsigned max_threads)
+{
+	const size_t NRUNS = 200;
+	std::vector<float> in(model.input_size), out(model.output_size());
+	std::mt19937 rng(1);
+	std::normal_distribution<float> dist(0, 0.01);
+	for (auto &v : in)
+		v = dist(rng);
+	const double nbytes = model.num_weights() * sizeof(float);
+
+	for (unsigned n = 1; n <= max_threads; n++) {
+		thread_pool_t pool(n);
+		model.partition(n);
+		nn_workspace_t ws;
+		ws.pool = &pool;
+		model.predict(in.data(), out.data(), ws);	// Warm up.
+
+		std::vector<double> us(NRUNS);
+		for (auto &u : us) {
+			auto t0 = std::chrono::steady_clock::now();
+			model.predict(in.data(), out.data(), ws);
+			u = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+		}
+		std::sort(us.begin(), us.end());
+		std::cout << n << " threads: median " << us[NRUNS / 2] << " us, p99 ";
+		std::cout << us[NRUNS * 99 / 100] << " us, ";
+		std::cout << nbytes / us[NRUNS / 2] / 1e3 << " GB/s of weights" << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: run-model -m MODEL [-j NTHREADS] [-q QUERY] <DATASET_DIRECTORY>\n"
+				  "       run-model -m MODEL -S [-j MAX_NTHREADS]";
+	std::string model_path, query;
+	unsigned nthreads = 0;
+	bool scaling = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:q:j:S")) != -1) {
+		switch (opt) {
+		case 'm':
+			model_path = optarg;
+			break;
+		case 'q':
+			query = optarg;
+			break;
+		case 'j':
+			nthreads = std::max(1, std::atoi(optarg));
+			break;
+		case 'S':
+			scaling = true;
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind != !scaling || model_path.empty())
+		fatal(usage);
+
+	auto model = nn_model_t::load(model_path);
+	std::cout << "Model: " << model->layers.size() << " layers, ";
+	std::cout << model->num_weights() << " weights, ";
+	std::cout << model->class_names.size() << " classes." << std::endl;
+
+	if (scaling) {
+		run_scaling(*model, nthreads ? nthreads : std::max(1u, std::thread::hardware_concurrency()));
+		return EXIT_SUCCESS;
+	}
+
+	std::unique_ptr<thread_pool_t> pool;
+	nn_workspace_t ws;
+	if (nthreads > 1) {
+		pool = std::make_unique<thread_pool_t>(nthreads);
+		model->partition(nthreads);
+		ws.pool = pool.get();
+	}
+
+	const fs::path dir = argv[optind];
+	eval_stats_t st;
+	if (fs::exists(dir / DATASET_INDEX_FILENAME))
+		eval_sharded(*model, ws, dir, query, st);
+	else if (query.empty())
+		eval_tree(*model, ws, dir, st);
+	else
+		fatal("a query requires a sharded dataset");
+
+	if (st.ntotal == 0)
+		fatal("no datasets found");
+	std::cout << "Total samples: " << st.ntotal << ", exact match ";
+	std::cout << (st.nexact * 100) / st.ntotal << "%" << std::endl;
+	std::cout << "Mean latency: ";
+	std::cout << std::chrono::duration<double, std::micro>(st.elapsed).count() / st.ntotal;
+	std::cout << " us" << std::endl;
+
+	return EXIT_SUCCESS;
+}
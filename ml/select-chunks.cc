@@ -0,0 +1,137 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Count the chunks of raw recordings with enough valid samples, for a
+// range of thresholds, using the statistics in their sidecar files.
+//
+// A sample is valid if it is above SAMPLE_THRESHOLD times the maximum
+// amplitude of the silence at the start of the recording. A chunk with
+// at least SAMPLES_PERCENT of them is valid, and any other is silent.
+// Both thresholds take comma-separated lists of values, and all their
+// combinations are counted.
+//
+// Only the chunks which the statistics cannot tell are read from the
+// recordings. With -b, not even those, and the count is a range instead.
+// Missing sidecar files are computed, which takes a full scan.
+//
+// Example invocations:
+//    $ ./select-chunks records/output-*.raw
+//    $ ./select-chunks -t 1.1,1.5,2,4 -p 5,10,20 records/output-*.raw
+
+#include <cstdlib>
+#include <cstdint>
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <unistd.h>
+
+#include "chunk-stats.h"
+#include "common.h"
+#include "raw-audio.h"
+
+// As OUT_NSAMPLES of prepare-data.
+const int CHUNK_NSAMPLES = 512;
+
+static std::vector<float> parse_list(const std::string &s)
+{
+	std::vector<float> v;
+	std::istringstream is(s);
+	std::string item;
+	while (std::getline(is, item, ','))
+		v.push_back(std::atof(item.c_str()));
+	if (v.empty())
+		fatal("empty list \"" + s + "\"");
+	return v;
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: select-chunks [-t SAMPLE_THRESHOLDS] [-p SAMPLES_PERCENTS] [-b] RECORDING...";
+	std::vector<float> thresholds {VALID_SAMPLE_THRESHOLD}, percents {VALID_SAMPLES_PERCENT};
+	bool bounds_only = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:p:b")) != -1) {
+		switch (opt) {
+		case 't':
+			thresholds = parse_list(optarg);
+			break;
+		case 'p':
+			percents = parse_list(optarg);
+			break;
+		case 'b':
+			bounds_only = true;
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind < 1)
+		fatal(usage);
+
+	const off_t chunk_len = CHUNK_NSAMPLES * NCHANNELS;
+	std::vector<std::string> paths(argv + optind, argv + argc);
+	std::vector<std::unique_ptr<chunk_stats_t>> stats;
+	for (const auto &path : paths) {
+		auto s = chunk_stats_t::load(path, chunk_len);
+		if (!s) {
+			std::cerr << "Computing " << chunk_stats_t::sidecar_path(path) << " ..." << std::endl;
+			s = chunk_stats_t::compute(*raw_audio_t::open(path), chunk_len, path);
+			if (!s->save(path))
+				std::cerr << "Failed to save " << chunk_stats_t::sidecar_path(path) << std::endl;
+		}
+		stats.push_back(std::move(s));
+	}
+
+	// Mapped on demand, for the chunks the statistics cannot tell.
+	std::vector<std::shared_ptr<raw_audio_t>> raw(paths.size());
+
+	std::cout << "threshold percent chunks valid read" << std::endl;
+	const auto t0 = std::chrono::steady_clock::now();
+	for (float t : thresholds) {
+		for (float p : percents) {
+			size_t nchunks = 0, lo = 0, hi = 0, nread = 0;
+			for (size_t f = 0; f < paths.size(); f++) {
+				const chunk_stats_t &s = *stats[f];
+				const silence_params_t sp = s.params(t, p);
+				for (size_t k = 0; k < s.hdr.nchunks; k++) {
+					int nvals_lo, nvals_hi;
+					s.valid_samples_bounds(sp, k, nvals_lo, nvals_hi);
+					nchunks++;
+					// Valid, i.e. not silent, if nvals >= nvals_threshold.
+					if (nvals_lo >= sp.nvals_threshold) {
+						lo++;
+						hi++;
+					} else if (nvals_hi >= sp.nvals_threshold) {
+						if (bounds_only) {
+							hi++;
+							continue;
+						}
+						if (!raw[f])
+							raw[f] = raw_audio_t::open(paths[f], MADV_RANDOM);
+						const int32_t *chunk = raw[f]->samples(sp.data_scan_i + k * chunk_len, chunk_len);
+						const bool valid = count_valid_samples(sp, chunk, chunk_len) >= sp.nvals_threshold;
+						lo += valid;
+						hi += valid;
+						nread++;
+					}
+				}
+			}
+			std::cout << t << " " << p << " " << nchunks << " " << lo;
+			if (hi != lo)
+				std::cout << "-" << hi;
+			std::cout << " " << nread << std::endl;
+		}
+	}
+	const auto t1 = std::chrono::steady_clock::now();
+	std::cerr << std::fixed << std::setprecision(1);
+	std::cerr << "Counted in " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,261 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Classical DOA estimation with SRP-PHAT (steered response power with
+// phase transform weighting).
+//
+// The PHAT-weighted cross spectra of all microphone pairs are averaged
+// over a number of chunks. The response for each candidate angle is the
+// sum over all pairs of the cross spectra, steered by the expected time
+// difference of arrival for that angle.
+//
+// It is far less accurate than what we hope to achieve with the NN, but
+// it is cheap and needs no training. Hence it is useful for sanity checks.
+
+#ifndef DOA_SRP_PHAT_H
+#define DOA_SRP_PHAT_H
+
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+
+#include <algorithm>
+#include <array>
+#include <numbers>
+#include <vector>
+
+#include "fft.h"
+#include "mic-array.h"
+#include "raw-audio.h"
+
+// Frequency band to consider. Lower frequencies carry little phase
+// information over the small aperture. Higher ones suffer spatial aliasing.
+const double SRP_MIN_HZ = 200;
+const double SRP_MAX_HZ = 6000;
+
+class srp_phat_t {
+public:
+	const size_t nfft;
+	const size_t bin_lo, bin_hi;	// Considered range of bins: [bin_lo, bin_hi).
+
+	srp_phat_t(size_t _nfft)
+		: nfft(_nfft),
+		  bin_lo(std::ceil(SRP_MIN_HZ * _nfft / SAMPLES_PER_SECOND)),
+		  bin_hi(std::floor(SRP_MAX_HZ * _nfft / SAMPLES_PER_SECOND) + 1),
+		  fft(_nfft),
+		  xspec(NMIC_PAIRS * (bin_hi - bin_lo)),
+		  steering(size_t(STAND_NANGLES) * NMIC_PAIRS * (bin_hi - bin_lo))
+	{
+		const size_t nbins = bin_hi - bin_lo;
+
+		for (int a = 0; a < STAND_NANGLES; a++) {
+			const double theta = stand_angle_deg(a) * std::numbers::pi / 180.0;
+			size_t pi = 0;
+			for (int i = 0; i < NCHANNELS; i++) {
+				for (int j = i + 1; j < NCHANNELS; j++, pi++) {
+					const double tdoa = mic_delay_s(theta, i) - mic_delay_s(theta, j);
+					for (size_t k = 0; k < nbins; k++) {
+						const double w = 2.0 * std::numbers::pi * (bin_lo + k) * SAMPLES_PER_SECOND / nfft;
+						steering[(a * NMIC_PAIRS + pi) * nbins + k] = std::polar(1.0, w * tdoa);
+					}
+				}
+			}
+		}
+	}
+
+	void reset()
+	{
+		std::fill(xspec.begin(), xspec.end(), cfloat(0));
+		nchunks = 0;
+	}
+
+	size_t num_chunks() const { return nchunks; }
+
+	// Add a chunk of nfft interleaved frames to the averaged cross spectra.
+	void accumulate(const int32_t *chunk)
+	{
+		std::vector<cfloat> spec(NCHANNELS * (nfft / 2 + 1));
+		std::vector<float> a(nfft), b(nfft);
+
+		for (int ch = 0; ch < NCHANNELS; ch += 2) {
+			for (size_t i = 0; i < nfft; i++) {
+				a[i] = chunk[i * NCHANNELS + ch];
+				b[i] = chunk[i * NCHANNELS + ch + 1];
+			}
+			fft.forward_real2(a.data(), b.data(),
+					  &spec[ch * (nfft / 2 + 1)],
+					  &spec[(ch + 1) * (nfft / 2 + 1)]);
+		}
+
+		add_xspec(&spec[bin_lo], nfft / 2 + 1, 1.0f, 1.0f);
+		nchunks++;
+	}
+
+	// Steered response power for each candidate angle.
+	std::array<float, STAND_NANGLES> response() const
+	{
+		const size_t nbins = bin_hi - bin_lo;
+		std::array<float, STAND_NANGLES> p;
+
+		for (int a = 0; a < STAND_NANGLES; a++) {
+			const cfloat *st = &steering[a * NMIC_PAIRS * nbins];
+			float sum = 0;
+			for (size_t k = 0; k < NMIC_PAIRS * nbins; k++)
+				sum += xspec[k].real() * st[k].real() - xspec[k].imag() * st[k].imag();
+			p[a] = sum;
+		}
+		return p;
+	}
+
+	// Index of the candidate angle with the highest response.
+	int estimate() const
+	{
+		const auto p = response();
+		return std::max_element(p.begin(), p.end()) - p.begin();
+	}
+
+protected:
+	// Update the cross spectra to decay * xspec + weight * PHAT(X_i X_j*),
+	// where X_i are the nbins band bins of mic i, stride apart.
+	void add_xspec(const cfloat *spec, size_t stride, float decay, float weight)
+	{
+		const size_t nbins = bin_hi - bin_lo;
+		size_t pi = 0;
+		for (int i = 0; i < NCHANNELS; i++) {
+			for (int j = i + 1; j < NCHANNELS; j++, pi++) {
+				// Plain floats, so that the loop vectorizes.
+				const float *xi = reinterpret_cast<const float *>(&spec[i * stride]);
+				const float *xj = reinterpret_cast<const float *>(&spec[j * stride]);
+				float *g = reinterpret_cast<float *>(&xspec[pi * nbins]);
+				for (size_t k = 0; k < nbins; k++) {
+					const float re = xi[2 * k] * xj[2 * k] + xi[2 * k + 1] * xj[2 * k + 1];
+					const float im = xi[2 * k + 1] * xj[2 * k] - xi[2 * k] * xj[2 * k + 1];
+					// Where the norm is zero, so are re and im.
+					const float norm = std::max(re * re + im * im, FLT_MIN);
+					const float w = weight / std::sqrt(norm);
+					g[2 * k] = decay * g[2 * k] + w * re;
+					g[2 * k + 1] = decay * g[2 * k + 1] + w * im;
+				}
+			}
+		}
+	}
+
+	fft_t fft;
+	std::vector<cfloat> xspec;	// Accumulated PHAT cross spectra, per pair.
+	std::vector<cfloat> steering;	// Per angle, per pair, per bin.
+	size_t nchunks = 0;
+};
+
+// SRP-PHAT over a continuous stream, updated every hop frames.
+//
+// The cross spectra are recursively averaged: for each hop, the old ones
+// decay by (1 - alpha), and alpha times those of the last nfft frames are
+// added. The spectra of the last nfft frames are either recomputed with
+// FFTs for each hop, or updated with a sliding DFT. The latter costs
+// O(hop * bins * mics) per hop instead of O(nfft * log(nfft) * mics),
+// which is far cheaper for small hops.
+//
+// The sliding DFT keeps the last nfft samples in a circular buffer,
+// indexed by the absolute sample number modulo nfft. Its bins are those
+// of this buffer, i.e. the true spectra of the window multiplied by a
+// phase term common to all mics, which cancels out in the cross spectra.
+// Rounding errors accumulate with each update. Hence every resync_hops
+// the bins are recomputed from the buffer with an FFT, which is exact.
+class srp_phat_stream_t : public srp_phat_t {
+public:
+	const size_t hop;
+	const float alpha;
+	const bool sliding;
+	const size_t resync_hops;
+
+	srp_phat_stream_t(size_t _nfft, size_t _hop, float _alpha, bool _sliding = true, size_t _resync_hops = 0)
+		: srp_phat_t(_nfft), hop(_hop), alpha(_alpha), sliding(_sliding),
+		  resync_hops(_resync_hops ? _resync_hops : std::max<size_t>(1, _nfft / _hop)),
+		  ring(NCHANNELS * _nfft), twiddles(_nfft), z(_nfft), tmp(2 * (_nfft / 2 + 1)),
+		  bins(NCHANNELS * (bin_hi - bin_lo)), spec(NCHANNELS * (bin_hi - bin_lo))
+	{
+		if (hop == 0 || hop > nfft)
+			fatal("invalid SRP-PHAT stream hop");
+		for (size_t i = 0; i < nfft; i++)
+			twiddles[i] = std::polar(1.0, -2.0 * std::numbers::pi * i / nfft);
+	}
+
+	// Consume hop interleaved frames.
+	void push(const int32_t *frames)
+	{
+		const size_t nbins = bin_hi - bin_lo;
+
+		for (size_t i = 0; i < hop; i++, pos = (pos + 1) & (nfft - 1)) {
+			float d[NCHANNELS];
+			for (int ch = 0; ch < NCHANNELS; ch++) {
+				float &r = ring[pos * NCHANNELS + ch];
+				d[ch] = float(frames[i * NCHANNELS + ch]) - r;
+				r = frames[i * NCHANNELS + ch];
+			}
+			if (!sliding)
+				continue;
+			// Bin k advances by k * pos around the unit circle.
+			// Each twiddle is shared by all the mics.
+			size_t ti = bin_lo * pos;
+			for (size_t k = 0; k < nbins; k++, ti += pos) {
+				const cfloat t = twiddles[ti & (nfft - 1)];
+				float *x = reinterpret_cast<float *>(&bins[k * NCHANNELS]);
+				for (int ch = 0; ch < NCHANNELS; ch++) {
+					x[2 * ch] += d[ch] * t.real();
+					x[2 * ch + 1] += d[ch] * t.imag();
+				}
+			}
+		}
+		if (!sliding || ++nhops % resync_hops == 0)
+			resync();
+
+		for (size_t k = 0; k < nbins; k++)
+			for (int ch = 0; ch < NCHANNELS; ch++)
+				spec[ch * nbins + k] = bins[k * NCHANNELS + ch];
+		add_xspec(spec.data(), nbins, 1.0f - alpha, alpha);
+		nchunks++;
+	}
+
+	// Largest deviation of the current band bins from the exact ones,
+	// relative to the largest magnitude of the latter.
+	double drift()
+	{
+		const std::vector<cfloat> cur = bins;
+		resync();
+		double err = 0, mag = 0;
+		for (size_t i = 0; i < bins.size(); i++) {
+			err = std::max<double>(err, std::abs(cur[i] - bins[i]));
+			mag = std::max<double>(mag, std::abs(bins[i]));
+		}
+		bins = cur;
+		return mag > 0 ? err / mag : 0;
+	}
+
+private:
+	std::vector<float> ring;	// Last nfft frames, interleaved.
+	std::vector<cfloat> twiddles;
+	std::vector<cfloat> z, tmp;
+	std::vector<cfloat> bins;	// Band bins of the ring, per bin, per mic.
+	std::vector<cfloat> spec;	// The same, per mic, per bin.
+	size_t pos = 0;
+	size_t nhops = 0;
+
+	void resync()
+	{
+		const size_t nbins = bin_hi - bin_lo;
+		const size_t n2 = nfft / 2 + 1;
+		for (int ch = 0; ch < NCHANNELS; ch += 2) {
+			for (size_t i = 0; i < nfft; i++)
+				z[i] = cfloat(ring[i * NCHANNELS + ch], ring[i * NCHANNELS + ch + 1]);
+			fft.forward(z.data());
+			fft.split_real2(z.data(), &tmp[0], &tmp[n2]);
+			for (size_t k = 0; k < nbins; k++) {
+				bins[k * NCHANNELS + ch] = tmp[bin_lo + k];
+				bins[k * NCHANNELS + ch + 1] = tmp[n2 + bin_lo + k];
+			}
+		}
+	}
+};
+
+#endif
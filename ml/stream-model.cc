@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Run an exported DOA model over a raw microphone recording, as a
+// continuous stream with a sliding window, and report the latency per hop.
+//
+// With -c, each streaming result is compared with that of running the
+// model on the whole window. They must be exactly the same.
+//
+// Example invocations:
+//    $ ./stream-model -m model.nn -H 64 -c output-5.6deg-0elev-1m.raw
+//    $ ./stream-model -m model.nn -H 256 -v output-5.6deg-0elev-1m.raw
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "nn-engine.h"
+#include "raw-audio.h"
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: stream-model -m MODEL [-H HOP] [-c] [-v] <RAW_AUDIO_FILE>";
+	std::string model_path;
+	size_t hop = 64;
+	bool check = false, verbose = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:H:cv")) != -1) {
+		switch (opt) {
+		case 'm':
+			model_path = optarg;
+			break;
+		case 'H':
+			hop = std::atol(optarg);
+			break;
+		case 'c':
+			check = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind != 1 || model_path.empty())
+		fatal(usage);
+
+	auto model = nn_model_t::load(model_path);
+	nn_stream_t stream(model, hop, NCHANNELS);
+	auto m = raw_audio_t::open(argv[optind]);
+
+	std::vector<float> out(model->output_size()), full_out(model->output_size());
+	nn_workspace_t ws;
+	std::chrono::steady_clock::duration stream_time {}, full_time {};
+	size_t nhops = 0, nmismatches = 0;
+
+	const off_t hop_len = hop * NCHANNELS;
+	for (off_t i = 0; i + hop_len <= m->len; i += hop_len, nhops++) {
+		auto t0 = std::chrono::steady_clock::now();
+		stream.push(m->samples(i, hop_len), out.data());
+		auto t1 = std::chrono::steady_clock::now();
+		stream_time += t1 - t0;
+
+		if (check) {
+			auto t2 = std::chrono::steady_clock::now();
+			model->predict(stream.input(), full_out.data(), ws);
+			full_time += std::chrono::steady_clock::now() - t2;
+			if (std::memcmp(out.data(), full_out.data(), out.size() * sizeof(float)))
+				nmismatches++;
+		}
+		if (verbose) {
+			const size_t ci = std::max_element(out.begin(), out.end()) - out.begin();
+			std::cout << std::fixed << std::setprecision(4);
+			std::cout << double((i / NCHANNELS) + hop) / SAMPLES_PER_SECOND << " ";
+			std::cout << model->class_names[ci] << " " << out[ci] << std::endl;
+		}
+	}
+	if (nhops == 0)
+		fatal("recording is shorter than one hop");
+
+	std::cerr << "Hops: " << nhops << " of " << hop << " frames, window ";
+	std::cerr << stream.window << " frames" << std::endl;
+	std::cerr << "Mean streaming latency: ";
+	std::cerr << std::chrono::duration<double, std::micro>(stream_time).count() / nhops;
+	std::cerr << " us" << std::endl;
+	if (check) {
+		std::cerr << "Mean full window latency: ";
+		std::cerr << std::chrono::duration<double, std::micro>(full_time).count() / nhops;
+		std::cerr << " us" << std::endl;
+		std::cerr << "Mismatches against the full window: " << nmismatches << std::endl;
+	}
+
+	return nmismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+
+# SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+# Sweep the hyperparameters of train.py, running several trainings at once.
+#
+# Each run is pinned to its own set of CPUs, and TensorFlow is limited to
+# that many threads, so that concurrent runs do not fight over the cores.
+# All runs read the same sharded dataset. Its shards are memory-mapped,
+# so they share the page cache, which is warmed up once before starting.
+#
+# Each parameter is given as NAME=VALUE1,VALUE2,..., and the sweep runs
+# all their combinations. NAME is a long option of train.py, with dashes
+# or underscores. Options after "--" are passed to all runs.
+#
+# Example invocation:
+#    $ ./sweep.py -i dataset -o sweep -j 4 -c 8 \
+#        -p batch_size=32,128 -p learning_rate=0.001,0.0003 -p model_type=dense,equivariant
+#
+# The results table is printed, and written to sweep/results.txt.
+
+import argparse
+import itertools
+import subprocess
+import json
+import time
+import sys
+import os
+
+import dataset_index
+
+def parse_param(s):
+    name, sep, values = s.partition('=')
+    if not sep or not name or not values:
+        raise argparse.ArgumentTypeError('expected NAME=VALUE1,VALUE2,... but got "{}"'.format(s))
+    return name.replace('-', '_'), values.split(',')
+
+def warm_page_cache(dirname):
+    """Read all the shards once, so that the runs do not compete for the disk."""
+    idx = dataset_index.DatasetIndex(dirname)
+    nbytes = 0
+    t0 = time.monotonic()
+    for shard in range(idx.nshards):
+        with open(os.path.join(dirname, dataset_index.shard_filename(shard)), 'rb') as f:
+            while True:
+                buf = f.read(1 << 24)
+                if not buf:
+                    break
+                nbytes += len(buf)
+    print("Read {:.1f} MiB of shards in {:.1f} s.".format(nbytes / 2**20, time.monotonic() - t0))
+
+    avail = os.sysconf('SC_AVPHYS_PAGES') * os.sysconf('SC_PAGE_SIZE')
+    if nbytes > avail:
+        print("WARNING: The dataset does not fit in the free memory, runs will compete for the disk.")
+
+class run_t:
+    def __init__(self, n, params, output_dir):
+        self.name = 'run-{:03d}'.format(n)
+        self.params = params
+        self.base = os.path.join(output_dir, self.name)
+        self.proc = None
+        self.cpus = None
+        self.t0 = None
+        self.wall_s = None
+        self.results = None
+
+    def command(self, args, train_py):
+        cmd = [sys.executable, train_py, '-i', args.input, '-o', self.base + '.h5',
+               '-r', self.base + '.json', '-j', str(len(self.cpus))]
+        for name, value in self.params.items():
+            cmd += ['--' + name.replace('_', '-'), value]
+        return cmd + args.extra
+
+    def start(self, args, train_py, cpus):
+        self.cpus = cpus
+        env = dict(os.environ)
+        env['OMP_NUM_THREADS'] = str(len(cpus))
+        with open(self.base + '.log', 'w') as log:
+            self.proc = subprocess.Popen(self.command(args, train_py), stdout=log,
+                                         stderr=subprocess.STDOUT, env=env,
+                                         preexec_fn=lambda: os.sched_setaffinity(0, cpus))
+        self.t0 = time.monotonic()
+
+    def finish(self):
+        self.wall_s = time.monotonic() - self.t0
+        if self.proc.returncode == 0 and os.path.exists(self.base + '.json'):
+            with open(self.base + '.json', 'r') as f:
+                self.results = json.load(f)
+
+def format_table(runs, param_names):
+    def fmt(v, spec):
+        return '-' if v is None else spec.format(v)
+    header = ['run'] + param_names + ['val_acc', 'epochs', 'epoch_s', 'latency_us', 'wall_s']
+    rows = []
+    for r in runs:
+        res = r.results or {}
+        rows.append([r.name] + [r.params[n] for n in param_names] + [
+            fmt(res.get('val_accuracy'), '{:.4f}'),
+            fmt(res.get('epochs'), '{}'),
+            fmt(res.get('epoch_s'), '{:.1f}'),
+            fmt(res.get('latency_us'), '{:.1f}'),
+            fmt(r.wall_s, '{:.0f}') + ('' if r.results else ' FAILED')])
+    widths = [max(len(row[i]) for row in [header] + rows) for i in range(len(header))]
+    lines = ['  '.join(c.ljust(w) for c, w in zip(row, widths)).rstrip() for row in [header] + rows]
+    return '\n'.join(lines) + '\n'
+
+def main():
+    parser = argparse.ArgumentParser(description='Run a hyperparameter sweep of train.py.')
+    parser.add_argument('-i', '--input', required=True,
+        help = 'Sharded dataset directory.')
+    parser.add_argument('-o', '--output', required=True,
+        help = 'Directory to write the models, logs and results to.')
+    parser.add_argument('-p', '--param', required=True, action='append', type=parse_param,
+        help = 'Parameter values to sweep, as NAME=VALUE1,VALUE2,...')
+    parser.add_argument('-j', '--jobs', required=False, type=int,
+        help = 'Number of concurrent runs. Default is as many as fit the CPUs.')
+    parser.add_argument('-c', '--cpus-per-run', required=False, type=int, default=4,
+        help = 'Number of CPUs to pin each run to.')
+    parser.add_argument('extra', nargs='*',
+        help = 'Options after "--" are passed to all runs.')
+    args = parser.parse_args()
+
+    if not dataset_index.has_index(args.input):
+        sys.exit('The sweep requires a sharded dataset, see "prepare-data -s".')
+
+    cpus = sorted(os.sched_getaffinity(0))
+    cpus_per_run = min(args.cpus_per_run, len(cpus))
+    max_jobs = len(cpus) // cpus_per_run
+    njobs = min(args.jobs or max_jobs, max_jobs)
+    if args.jobs and args.jobs > max_jobs:
+        print("WARNING: Only {} runs of {} CPUs fit at once.".format(max_jobs, cpus_per_run))
+    slots = [set(cpus[i * cpus_per_run:(i + 1) * cpus_per_run]) for i in range(njobs)]
+
+    param_names = [name for name, _ in args.param]
+    combinations = itertools.product(*[values for _, values in args.param])
+    os.makedirs(args.output, exist_ok=True)
+    pending = [run_t(n, dict(zip(param_names, c)), args.output) for n, c in enumerate(combinations)]
+    runs = list(pending)
+    print("Sweeping {} runs, {} at a time on {} CPUs each.".format(len(runs), njobs, cpus_per_run))
+
+    warm_page_cache(args.input)
+
+    train_py = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'train.py')
+    running = {}
+    free_slots = list(range(njobs))
+    while pending or running:
+        while pending and free_slots:
+            slot = free_slots.pop(0)
+            r = pending.pop(0)
+            r.start(args, train_py, slots[slot])
+            running[r.proc.pid] = (r, slot)
+            print("Started {} on CPUs {}: {}".format(r.name, sorted(slots[slot]), r.params))
+
+        pid, status = os.wait()
+        if pid not in running:
+            continue
+        r, slot = running.pop(pid)
+        r.proc.returncode = os.waitstatus_to_exitcode(status)
+        r.finish()
+        free_slots.append(slot)
+        print("Finished {} in {:.0f} s{}".format(r.name, r.wall_s, '' if r.results else ', FAILED'))
+
+    table = format_table(runs, param_names)
+    with open(os.path.join(args.output, 'results.txt'), 'w') as f:
+        f.write(table)
+    print(table, end='')
+
+    sys.exit(0 if all(r.results for r in runs) else 1)
+
+main()
@@ -8,31 +8,33 @@
 #
 # Example invocations:
 #    $ ./test-model.py -i dataset -m model.h5
+#    $ ./test-model.py -i sharded-dataset -s 'split=valid' -n 0 -m model.h5
+#
+# With the native backend, the exported model (see export-model.py) is run
+# by the C++ inference engine, and TensorFlow is not needed at all. The
+# agreement with TensorFlow can be checked on the same samples:
+#    $ ./test-model.py -i dataset -n 0 --backend native -m model.nn --compare-tf model.h5
 
 import numpy as np
 import argparse
 import random
 import glob
 import json
+import time
 import sys
 import os
 
-import tensorflow as tf
-from tensorflow import keras
+import dataset_index
 
 # Threshold for considering a resulting angle
 # as a "loose" (i.e. not exact) match. In degrees.
 LOOSE_MATCH_DEGS = 15;
 
-def run_sample(model, a, idstr, labels):
-    ds = tf.data.Dataset.from_tensor_slices(([a], [idstr])).batch(1)
-
-    predict = model.predict(ds, verbose=0)
-    angle_id_predict = np.argmax(predict)
-    print('Expected: ' + idstr + ', got: ' + labels[angle_id_predict])
+# Number of samples to load and evaluate at once.
+BATCH_SIZE = 1024
 
-    s_expected = idstr
-    s_got = labels[angle_id_predict]
+def compare_labels(s_expected, s_got):
+    """Returns whether the labels match exactly, and loosely."""
     if s_expected == 'silence' and s_got != 'silence':
         return False, False
     if s_expected != 'silence' and s_got == 'silence':
@@ -42,12 +44,10 @@ def run_sample(model, a, idstr, labels):
     angle_diff = abs(float(s_got) - float(s_expected))
     if angle_diff > 180.0:
         angle_diff = 360.0 - angle_diff
-    return idstr == labels[angle_id_predict], angle_diff < LOOSE_MATCH_DEGS
+    return s_expected == s_got, angle_diff < LOOSE_MATCH_DEGS
 
-def path_to_audio(path):
-    audio = np.fromfile(path, dtype=np.dtype('<i4'))
-    audio = np.divide(audio, 2**31)
-    return audio
+def path_to_record(path):
+    return np.fromfile(path, dtype=np.dtype('<i4'))
 
 # Load the mapping of NN output class IDs to their human-readable strings.
 def load_class_names(input_filename):
@@ -55,6 +55,61 @@ def load_class_names(input_filename):
         json_str = f.read()
     return json.loads(json_str)['class_names']
 
+def load_tf_model(filename):
+    """Returns the class names, and a function predicting on a batch of records."""
+    import tensorflow as tf
+    from tensorflow import keras
+    import doa_layers
+
+    model = keras.models.load_model(filename, custom_objects=doa_layers.custom_objects())
+    class_names = load_class_names(os.path.splitext(filename)[0] + '.json')
+    def predict(records):
+        x = np.divide(records, 2**31).reshape(len(records), -1, 1)
+        return model.predict(x, batch_size=256, verbose=0)
+    return class_names, predict
+
+def load_native_model(filename):
+    import nn_engine
+
+    try:
+        model = nn_engine.NativeModel(filename)
+    except ValueError as e:
+        sys.exit('Failed to load the model: {}'.format(e))
+    return model.class_names, model.predict_records
+
+class TreeSamples:
+    """Datasets in the directory tree layout."""
+    def __init__(self, dirname):
+        self.paths = []
+        self.classes = []
+        for name in os.listdir(dirname):
+            print("Processing dataset {}".format(name,))
+            fpaths = glob.glob(os.path.join(dirname, name) + '/**/*raw_*', recursive=True)
+            self.paths += fpaths
+            self.classes += [name] * len(fpaths)
+
+    def __len__(self):
+        return len(self.paths)
+
+    def read(self, indices):
+        records = np.stack([path_to_record(self.paths[i]) for i in indices])
+        return records, [self.classes[i] for i in indices]
+
+class IndexedSamples:
+    """Records of a sharded dataset, optionally selected by a query."""
+    def __init__(self, dirname, query):
+        self.index = dataset_index.DatasetIndex(dirname)
+        self.selected = self.index.query(query)
+        self.class_values = self.index.attr_values('class')
+
+    def __len__(self):
+        return len(self.selected)
+
+    def read(self, indices):
+        recs = self.selected[indices]
+        class_ids = self.index.attr_ids('class', recs)
+        return self.index.read_records(recs), [self.class_values[c] for c in class_ids]
+
 def main():
     parser = argparse.ArgumentParser(description='Test the DOA estimation model.')
     parser.add_argument('-i', '--input', required=True,
@@ -63,41 +118,69 @@ def main():
         help = 'NN model file to use')
     parser.add_argument('-n', '--niterations', required=False,
         default=10, type=int,
-        help = 'How much test iterations to do')
+        help = 'How much test iterations to do. Zero tests all samples once.')
+    parser.add_argument('-s', '--select', required=False, default='',
+        help = 'Query selecting the samples of a sharded dataset, e.g. "split=valid"')
+    parser.add_argument('-b', '--backend', choices=['tf', 'native'], default='tf',
+        help = 'Run the model with TensorFlow, or with the native engine')
+    parser.add_argument('--compare-tf', required=False, metavar='MODEL_H5',
+        help = 'Also run this TensorFlow model, and report the top-1 agreement')
+    parser.add_argument('-q', '--quiet', action='store_true',
+        help = 'Do not print the result for each sample')
     args = parser.parse_args()
 
-    dir_class_names = os.listdir(args.input)
-    dataset_paths = []
-    dataset_classes = []
-
-    # Enumerate the available datasets.
-    for name in dir_class_names:
-        print("Processing dataset {}".format(name,))
-        dirpath = os.path.join(args.input, name)
-        fpaths = glob.glob(dirpath + '/**/*raw_*', recursive=True)
-        dataset_paths += fpaths
-        dataset_classes += [name] * len(fpaths)
-    print("Found {} files.".format(len(dataset_paths), ))
-
-    model = keras.models.load_model(args.model)
-    class_names = load_class_names(os.path.splitext(args.model)[0] + '.json')
+    if dataset_index.has_index(args.input):
+        samples = IndexedSamples(args.input, args.select)
+    elif args.select:
+        sys.exit('A query requires a sharded dataset.')
+    else:
+        samples = TreeSamples(args.input)
+    print("Found {} files.".format(len(samples), ))
+
+    t0 = time.monotonic()
+    if args.backend == 'native':
+        class_names, predict = load_native_model(args.model)
+    else:
+        class_names, predict = load_tf_model(args.model)
+    if args.compare_tf:
+        tf_class_names, tf_predict = load_tf_model(args.compare_tf)
+        if tf_class_names != class_names:
+            sys.exit('The TensorFlow model has different classes.')
+    print("Loaded the model in {:.2f} s.".format(time.monotonic() - t0))
+
+    if args.niterations > 0:
+        indices = np.array([random.randint(0, len(samples)-1) for _ in range(args.niterations)])
+    else:
+        indices = np.arange(len(samples))
 
     n_total = 0
     n_exact = 0
     n_loose = 0
-    for testi in range(0, args.niterations):
-        rnd_i = random.randint(0, len(dataset_paths)-1)
-        path = dataset_paths[rnd_i]
-        a = path_to_audio(path)
-
-        (exact, loose) = run_sample(model, a, dataset_classes[rnd_i], class_names)
-        if exact:
-            n_exact += 1
-        if loose:
-            n_loose += 1
-        n_total += 1
+    n_agree = 0
+    predict_s = 0
+    for bi in range(0, len(indices), BATCH_SIZE):
+        records, expected = samples.read(indices[bi:bi + BATCH_SIZE])
+        t0 = time.monotonic()
+        got = np.argmax(predict(records), axis=1)
+        predict_s += time.monotonic() - t0
+        if args.compare_tf:
+            n_agree += np.count_nonzero(got == np.argmax(tf_predict(records), axis=1))
+
+        for s_expected, gi in zip(expected, got):
+            s_got = class_names[gi]
+            if not args.quiet:
+                print('Expected: ' + s_expected + ', got: ' + s_got)
+            exact, loose = compare_labels(s_expected, s_got)
+            if exact:
+                n_exact += 1
+            if loose:
+                n_loose += 1
+            n_total += 1
 
     print("Total samples: {}, exact match {}%, loose match {}%".format(n_total, (n_exact * 100) // n_total, (n_loose * 100) // n_total))
+    print("Inference: {:.1f} us per sample".format(predict_s * 1e6 / n_total))
+    if args.compare_tf:
+        print("Top-1 agreement with TensorFlow: {}/{} ({:.2f}%)".format(n_agree, n_total, n_agree * 100 / n_total))
 
     sys.exit(0)
 
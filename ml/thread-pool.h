@@ -0,0 +1,111 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Persistent pool of threads for splitting a single latency-critical
+// computation across cores.
+//
+// Waking up a sleeping thread takes tens of microseconds, which is
+// comparable to the whole computation. Hence after each job the workers
+// spin for a while, waiting for the next one, and only then park.
+
+#ifndef DOA_THREAD_POOL_H
+#define DOA_THREAD_POOL_H
+
+#include <cstdint>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#endif
+}
+
+class thread_pool_t {
+public:
+	// Iterations of busy waiting before parking, roughly 50us.
+	static const unsigned DEFAULT_SPIN = 1 << 12;
+
+	// The calling thread counts as one of nthreads.
+	thread_pool_t(unsigned nthreads, unsigned _spin = DEFAULT_SPIN)
+		: spin(_spin)
+	{
+		for (unsigned t = 1; t < nthreads; t++)
+			threads.emplace_back([this, t]() { worker(t); });
+	}
+
+	~thread_pool_t()
+	{
+		stop = true;
+		generation.fetch_add(1, std::memory_order_release);
+		generation.notify_all();
+		for (auto &t : threads)
+			t.join();
+	}
+
+	thread_pool_t(const thread_pool_t &) = delete;
+	thread_pool_t &operator=(const thread_pool_t &) = delete;
+
+	unsigned size() const { return threads.size() + 1; }
+
+	// Call fn(t) for each t in [0, size()) in parallel, and wait for all
+	// to finish. The calling thread runs fn(0). Not reentrant.
+	template <typename F>
+	void run(F &&fn)
+	{
+		job_fn = [](void *ctx, unsigned t) { (*static_cast<F *>(ctx))(t); };
+		job_ctx = &fn;
+		pending.store(threads.size(), std::memory_order_relaxed);
+		generation.fetch_add(1, std::memory_order_release);
+		generation.notify_all();
+
+		fn(0);
+
+		for (unsigned n = 0; pending.load(std::memory_order_acquire); n++) {
+			if (n < spin) {
+				cpu_relax();
+			} else {
+				const unsigned p = pending.load(std::memory_order_acquire);
+				if (p)
+					pending.wait(p, std::memory_order_acquire);
+			}
+		}
+	}
+
+private:
+	const unsigned spin;
+	std::vector<std::thread> threads;
+	std::atomic<uint32_t> generation {0};
+	std::atomic<unsigned> pending {0};
+	std::atomic<bool> stop {false};
+	void (*job_fn)(void *, unsigned) = nullptr;
+	void *job_ctx = nullptr;
+
+	void worker(unsigned t)
+	{
+		uint32_t seen = 0;
+		for (;;) {
+			uint32_t g;
+			for (unsigned n = 0; (g = generation.load(std::memory_order_acquire)) == seen; n++) {
+				if (n < spin)
+					cpu_relax();
+				else
+					generation.wait(seen, std::memory_order_acquire);
+			}
+			seen = g;
+			if (stop)
+				return;
+			job_fn(job_ctx, t);
+			if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				pending.notify_one();
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,185 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Timeline of scoped spans, written in the Chrome trace JSON format. Load
+// it in https://ui.perfetto.dev or chrome://tracing to see where each
+// thread spends its time, and where it stalls or idles.
+//
+// Each thread records its spans into its own ring buffer, without locks.
+// When a buffer is full, the oldest spans are overwritten. The buffers
+// are written to the file by trace_flush(), after the threads stop.
+//
+// Example usage:
+//    trace_start("trace.json");
+//    {
+//        trace_span_t span("scan");
+//        ...
+//    }
+//    trace_flush();
+//
+// Until trace_start(), a span costs a single load of a flag.
+
+#ifndef DOA_TRACE_H
+#define DOA_TRACE_H
+
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+class trace_buffer_t {
+public:
+	// Spans kept per thread. 24 bytes each.
+	static const size_t CAPACITY = 1 << 18;
+
+	struct event_t {
+		const char *name;	// Must be a string literal.
+		int64_t begin_ns;
+		int64_t dur_ns;
+	};
+
+	const unsigned tid;
+	std::string thread_name;
+
+	trace_buffer_t(unsigned _tid) : tid(_tid), events(CAPACITY) {}
+
+	void add(const char *name, int64_t begin_ns, int64_t dur_ns)
+	{
+		events[n++ % CAPACITY] = {name, begin_ns, dur_ns};
+	}
+
+	template <typename F>
+	void for_each(F &&fn) const
+	{
+		for (size_t i = n > CAPACITY ? n - CAPACITY : 0; i < n; i++)
+			fn(events[i % CAPACITY]);
+	}
+
+private:
+	std::vector<event_t> events;
+	size_t n = 0;
+};
+
+class tracer_t {
+public:
+	std::atomic<bool> enabled {false};
+	std::string path;
+
+	static tracer_t &get()
+	{
+		static tracer_t t;
+		return t;
+	}
+
+	static int64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// The buffer of the calling thread. Takes a lock only the first time.
+	trace_buffer_t &buffer()
+	{
+		thread_local trace_buffer_t *b = nullptr;
+		if (!b) {
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers.push_back(std::make_unique<trace_buffer_t>(buffers.size() + 1));
+			b = buffers.back().get();
+		}
+		return *b;
+	}
+
+	void flush()
+	{
+		if (!enabled)
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		std::ofstream o(path);
+		if (!o)
+			fatal("failed to open \"" + path + "\"");
+		o << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+		o << std::fixed;
+		o.precision(3);
+		bool first = true;
+		auto sep = [&]() -> std::ostream & {
+			o << (first ? "" : ",\n");
+			first = false;
+			return o;
+		};
+		for (const auto &b : buffers) {
+			if (!b->thread_name.empty())
+				sep() << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << b->tid
+				      << ",\"args\":{\"name\":\"" << b->thread_name << "\"}}";
+			b->for_each([&](const trace_buffer_t::event_t &e) {
+				sep() << "{\"ph\":\"X\",\"name\":\"" << e.name << "\",\"pid\":1,\"tid\":" << b->tid
+				      << ",\"ts\":" << (e.begin_ns - start_ns) / 1e3
+				      << ",\"dur\":" << e.dur_ns / 1e3 << "}";
+			});
+		}
+		o << "\n]}\n";
+	}
+
+private:
+	friend void trace_start(const std::string &path);
+
+	int64_t start_ns = 0;
+	std::mutex mutex;
+	std::vector<std::unique_ptr<trace_buffer_t>> buffers;
+};
+
+// Start recording spans, to be written to the given file.
+inline void trace_start(const std::string &path)
+{
+	auto &t = tracer_t::get();
+	t.path = path;
+	t.start_ns = tracer_t::now_ns();
+	t.enabled = true;
+}
+
+// Write the spans recorded so far. Other threads must not record spans
+// concurrently, so call it after they stop.
+inline void trace_flush()
+{
+	tracer_t::get().flush();
+}
+
+// Name the calling thread in the timeline.
+inline void trace_thread_name(const std::string &name)
+{
+	auto &t = tracer_t::get();
+	if (t.enabled.load(std::memory_order_relaxed))
+		t.buffer().thread_name = name;
+}
+
+// Records the time from its construction to its destruction.
+class trace_span_t {
+public:
+	explicit trace_span_t(const char *_name)
+		: name(tracer_t::get().enabled.load(std::memory_order_relaxed) ? _name : nullptr),
+		  begin_ns(name ? tracer_t::now_ns() : 0)
+	{
+	}
+
+	~trace_span_t()
+	{
+		if (name)
+			tracer_t::get().buffer().add(name, begin_ns, tracer_t::now_ns() - begin_ns);
+	}
+
+	trace_span_t(const trace_span_t &) = delete;
+	trace_span_t &operator=(const trace_span_t &) = delete;
+
+private:
+	const char *const name;
+	const int64_t begin_ns;
+};
+
+#endif
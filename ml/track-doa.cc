@@ -0,0 +1,163 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Track the direction of arrival in a raw 8-channel S32_LE stream with
+// SRP-PHAT, updated every few samples.
+//
+// For small hops, the cross spectra are updated incrementally with a
+// sliding DFT (see srp-phat.h). Otherwise, or with -f, they are recomputed
+// with FFTs for each hop. Estimates are
+// printed as "<time in seconds> <angle in degrees>" lines.
+//
+// Example invocations:
+//    $ arecord -Dhw:0 -c8 -r24000 -fS32_LE -t raw | ./track-doa -H 16
+//    $ ./track-doa -H 4 output-5.6deg-0elev-1m.raw
+//    $ ./track-doa -B 10
+
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "mic-array.h"
+#include "raw-audio.h"
+#include "srp-phat.h"
+
+// Analysis window. Matches the datasets.
+const size_t TRACK_NFFT = 512;
+
+// Beyond this hop, recomputing the spectra is faster than sliding them.
+const size_t TRACK_SLIDING_MAX_HOP = 16;
+
+static float hop_alpha(size_t hop, double time_constant_s)
+{
+	return 1.0 - std::exp(-double(hop) / (time_constant_s * SAMPLES_PER_SECOND));
+}
+
+static bool read_full(int fd, void *buf, size_t n)
+{
+	char *p = static_cast<char *>(buf);
+	while (n) {
+		const ssize_t r = read(fd, p, n);
+		if (r < 0)
+			fatal("read error");
+		if (r == 0)
+			return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+static void run_stream(srp_phat_stream_t &srp, int fd, double report_s)
+{
+	std::vector<int32_t> frames(srp.hop * NCHANNELS);
+	const size_t report_hops = std::max<size_t>(1, std::lround(report_s * SAMPLES_PER_SECOND / srp.hop));
+	size_t nhops = 0;
+
+	std::cout << std::fixed << std::setprecision(3);
+	while (read_full(fd, frames.data(), frames.size() * sizeof(frames[0]))) {
+		srp.push(frames.data());
+		if (++nhops % report_hops == 0) {
+			std::cout << double(nhops * srp.hop) / SAMPLES_PER_SECOND << " ";
+			std::cout << stand_angle_deg(srp.estimate()) << std::endl;
+		}
+	}
+}
+
+// Compare the cost of updating the cross spectra with a sliding DFT
+// and with a full recompute, for a range of hops.
+static void run_benchmark(double seconds, double time_constant_s)
+{
+	const size_t nframes = seconds * SAMPLES_PER_SECOND;
+	std::vector<int32_t> in(nframes * NCHANNELS);
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<int32_t> dist(-(1 << 28), 1 << 28);
+	for (auto &v : in)
+		v = dist(rng);
+
+	std::cout << std::fixed;
+	std::cout << std::setw(6) << "hop" << std::setw(16) << "sliding us/hop";
+	std::cout << std::setw(16) << "full us/hop" << std::setw(12) << "speedup";
+	std::cout << std::setw(16) << "sliding xRT" << std::setw(14) << "drift" << std::endl;
+	for (size_t hop = 1; hop <= TRACK_NFFT / 2; hop *= 4) {
+		double us[2];
+		double drift = 0;
+		for (int full = 0; full < 2; full++) {
+			srp_phat_stream_t srp(TRACK_NFFT, hop, hop_alpha(hop, time_constant_s), !full);
+			// Full recompute is slow for tiny hops. A second is enough.
+			const size_t nhops = (full ? std::min(nframes, size_t(SAMPLES_PER_SECOND)) : nframes) / hop;
+			auto t0 = std::chrono::steady_clock::now();
+			for (size_t h = 0; h < nhops; h++)
+				srp.push(&in[h * hop * NCHANNELS]);
+			auto t1 = std::chrono::steady_clock::now();
+			us[full] = std::chrono::duration<double, std::micro>(t1 - t0).count() / nhops;
+			if (!full)
+				drift = srp.drift();
+		}
+		std::cout << std::setw(6) << hop;
+		std::cout << std::setw(16) << std::setprecision(3) << us[0];
+		std::cout << std::setw(16) << us[1];
+		std::cout << std::setw(12) << std::setprecision(1) << us[1] / us[0];
+		std::cout << std::setw(16) << std::setprecision(1) << hop * 1e6 / SAMPLES_PER_SECOND / us[0];
+		std::cout << std::setw(14) << std::scientific << std::setprecision(2) << drift;
+		std::cout << std::fixed << std::endl;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: track-doa [-H HOP] [-t TIME_CONSTANT_S] [-r REPORT_S] [-f] [-B SECONDS] [INPUT]";
+	size_t hop = 16;
+	double time_constant_s = 0.2, report_s = 0.1, bench_s = 0;
+	bool full = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "H:t:r:fB:")) != -1) {
+		switch (opt) {
+		case 'H':
+			hop = std::atol(optarg);
+			break;
+		case 't':
+			time_constant_s = std::atof(optarg);
+			break;
+		case 'r':
+			report_s = std::atof(optarg);
+			break;
+		case 'f':
+			full = true;
+			break;
+		case 'B':
+			bench_s = std::atof(optarg);
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind > 1 || time_constant_s <= 0 || bench_s < 0)
+		fatal(usage);
+
+	if (bench_s) {
+		run_benchmark(bench_s, time_constant_s);
+		return EXIT_SUCCESS;
+	}
+
+	int fd = STDIN_FILENO;
+	if (argc - optind == 1 && (fd = open(argv[optind], O_RDONLY)) < 0)
+		fatal(std::string("could not open ") + argv[optind]);
+	const bool sliding = !full && hop <= TRACK_SLIDING_MAX_HOP;
+	srp_phat_stream_t srp(TRACK_NFFT, hop, hop_alpha(hop, time_constant_s), sliding);
+	run_stream(srp, fd, report_s);
+
+	return EXIT_SUCCESS;
+}
@@ -8,18 +8,46 @@
 #
 # Example invocation:
 #    $ ./train.py -i dataset-directory -o model.h5
+#
+# For a sharded dataset, a subset can be selected with a query:
+#    $ ./train.py -i dataset-directory -o model.h5 -s 'elev=0.0,distance=1.0'
+#
+# Train the rotation-equivariant model, using only the unrotated datasets:
+#    $ ./train.py -i dataset-directory -o model.h5 -m equivariant
+#
+# Train within a wall-clock budget of 90 minutes. The length of the epochs,
+# and the size of the validation subsample, are fitted to the measured speed:
+#    $ ./train.py -i dataset-directory -o model.h5 -T 90
+#
+# Hyperparameters can be given on the command line, and a summary of the
+# results written for sweep.py:
+#    $ ./train.py -i dataset-directory -o model.h5 -b 128 -l 0.0003 -r results.json
+#
+# Distill a trained model into a small student model. The teacher's outputs
+# are computed once, and cached next to the index of the sharded dataset:
+#    $ ./train.py -i dataset-directory -o student.h5 -t model.h5
+#
+# Draw each epoch from a quarter of the records of a sharded dataset,
+# preferring those with a high loss:
+#    $ ./train.py -i dataset-directory -o model.h5 -x 0.25
 
 import numpy as np
 import argparse
 import random
 import glob
 import json
+import time
+import subprocess
+import tempfile
 import sys
 import os
 
 import tensorflow as tf
 from tensorflow import keras
 
+import dataset_index
+import doa_layers
+
 # Percentage of samples to use for validation
 VALID_SPLIT = 0.1
 BATCH_SIZE = 32
@@ -34,6 +62,35 @@ SAMPLES_PER_SECOND = 24000;
 # Neural Network's input parameters.
 DATASET_NSAMPLES = 512;
 
+# Angle classes of the rotation-equivariant model, one per stand marking.
+EQUIVARIANT_NANGLES = 64
+
+# Time-budgeted training parameters. The budget is split into about that
+# many epochs, each ending with a validation on a random subsample, with
+# that fraction of the time spent validating and saving checkpoints.
+BUDGET_NEPOCHS = 25
+BUDGET_VALID_FRACTION = 0.1
+BUDGET_CHECKPOINT_FRACTION = 0.02
+# Training steps of the first epoch, which measures the speed. The first
+# steps include tracing the graph, so they are not counted.
+BUDGET_CALIBRATION_STEPS = 100
+BUDGET_WARMUP_STEPS = 5
+
+# Knowledge distillation parameters. The loss is a mix of the cross
+# entropy with the true labels, and with the teacher's outputs softened
+# by the temperature.
+DISTILL_TEMPERATURE = 4.0
+DISTILL_HARD_WEIGHT = 0.1
+# Hidden units of the student model. Keeps it under 200K parameters.
+STUDENT_NUNITS = 40
+
+# Hard-example sampling parameters. This fraction of each epoch is drawn
+# uniformly, which bounds the importance weights, and keeps refreshing the
+# loss estimates of the easy records.
+HARD_UNIFORM_FRACTION = 0.2
+# Positions in the training split are passed as float32 labels.
+HARD_MAX_RECORDS = 2**24
+
 class train_state:
     def __init__(self):
         self.class_names = None
@@ -43,6 +100,48 @@ class train_state:
         self.train_ds = None
         self.validation_ds = None
         self.model_filename = None
+        self.model_type = 'dense'
+        self.batch_size = BATCH_SIZE
+        self.learning_rate = 0.001
+        self.teacher_filename = None
+        # Wall-clock training budget in seconds, or None for no limit.
+        self.time_budget = None
+        # Wall time of each training epoch, in seconds.
+        self.epoch_times = []
+        # Of the final model, measured with the training loss and labels.
+        self.val_accuracy = None
+        # Validation records and the teacher's log probabilities for them.
+        self.valid_labels = None
+        self.valid_teacher = None
+        # Fraction of the training records drawn per epoch by the
+        # HardExampleSampler, or None to shuffle them all.
+        self.hard_examples = None
+        self.sampler = None
+
+def equivariant_class_names():
+    """Classes of the equivariant model, in the order its outputs require."""
+    names = ['{:1.3f}'.format(i * 360.0 / EQUIVARIANT_NANGLES) for i in range(EQUIVARIANT_NANGLES)]
+    return names + ['silence']
+
+def is_unrotated_class(name):
+    """Whether the class is recorded directly, i.e. not by rotating the mics."""
+    return name == 'silence' or float(name) < 360.0 / NCHANNELS
+
+def unrotated_classes(dataset_classes):
+    """The unrotated dataset classes, which must all be outputs of the equivariant model."""
+    class_names = equivariant_class_names()
+    unrotated = []
+    for name in dataset_classes:
+        try:
+            if not is_unrotated_class(name):
+                continue
+        except ValueError:
+            pass
+        if name not in class_names:
+            print('ERROR: Class "{}" is not one of the {} angles of the equivariant model, formatted as {{:1.3f}}, nor silence.'.format(name, EQUIVARIANT_NANGLES))
+            sys.exit(1)
+        unrotated.append(name)
+    return unrotated
 
 def build_model(input_shape, num_classes):
     inputs = keras.layers.Input(shape=input_shape, name="input")
@@ -55,15 +154,233 @@ def build_model(input_shape, num_classes):
 
     return keras.models.Model(inputs=inputs, outputs=outputs)
 
+def build_student_model(input_shape, num_classes):
+    """Small model to distill a teacher into."""
+    inputs = keras.layers.Input(shape=input_shape, name="input")
+
+    x = keras.layers.Flatten()(inputs)
+    x = keras.layers.Dense(STUDENT_NUNITS, activation="relu")(x)
+
+    outputs = keras.layers.Dense(num_classes, activation="softmax", name="output")(x)
+
+    return keras.models.Model(inputs=inputs, outputs=outputs)
+
+def build_equivariant_model(input_shape, num_classes):
+    """Model whose outputs rotate along with a circular shift of the mics.
+
+    Weights are shared across the 8 rotations, so it can be trained only
+    on the unrotated datasets."""
+    nangles_per_mic = (num_classes - 1) // NCHANNELS
+    inputs = keras.layers.Input(shape=input_shape, name="input")
+
+    x = keras.layers.Reshape((DATASET_NSAMPLES, NCHANNELS))(inputs)
+    x = doa_layers.Denormalize()(x)
+    x = keras.layers.Reshape((DATASET_NSAMPLES, NCHANNELS, 1))(x)
+    x = doa_layers.MicCircularConv(16, kernel_time=8, stride=4, activation="relu")(x)
+    x = doa_layers.MicCircularConv(32, kernel_time=8, stride=4, activation="relu")(x)
+    x = doa_layers.MicCircularConv(32, kernel_time=8, stride=4, activation="relu")(x)
+    x = doa_layers.MicDense(nangles_per_mic + 1)(x)
+    x = doa_layers.EquivariantHead()(x)
+
+    outputs = keras.layers.Activation("softmax", name="output")(x)
+
+    return keras.models.Model(inputs=inputs, outputs=outputs)
+
+def distillation_loss(y_true, y_pred):
+    """y_true is the label, followed by the teacher's log probabilities."""
+    labels = tf.cast(y_true[:, 0], tf.int32)
+    hard = keras.losses.sparse_categorical_crossentropy(labels, y_pred)
+    teacher = tf.nn.softmax(y_true[:, 1:] / DISTILL_TEMPERATURE)
+    student = tf.nn.softmax(tf.math.log(y_pred + 1e-7) / DISTILL_TEMPERATURE)
+    soft = keras.losses.kl_divergence(teacher, student) * DISTILL_TEMPERATURE**2
+    return DISTILL_HARD_WEIGHT * hard + (1 - DISTILL_HARD_WEIGHT) * soft
+
+def distillation_accuracy(y_true, y_pred):
+    return keras.metrics.sparse_categorical_accuracy(y_true[:, :1], y_pred)
+
+class HardExampleSampler:
+    """Per-record loss estimates of the training split, and epochs drawn
+    according to them.
+
+    The estimate of a record is its loss in the forward pass of the last
+    training step it took part in. Each epoch draws records with a
+    probability proportional to their loss, mixed with a uniform one, and
+    weighs them by its inverse, so that the expected gradient is still
+    that of the whole split."""
+    def __init__(self, nrecords, nclasses, fraction, label_width):
+        if nrecords > HARD_MAX_RECORDS:
+            raise ValueError('too many training records for hard-example sampling')
+        self.nrecords = nrecords
+        self.epoch_size = max(1, int(nrecords * fraction))
+        # Width of the labels, before the record positions are prepended.
+        self.label_width = label_width
+        # Records not yet seen are as hard as a uniform guess.
+        self.losses = tf.Variable(np.full(nrecords, np.log(nclasses), dtype=np.float32), trainable=False)
+        self.rng = np.random.default_rng(SHUFFLE_SEED)
+
+    def draw_epoch(self):
+        """Positions of the records of an epoch in the split, and their
+        importance weights."""
+        loss = np.maximum(self.losses.numpy(), 0)
+        p = (1 - HARD_UNIFORM_FRACTION) * loss / max(loss.sum(), 1e-12) + HARD_UNIFORM_FRACTION / self.nrecords
+        p /= p.sum()
+        pos = self.rng.choice(self.nrecords, size=self.epoch_size, p=p)
+        weights = 1 / p[pos]
+        return pos, (weights / weights.mean()).astype(np.float32)
+
+    def is_training(self, y_true):
+        # Only the training labels are preceded by the record positions.
+        return y_true.shape.rank == 2 and y_true.shape[1] == self.label_width + 1
+
+    def tracked_loss(self, loss_fn):
+        """Wraps a loss function, to also record the loss of each training
+        record."""
+        def loss(y_true, y_pred):
+            if not self.is_training(y_true):
+                return loss_fn(y_true, y_pred)
+            per_record = loss_fn(y_true[:, 1:], y_pred)
+            pos = tf.cast(y_true[:, 0], tf.int64)
+            self.losses.scatter_nd_update(pos[:, None], tf.stop_gradient(per_record))
+            return per_record
+        return loss
+
+    def untracked(self, metric_fn):
+        """Wraps a metric function, to skip the record positions."""
+        def metric(y_true, y_pred):
+            if self.is_training(y_true):
+                y_true = y_true[:, 1:]
+            return metric_fn(y_true, y_pred)
+        return metric
+
+class EpochTimer(keras.callbacks.Callback):
+    def __init__(self, trst):
+        super().__init__()
+        self.trst = trst
+
+    def on_epoch_begin(self, epoch, logs=None):
+        self.t0 = time.monotonic()
+
+    def on_epoch_end(self, epoch, logs=None):
+        self.trst.epoch_times.append(time.monotonic() - self.t0)
+
+class StepTimer(keras.callbacks.Callback):
+    """Measures the speed of training and evaluation, in batches per second."""
+    def __init__(self):
+        super().__init__()
+        self.times = []
+
+    def on_train_begin(self, logs=None):
+        self.times.append(time.monotonic())
+
+    def on_test_begin(self, logs=None):
+        self.times.append(time.monotonic())
+
+    def on_train_batch_end(self, batch, logs=None):
+        self.times.append(time.monotonic())
+
+    def on_test_batch_end(self, batch, logs=None):
+        self.times.append(time.monotonic())
+
+    def steps_per_s(self):
+        t = self.times[min(BUDGET_WARMUP_STEPS, len(self.times) - 2):]
+        return (len(t) - 1) / max(t[-1] - t[0], 1e-6)
+
+class BudgetCallback(keras.callbacks.Callback):
+    """Stops training before the deadline, and saves the best model every
+    few epochs."""
+    def __init__(self, filename, deadline, checkpoint_epochs):
+        super().__init__()
+        self.filename = filename
+        self.deadline = deadline
+        self.checkpoint_epochs = checkpoint_epochs
+        self.best = -1
+        self.longest_epoch_s = 0
+
+    def on_epoch_begin(self, epoch, logs=None):
+        self.t0 = time.monotonic()
+
+    def on_epoch_end(self, epoch, logs=None):
+        now = time.monotonic()
+        self.longest_epoch_s = max(self.longest_epoch_s, now - self.t0)
+        accuracy = logs.get('val_accuracy', 0)
+        if epoch % self.checkpoint_epochs == 0 and accuracy > self.best:
+            self.best = accuracy
+            self.model.save(self.filename)
+        if now + self.longest_epoch_s > self.deadline:
+            print("\nStopping, as another epoch would exceed the time budget.")
+            self.model.stop_training = True
+
+def plan_budget(trst, model, deadline):
+    """Runs a short first epoch to measure the speed, and returns the
+    arguments of model.fit that fit the rest of the training in the budget."""
+    train_ds = trst.train_ds.repeat()
+    valid_ds = trst.validation_ds.repeat()
+    train_steps = int(trst.train_ds.cardinality())
+    valid_steps = int(trst.validation_ds.cardinality())
+
+    train_timer = StepTimer()
+    model.fit(train_ds, epochs=1, steps_per_epoch=min(BUDGET_CALIBRATION_STEPS, train_steps),
+              callbacks=[train_timer, EpochTimer(trst)])
+    valid_timer = StepTimer()
+    model.evaluate(valid_ds, steps=min(BUDGET_CALIBRATION_STEPS // 4, valid_steps),
+                   callbacks=[valid_timer], verbose=0)
+    t0 = time.monotonic()
+    model.save(trst.model_filename)
+    save_s = time.monotonic() - t0
+    train_rate = train_timer.steps_per_s()
+    valid_rate = valid_timer.steps_per_s()
+
+    # Keep time for the final validation on the whole split.
+    remaining = deadline - time.monotonic() - valid_steps / valid_rate
+    if remaining <= 0:
+        return None
+    epoch_s = min(remaining / BUDGET_NEPOCHS,
+                  train_steps / train_rate / (1 - BUDGET_VALID_FRACTION))
+    epoch_valid_steps = int(min(valid_steps, max(1, epoch_s * BUDGET_VALID_FRACTION * valid_rate)))
+    epoch_train_steps = int(min(train_steps, max(1, (epoch_s - epoch_valid_steps / valid_rate) * train_rate)))
+    nepochs = max(1, int(remaining / epoch_s))
+    checkpoint_epochs = max(1, int(np.ceil(nepochs * save_s / (remaining * BUDGET_CHECKPOINT_FRACTION))))
+
+    print("Training speed {:.1f} steps/s, validation {:.1f} steps/s, saving {:.1f} s.".format(
+        train_rate, valid_rate, save_s))
+    print("Planned {} epochs of {} of {} steps, validating on {} of {} steps, checkpoint every {} epochs.".format(
+        nepochs, epoch_train_steps, train_steps, epoch_valid_steps, valid_steps, checkpoint_epochs))
+    return {
+        'x': train_ds,
+        'validation_data': valid_ds,
+        'initial_epoch': 1,
+        'epochs': 1 + nepochs,
+        'steps_per_epoch': epoch_train_steps,
+        'validation_steps': epoch_valid_steps,
+        'callbacks': [BudgetCallback(trst.model_filename, deadline, checkpoint_epochs)],
+    }
+
 def do_training(trst):
-    model = build_model((NCHANNELS * DATASET_NSAMPLES, 1), len(trst.class_names))
+    deadline = time.monotonic() + trst.time_budget if trst.time_budget else None
+    if trst.model_type == 'equivariant':
+        model = build_equivariant_model((NCHANNELS * DATASET_NSAMPLES, 1), len(trst.class_names))
+    elif trst.model_type == 'student':
+        model = build_student_model((NCHANNELS * DATASET_NSAMPLES, 1), len(trst.class_names))
+    else:
+        model = build_model((NCHANNELS * DATASET_NSAMPLES, 1), len(trst.class_names))
     model.summary()
 
-    # Compile the model using Adam's default learning rate
-    opt = keras.optimizers.Adam(learning_rate=0.001)
-    model.compile(
-        optimizer=opt, loss="sparse_categorical_crossentropy", metrics=["accuracy"]
-    )
+    opt = keras.optimizers.Adam(learning_rate=trst.learning_rate)
+    if trst.sampler:
+        if trst.teacher_filename:
+            loss, accuracy = distillation_loss, distillation_accuracy
+        else:
+            loss = keras.losses.sparse_categorical_crossentropy
+            accuracy = keras.metrics.sparse_categorical_accuracy
+        model.compile(optimizer=opt, loss=trst.sampler.tracked_loss(loss),
+            metrics=[keras.metrics.MeanMetricWrapper(trst.sampler.untracked(accuracy), name='accuracy')])
+    elif trst.teacher_filename:
+        model.compile(optimizer=opt, loss=distillation_loss,
+            metrics=[keras.metrics.MeanMetricWrapper(distillation_accuracy, name='accuracy')])
+    else:
+        model.compile(
+            optimizer=opt, loss="sparse_categorical_crossentropy", metrics=["accuracy"]
+        )
 
     # Add callbacks:
     # 'EarlyStopping' to stop training when the model is not enhancing anymore
@@ -77,14 +394,29 @@ def do_training(trst):
         trst.model_filename, monitor="val_accuracy", save_best_only=True
     )
 
-    history = model.fit(
-        trst.train_ds,
-        epochs=EPOCHS,
-        validation_data=trst.validation_ds,
-        callbacks=[earlystopping_cb, mdlcheckpoint_cb],
-    )
-    print(model.evaluate(trst.validation_ds))
+    if deadline:
+        fit_args = plan_budget(trst, model, deadline)
+        if fit_args:
+            fit_args['callbacks'] += [earlystopping_cb, EpochTimer(trst)]
+            history = model.fit(**fit_args)
+        else:
+            print("WARNING: The time budget is too short for more than one epoch.")
+    else:
+        history = model.fit(
+            trst.train_ds,
+            epochs=EPOCHS,
+            validation_data=trst.validation_ds,
+            callbacks=[earlystopping_cb, mdlcheckpoint_cb, EpochTimer(trst)],
+        )
+    # The validation labels may carry the teacher outputs, which only the
+    # training loss and metric understand, so evaluate before recompiling.
+    val_loss, trst.val_accuracy = model.evaluate(trst.validation_ds)
+    print([val_loss, trst.val_accuracy])
+    if trst.teacher_filename or trst.sampler:
+        # Do not require the custom loss for loading the model.
+        model.compile(loss="sparse_categorical_crossentropy", metrics=["accuracy"])
     model.save(trst.model_filename)
+    return model
 
 def path_to_audio(path):
     """Reads a raw audio file."""
@@ -103,13 +435,170 @@ def paths_and_labels_to_dataset(audio_paths, labels):
     label_ds = tf.data.Dataset.from_tensor_slices(labels)
     return tf.data.Dataset.zip((audio_ds, label_ds))
 
+def index_to_dataset(idx, indices, labels, batch_size, teacher=None):
+    """Constructs a dataset of audios and labels, read directly from the shards.
+
+    With the teacher's log probabilities for all the index records, each
+    label is followed by those of its record, for the distillation loss."""
+    def gather(batch_indices):
+        return idx.read_records(batch_indices).astype(np.float32) / 2**31
+    def gather_soft(batch_indices, batch_labels):
+        soft = teacher[batch_indices].astype(np.float32)
+        return np.concatenate([batch_labels[:, None].astype(np.float32), soft], axis=1)
+
+    ds = tf.data.Dataset.from_tensor_slices((indices, labels))
+    if idx.shuffled:
+        # The records were shuffled across the shards by prepare-data. Read
+        # each batch sequentially, and shuffle only the order of batches.
+        ds = ds.batch(batch_size)
+        ds = ds.shuffle(buffer_size=(len(indices) + batch_size - 1) // batch_size, seed=SHUFFLE_SEED)
+    else:
+        # Shuffling record numbers is cheap, so do it over the whole set.
+        ds = ds.shuffle(buffer_size=len(indices), seed=SHUFFLE_SEED).batch(batch_size)
+    def load(i, l):
+        x = tf.ensure_shape(tf.numpy_function(gather, [i], tf.float32),
+                            [None, NCHANNELS * DATASET_NSAMPLES])
+        if teacher is not None:
+            l = tf.ensure_shape(tf.numpy_function(gather_soft, [i, l], tf.float32),
+                                [None, teacher.shape[1] + 1])
+        return x, l
+    ds = ds.map(load, num_parallel_calls=tf.data.AUTOTUNE)
+    return ds
+
+def sampled_index_to_dataset(idx, indices, labels, batch_size, sampler, teacher=None):
+    """Like index_to_dataset(), but each epoch is drawn by the sampler.
+
+    The labels are preceded by the positions of the records in indices,
+    and each batch carries the importance weights of its records."""
+    def batches():
+        pos, weights = sampler.draw_epoch()
+        for i in range(0, len(pos), batch_size):
+            yield pos[i:i + batch_size], weights[i:i + batch_size]
+    def gather(batch_pos):
+        return idx.read_records(indices[batch_pos]).astype(np.float32) / 2**31
+    def gather_labels(batch_pos):
+        y = [batch_pos[:, None], labels[batch_pos][:, None]]
+        if teacher is not None:
+            y.append(teacher[indices[batch_pos]])
+        return np.concatenate(y, axis=1).astype(np.float32)
+
+    ds = tf.data.Dataset.from_generator(batches, output_signature=(
+            tf.TensorSpec(shape=[None], dtype=tf.int64), tf.TensorSpec(shape=[None], dtype=tf.float32)))
+    # The generator is called again for each epoch.
+    nbatches = (sampler.epoch_size + batch_size - 1) // batch_size
+    ds = ds.apply(tf.data.experimental.assert_cardinality(nbatches))
+    def load(p, w):
+        x = tf.ensure_shape(tf.numpy_function(gather, [p], tf.float32),
+                            [None, NCHANNELS * DATASET_NSAMPLES])
+        y = tf.ensure_shape(tf.numpy_function(gather_labels, [p], tf.float32),
+                            [None, sampler.label_width + 1])
+        return x, y, w
+    return ds.map(load, num_parallel_calls=tf.data.AUTOTUNE)
+
+def teacher_cache_filenames(input_dirname, teacher_filename):
+    base = os.path.join(input_dirname, 'teacher-' + os.path.splitext(os.path.basename(teacher_filename))[0])
+    return base + '.npy', base + '.json'
+
+def load_teacher_outputs(idx, input_dirname, teacher_filename, class_names):
+    """Log probabilities of the teacher for all the index records.
+
+    They are computed once, and cached next to the dataset index. The
+    cache is tied to the teacher model file and to the index file by their
+    sizes and times, so a regenerated dataset, even with as many records,
+    gets new outputs. The .json file is written last, once the outputs
+    are complete."""
+    npy_filename, json_filename = teacher_cache_filenames(input_dirname, teacher_filename)
+    st = os.stat(teacher_filename)
+    index_st = os.stat(os.path.join(input_dirname, dataset_index.INDEX_FILENAME))
+    meta = {'teacher': os.path.abspath(teacher_filename), 'size': st.st_size,
+            'mtime': st.st_mtime, 'nrecords': len(idx), 'class_names': class_names,
+            'index_size': index_st.st_size, 'index_mtime_ns': index_st.st_mtime_ns}
+    if os.path.exists(json_filename) and os.path.exists(npy_filename):
+        with open(json_filename, 'r') as f:
+            if json.load(f) == meta:
+                print("Using the cached teacher outputs in {}.".format(npy_filename))
+                return np.load(npy_filename, mmap_mode='r')
+
+    print("Computing the teacher outputs for {} records.".format(len(idx)))
+    if os.path.exists(json_filename):
+        os.remove(json_filename)
+    teacher = keras.models.load_model(teacher_filename, custom_objects=doa_layers.custom_objects())
+    tmp_filename = npy_filename + '.tmp'
+    out = np.lib.format.open_memmap(tmp_filename, mode='w+', dtype=np.float16,
+                                    shape=(len(idx), len(class_names)))
+    t0 = time.monotonic()
+    for i in range(0, len(idx), 4096):
+        indices = np.arange(i, min(i + 4096, len(idx)))
+        x = idx.read_records(indices).astype(np.float32) / 2**31
+        p = teacher.predict(x.reshape(len(x), -1, 1), batch_size=256, verbose=0)
+        out[indices] = np.log(np.maximum(p, 1e-7))
+    out.flush()
+    del out
+    os.replace(tmp_filename, npy_filename)
+    print("Computed the teacher outputs in {:.1f} s.".format(time.monotonic() - t0))
+    with open(json_filename + '.tmp', 'w') as f:
+        json.dump(meta, f)
+    os.replace(json_filename + '.tmp', json_filename)
+    return np.load(npy_filename, mmap_mode='r')
+
+def prepare_indexed_datasets(trst, input_dirname, query):
+    idx = dataset_index.DatasetIndex(input_dirname)
+    dataset_classes = idx.attr_values('class')
+    teacher = None
+    if trst.teacher_filename:
+        # The student learns the teacher's classes.
+        trst.class_names = load_class_names(os.path.splitext(trst.teacher_filename)[0] + '.json')
+        dataset_classes = [n for n in dataset_classes if n in trst.class_names]
+        query += ',class=' + '|'.join(dataset_classes)
+        teacher = load_teacher_outputs(idx, input_dirname, trst.teacher_filename, trst.class_names)
+    elif trst.model_type == 'equivariant':
+        trst.class_names = equivariant_class_names()
+        dataset_classes = unrotated_classes(dataset_classes)
+        query += ',class=' + '|'.join(dataset_classes)
+    else:
+        trst.class_names = dataset_classes
+    # Map the index's class value IDs to the model's output classes.
+    label_map = np.full(len(idx.attr_values('class')), -1)
+    for name in dataset_classes:
+        label_map[idx.attr_values('class').index(name)] = trst.class_names.index(name)
+
+    # The split is decided by prepare-data, so that all the rotated
+    # variants of a chunk end up in the same split.
+    train_indices = idx.query(query + ',split=train')
+    valid_indices = idx.query(query + ',split=valid')
+    print("Found {} records belonging to {} classes.".format(len(train_indices) + len(valid_indices), len(trst.class_names)))
+    print("Using {} records for training.".format(len(train_indices)))
+    print("Using {} records for validation.".format(len(valid_indices)))
+
+    train_labels = label_map[idx.attr_ids('class', train_indices)]
+    if trst.hard_examples:
+        label_width = 1 if teacher is None else teacher.shape[1] + 1
+        trst.sampler = HardExampleSampler(len(train_indices), len(trst.class_names), trst.hard_examples, label_width)
+        print("Drawing {} records per epoch, preferring those with a high loss.".format(trst.sampler.epoch_size))
+        trst.train_ds = sampled_index_to_dataset(idx, train_indices, train_labels, trst.batch_size, trst.sampler, teacher)
+    else:
+        trst.train_ds = index_to_dataset(idx, train_indices, train_labels, trst.batch_size, teacher)
+    trst.validation_ds = index_to_dataset(idx, valid_indices, label_map[idx.attr_ids('class', valid_indices)], trst.batch_size, teacher)
+    if teacher is not None:
+        trst.valid_labels = label_map[idx.attr_ids('class', valid_indices)]
+        trst.valid_teacher = teacher[valid_indices]
+
+    trst.train_ds = trst.train_ds.prefetch(tf.data.AUTOTUNE)
+    trst.validation_ds = trst.validation_ds.prefetch(tf.data.AUTOTUNE)
+
 def prepare_datasets(trst, input_dirname):
     # We'll classify per angle of arrival and silence.
     # For now the elevation and distance will not be taken into account.
-    trst.class_names = os.listdir(input_dirname)
+    dataset_classes = os.listdir(input_dirname)
+    if trst.model_type == 'equivariant':
+        trst.class_names = equivariant_class_names()
+        dataset_classes = unrotated_classes(dataset_classes)
+    else:
+        trst.class_names = dataset_classes
 
     # Enumerate the available datasets.
-    for label, name in enumerate(trst.class_names):
+    for name in dataset_classes:
+        label = trst.class_names.index(name)
         print("Processing dataset {}".format(name,))
         dirpath = os.path.join(input_dirname, name)
         fpaths = glob.glob(dirpath + '/**/*raw_*', recursive=True)
@@ -135,14 +624,63 @@ def prepare_datasets(trst, input_dirname):
 
     # Create 2 datasets, one for training and the other for validation
     trst.train_ds = paths_and_labels_to_dataset(train_ds_paths, train_labels)
-    trst.train_ds = trst.train_ds.shuffle(buffer_size=BATCH_SIZE * 8, seed=SHUFFLE_SEED).batch(BATCH_SIZE)
+    trst.train_ds = trst.train_ds.shuffle(buffer_size=trst.batch_size * 8, seed=SHUFFLE_SEED).batch(trst.batch_size)
 
     trst.validation_ds = paths_and_labels_to_dataset(valid_ds_paths, valid_labels)
-    trst.validation_ds = trst.validation_ds.shuffle(buffer_size=BATCH_SIZE * 8, seed=SHUFFLE_SEED).batch(BATCH_SIZE)
+    trst.validation_ds = trst.validation_ds.shuffle(buffer_size=trst.batch_size * 8, seed=SHUFFLE_SEED).batch(trst.batch_size)
     
     trst.train_ds = trst.train_ds.prefetch(tf.data.AUTOTUNE)
     trst.validation_ds = trst.validation_ds.prefetch(tf.data.AUTOTUNE)
 
+def load_class_names(input_filename):
+    with open(input_filename, 'r') as f:
+        return json.load(f)['class_names']
+
+def native_latency_us(model_filename, nsamples=256):
+    """Per-sample latency of the model with the native engine, on one thread.
+
+    Returns None if the engine library is not built."""
+    ml_dir = os.path.dirname(os.path.abspath(__file__))
+    if not os.path.exists(os.path.join(ml_dir, 'libnn-engine.so')):
+        return None
+    import nn_engine
+    with tempfile.TemporaryDirectory() as tmpdir:
+        nn_filename = os.path.join(tmpdir, 'model.nn')
+        subprocess.run([os.path.join(ml_dir, 'export-model.py'), '-m', model_filename,
+                        '-o', nn_filename], check=True, stdout=subprocess.DEVNULL)
+        model = nn_engine.NativeModel(nn_filename, nthreads=1)
+    records = np.random.RandomState(SHUFFLE_SEED).randint(
+            -2**24, 2**24, size=(nsamples, model.input_size), dtype=np.int32)
+    model.predict_records(records[:8])
+    t0 = time.monotonic()
+    model.predict_records(records)
+    return (time.monotonic() - t0) * 1e6 / nsamples
+
+def report_distillation(trst, student):
+    teacher_acc = np.mean(np.argmax(trst.valid_teacher, axis=1) == trst.valid_labels)
+    student_acc = trst.val_accuracy
+    teacher = keras.models.load_model(trst.teacher_filename, custom_objects=doa_layers.custom_objects())
+    print("Validation accuracy: teacher {:.2f}%, student {:.2f}%".format(teacher_acc * 100, student_acc * 100))
+    print("Parameters: teacher {}, student {}".format(teacher.count_params(), student.count_params()))
+    teacher_us = native_latency_us(trst.teacher_filename)
+    student_us = native_latency_us(trst.model_filename)
+    if teacher_us is None or student_us is None:
+        print("Build libnn-engine.so to also compare the native engine latency.")
+    else:
+        print("Native engine latency: teacher {:.1f} us, student {:.1f} us".format(teacher_us, student_us))
+
+def save_results(trst, model, output_filename):
+    """Summary of the training run, in JSON."""
+    root = {
+        "val_accuracy": trst.val_accuracy,
+        "epochs": len(trst.epoch_times),
+        "epoch_s": float(np.mean(trst.epoch_times)) if trst.epoch_times else None,
+        "params": model.count_params(),
+        "latency_us": native_latency_us(trst.model_filename),
+    }
+    with open(output_filename, 'w') as o:
+        json.dump(root, o)
+
 def save_class_names(trst, output_filename):
     root = {"class_names" : trst.class_names}
     root_str = json.dumps(root)
@@ -158,8 +696,33 @@ def main():
         help = 'File to write the final model.')
     parser.add_argument('-d', '--debug', required=False,
         help = 'Directory to write debug TF logs to.')
+    parser.add_argument('-s', '--select', required=False, default='',
+        help = 'Query to select a subset of a sharded dataset, e.g. "elev=0.0,distance=1.0".')
+    parser.add_argument('-m', '--model-type', required=False,
+        choices=['dense', 'equivariant', 'student'],
+        help = 'Model architecture. The equivariant one is trained only on unrotated datasets.'
+               ' Default is dense, or student when distilling.')
+    parser.add_argument('-t', '--teacher', required=False,
+        help = 'Trained model to distill into the new one. Requires a sharded dataset.')
+    parser.add_argument('-b', '--batch-size', required=False, type=int, default=BATCH_SIZE,
+        help = 'Training batch size.')
+    parser.add_argument('-l', '--learning-rate', required=False, type=float, default=0.001,
+        help = 'Learning rate of the Adam optimizer.')
+    parser.add_argument('-j', '--threads', required=False, type=int,
+        help = 'Number of threads for TensorFlow. Default is all cores.')
+    parser.add_argument('-T', '--time-budget', required=False, type=float,
+        help = 'Wall-clock budget for the training, in minutes.')
+    parser.add_argument('-x', '--hard-examples', required=False, type=float,
+        help = 'Draw each epoch from this fraction of the training records, preferring those'
+               ' with a high loss, with importance weights. Requires a sharded dataset.')
+    parser.add_argument('-r', '--results', required=False,
+        help = 'JSON file to write the validation accuracy, epoch time and native latency to.')
     args = parser.parse_args()
 
+    if args.threads:
+        tf.config.threading.set_intra_op_parallelism_threads(args.threads)
+        tf.config.threading.set_inter_op_parallelism_threads(min(args.threads, 2))
+
     if args.debug is not None:
         tf.debugging.experimental.enable_dump_debug_info(
             args.debug,
@@ -168,15 +731,38 @@ def main():
 
     trst = train_state()
     trst.model_filename = args.output
-
-    prepare_datasets(trst, args.input)
+    trst.model_type = args.model_type or ('student' if args.teacher else 'dense')
+    trst.teacher_filename = args.teacher
+    trst.batch_size = args.batch_size
+    trst.learning_rate = args.learning_rate
+    trst.hard_examples = args.hard_examples
+    if args.time_budget:
+        trst.time_budget = args.time_budget * 60
+
+    if dataset_index.has_index(args.input):
+        prepare_indexed_datasets(trst, args.input, args.select)
+    elif args.select:
+        print('ERROR: Subset selection requires a sharded dataset.')
+        sys.exit(1)
+    elif args.teacher:
+        print('ERROR: Distillation requires a sharded dataset.')
+        sys.exit(1)
+    elif args.hard_examples:
+        print('ERROR: Hard-example sampling requires a sharded dataset.')
+        sys.exit(1)
+    else:
+        prepare_datasets(trst, args.input)
 
     # I'm not sure why there is no standard method to save
     # the output label strings in the model itself.
     # So save in a separate json file.
     save_class_names(trst, os.path.splitext(args.output)[0] + '.json')
 
-    do_training(trst)
+    model = do_training(trst)
+    if trst.teacher_filename:
+        report_distillation(trst, model)
+    if args.results:
+        save_results(trst, model, args.results)
 
     sys.exit(0)
 
@@ -0,0 +1,146 @@
+// SPDX-FileCopyrightText: 2022-2023 Dimitar Dimitrov <dimitar@dinux.eu>
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Verify the angle encoded in the filename of each raw microphone
+// recording, using a classical SRP-PHAT estimate.
+//
+// A misplaced stand or a swapped filename silently poisons a whole angle
+// class. This tool catches such mistakes before a lengthy training.
+// Only a sample of the valid chunks of each recording is analyzed, and
+// recordings are processed in parallel, so a whole campaign is checked
+// in a short time.
+//
+// Example invocation:
+//    $ ./verify-labels ./records
+//
+// Exit status is non-zero if any mismatch was detected.
+
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#include <unistd.h>
+
+#include "common.h"
+#include "raw-audio.h"
+#include "srp-phat.h"
+
+// Chunk size to analyze. Matches the datasets.
+const int VERIFY_NSAMPLES = 512;
+
+// Number of chunks to inspect in each recording. Silent ones are skipped.
+const int VERIFY_SCAN_NCHUNKS = 512;
+
+// Maximum allowed difference between the label and the estimate.
+const double VERIFY_TOLERANCE_DEG = 2 * 360.0 / STAND_NANGLES;
+
+struct verify_result_t {
+	std::string fname;
+	double label_deg;
+	double estimate_deg;
+	size_t nchunks;
+	bool ok;
+};
+
+static double angle_diff_deg(double a, double b)
+{
+	double d = std::fmod(std::fabs(a - b), 360.0);
+	return d > 180.0 ? 360.0 - d : d;
+}
+
+static verify_result_t verify_recording(const std::string &fpath)
+{
+	verify_result_t r;
+	float elev, distance;
+
+	r.fname = fpath.substr(fpath.find_last_of('/') + 1);
+	float label;
+	if (!parse_recording_filename(r.fname, label, elev, distance))
+		fatal(r.fname + " has invalid filename.");
+	r.label_deg = label;
+
+	// Only a sparse subset of chunks is read.
+	auto m = raw_audio_t::open(fpath, MADV_RANDOM);
+	const off_t chunk_len = VERIFY_NSAMPLES * NCHANNELS;
+	const silence_params_t sp = train_silence(*m, chunk_len, fpath);
+
+	const off_t nchunks = (m->len - sp.data_scan_i) / chunk_len;
+	const off_t stride = std::max<off_t>(1, nchunks / VERIFY_SCAN_NCHUNKS);
+
+	srp_phat_t srp(VERIFY_NSAMPLES);
+	for (off_t ci = 0; ci < nchunks; ci += stride) {
+		const int32_t *chunk = m->samples(sp.data_scan_i + ci * chunk_len, chunk_len);
+		// Only the chunks with enough valid samples, i.e. with a
+		// sound to locate, whatever prepare-data makes of them.
+		if (count_valid_samples(sp, chunk, chunk_len) >= sp.nvals_threshold)
+			srp.accumulate(chunk);
+	}
+
+	r.nchunks = srp.num_chunks();
+	r.estimate_deg = stand_angle_deg(srp.estimate());
+	r.ok = r.nchunks > 0 && angle_diff_deg(r.label_deg, r.estimate_deg) <= VERIFY_TOLERANCE_DEG;
+
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	const std::string usage = "Usage: verify-labels [-j NTHREADS] <RAW_AUDIO_DIRECTORY>";
+	unsigned nthreads = std::max(1u, std::thread::hardware_concurrency());
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = std::max(1, std::atoi(optarg));
+			break;
+		default:
+			fatal(usage);
+		}
+	}
+	if (argc - optind != 1)
+		fatal(usage);
+
+	const std::vector<std::string> fpaths = find_recordings(std::string(argv[optind]) + "/output-*deg-*elev-*m");
+
+	// Recordings are independent, so simply hand them out to the workers.
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<verify_result_t> results(fpaths.size());
+	std::atomic<size_t> next {0};
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < nthreads; t++) {
+		workers.emplace_back([&]() {
+			for (size_t i; (i = next++) < fpaths.size(); )
+				results[i] = verify_recording(fpaths[i]);
+		});
+	}
+	for (auto &w : workers)
+		w.join();
+	auto t1 = std::chrono::steady_clock::now();
+
+	size_t nmismatches = 0;
+	for (const auto &r : results) {
+		std::ostringstream s;
+		s << (r.ok ? "OK       " : "MISMATCH ") << r.fname;
+		s << std::fixed << std::setprecision(3);
+		s << ": label " << r.label_deg << ", estimate " << r.estimate_deg;
+		s << " (" << r.nchunks << " chunks)";
+		std::cout << s.str() << std::endl;
+		if (!r.ok)
+			nmismatches++;
+	}
+	std::cout << "Verified " << results.size() << " recordings in ";
+	std::cout << std::chrono::duration<double>(t1 - t0).count() << " s, ";
+	std::cout << nmismatches << " mismatches." << std::endl;
+
+	return nmismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}